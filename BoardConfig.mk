@@ -76,6 +76,8 @@ TARGET_USES_ION := true
 HWUI_COMPILE_FOR_PERF := true
 #TARGET_RUNNING_WITHOUT_SYNC_FRAMEWORK := true
 COMMON_GLOBAL_CFLAGS += -DNEEDS_VECTORIMPL_SYMBOLS -DHAWAII_HWC
+# Rate limited OMX.brcm color format tracing in stagefright (patch/frameworks/av)
+#COMMON_GLOBAL_CFLAGS += -DBRCM_PATCH_TRACE
 
 # Opengl
 BOARD_USES_HWCOMPOSER := true
@@ -18,10 +18,56 @@
 #define LOG_TAG "AudioPolicyManager"
 //#define LOG_NDEBUG 0
 
+#include <cutils/properties.h>
+
 #include "AudioPolicyManager.h"
 
+// Time the HAL needs to switch the modem path to a new device. A voice
+// volume sent before that is lost with the old route.
+#define VOICE_ROUTE_SETTLE_MS 300
+
 namespace android_audio_legacy {
 
+AudioPolicyManager::AudioPolicyManager(AudioPolicyClientInterface *clientInterface)
+    : AudioPolicyManagerBase(clientInterface)
+{
+    // The HAL isn't known to run the low_latency stream next to the primary
+    // one, keep that profile out unless it is asked for
+    char value[PROPERTY_VALUE_MAX];
+    property_get("audio.hawaii.low_latency", value, "0");
+    if (strcmp(value, "1") != 0) {
+        dropFastOutputs();
+    }
+}
+
+void AudioPolicyManager::dropFastOutputs()
+{
+    for (size_t i = mOutputs.size(); i > 0; i--) {
+        AudioOutputDescriptor *desc = mOutputs.valueAt(i - 1);
+        if (desc->mProfile != NULL && isFastProfile(desc->mProfile)) {
+            ALOGV("dropFastOutputs() closing output %d", mOutputs.keyAt(i - 1));
+            closeOutput(mOutputs.keyAt(i - 1));
+        }
+    }
+    // and never reopen it when a device it covers is connected
+    for (size_t i = 0; i < mHwModules.size(); i++) {
+        Vector <IOProfile *> &profiles = mHwModules[i]->mOutputProfiles;
+        for (size_t j = profiles.size(); j > 0; j--) {
+            if (isFastProfile(profiles[j - 1])) {
+                delete profiles[j - 1];
+                profiles.removeAt(j - 1);
+            }
+        }
+    }
+    updateDevicesAndOutputs();
+}
+
+bool AudioPolicyManager::isFastProfile(const IOProfile *profile)
+{
+    return (profile->mFlags & AUDIO_OUTPUT_FLAG_FAST) &&
+            !(profile->mFlags & AUDIO_OUTPUT_FLAG_PRIMARY);
+}
+
 extern "C" AudioPolicyInterface* createAudioPolicyManager(AudioPolicyClientInterface *clientInterface)
 {
     return new AudioPolicyManager(clientInterface);
@@ -32,17 +78,105 @@ extern "C" void destroyAudioPolicyManager(AudioPolicyInterface *interface)
     delete interface;
 }
 
+audio_devices_t AudioPolicyManager::voiceDevice()
+{
+    AudioOutputDescriptor *outputDesc = mOutputs.valueFor(mPrimaryOutput);
+    return outputDesc != NULL ? outputDesc->device() : AUDIO_DEVICE_NONE;
+}
+
+float AudioPolicyManager::voiceVolumeFor(audio_devices_t device)
+{
+    // same as AudioPolicyManagerBase::checkAndSetVolume()
+    if (device & AUDIO_DEVICE_OUT_ALL_SCO) {
+        return 1.0f;
+    }
+    const StreamDescriptor &stream = mStreams[AudioSystem::VOICE_CALL];
+    return (float)stream.getVolumeIndex(getDeviceForVolume(device)) / (float)stream.mIndexMax;
+}
+
+void AudioPolicyManager::applyVoiceVolume(int delayMs)
+{
+    audio_devices_t device = voiceDevice();
+    if (device == AUDIO_DEVICE_NONE) {
+        return;
+    }
+
+    float volume = voiceVolumeFor(device);
+    ssize_t index = mVoiceVolumes.indexOfKey(device);
+    if (index >= 0 && mVoiceVolumes.valueAt(index) == volume) {
+        return;
+    }
+
+    ALOGV("applyVoiceVolume() %f on device %x in %d ms", volume, device, delayMs);
+    // queued on the AudioPolicyService command thread, the caller doesn't
+    // wait for the HAL
+    mpClientInterface->setVoiceVolume(volume, delayMs);
+    mLastVoiceVolume = volume;
+    mVoiceVolumes.add(device, volume);
+}
+
 void AudioPolicyManager::setPhoneState(int state)
 {
-    if (!isStateInCall(mPhoneState) && isStateInCall(state)) {
-		// On S7580, we need to reset mLastVoiceVolume every call start to force the
-		// volume to be always set since the HAL sometimes forget about it
-        ALOGV("Resetting mLastVoiceVolume");
-        mLastVoiceVolume = -1.0f;
+    bool callStart = !isStateInCall(mPhoneState) && isStateInCall(state);
+
+    // Call parent function
+    AudioPolicyManagerBase::setPhoneState(state);
+
+    if (callStart) {
+        // On S7580, the HAL forgets the voice volume between calls. Set it
+        // again once the call route is up instead of forcing it through
+        // the call setup.
+        mVoiceVolumes.clear();
+        applyVoiceVolume(VOICE_ROUTE_SETTLE_MS);
+    } else if (!isStateInCall(state)) {
+        mVoiceVolumes.clear();
     }
+}
+
+void AudioPolicyManager::setForceUse(AudioSystem::force_use usage,
+                                     AudioSystem::forced_config config)
+{
+    audio_devices_t oldDevice = voiceDevice();
+
+    AudioPolicyManagerBase::setForceUse(usage, config);
 
-	// Call parent function
-	AudioPolicyManagerBase::setPhoneState(state);
+    // earpiece <-> speaker <-> BT SCO switch during a call
+    if (isStateInCall(mPhoneState) && voiceDevice() != oldDevice) {
+        applyVoiceVolume(VOICE_ROUTE_SETTLE_MS);
+    }
+}
+
+status_t AudioPolicyManager::setDeviceConnectionState(audio_devices_t device,
+                                                      AudioSystem::device_connection_state state,
+                                                      const char *device_address)
+{
+    audio_devices_t oldDevice = voiceDevice();
+
+    status_t status = AudioPolicyManagerBase::setDeviceConnectionState(device, state,
+                                                                       device_address);
+
+    // headset or BT SCO (dis)connected during a call
+    if (isStateInCall(mPhoneState) && voiceDevice() != oldDevice) {
+        applyVoiceVolume(VOICE_ROUTE_SETTLE_MS);
+    }
+    return status;
+}
+
+status_t AudioPolicyManager::setStreamVolumeIndex(AudioSystem::stream_type stream,
+                                                  int index,
+                                                  audio_devices_t device)
+{
+    status_t status = AudioPolicyManagerBase::setStreamVolumeIndex(stream, index, device);
+
+    // the user changed the call volume, the parent function applied it
+    if (status == NO_ERROR && isStateInCall(mPhoneState) &&
+            (stream == AudioSystem::VOICE_CALL || stream == AudioSystem::BLUETOOTH_SCO)) {
+        audio_devices_t voice = voiceDevice();
+        if (voice != AUDIO_DEVICE_NONE) {
+            mVoiceVolumes.add(voice, mLastVoiceVolume);
+        }
+    }
+    return status;
 }
 
 }; // namespace android
@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <utils/KeyedVector.h>
 #include <hardware_legacy/AudioPolicyManagerBase.h>
 
 namespace android_audio_legacy {
@@ -27,10 +28,32 @@ class AudioPolicyManager: public AudioPolicyManagerBase
 {
 
 public:
-                AudioPolicyManager(AudioPolicyClientInterface *clientInterface)
-                : AudioPolicyManagerBase(clientInterface) {}
+                AudioPolicyManager(AudioPolicyClientInterface *clientInterface);
 
         virtual ~AudioPolicyManager() {}
+        virtual status_t setDeviceConnectionState(audio_devices_t device,
+                                                  AudioSystem::device_connection_state state,
+                                                  const char *device_address);
         virtual void setPhoneState(int state);
+        virtual void setForceUse(AudioSystem::force_use usage, AudioSystem::forced_config config);
+        virtual status_t setStreamVolumeIndex(AudioSystem::stream_type stream,
+                                              int index,
+                                              audio_devices_t device);
+
+private:
+        // device the voice call is routed to
+        audio_devices_t voiceDevice();
+        // voice volume the HAL should have for the call on device
+        float voiceVolumeFor(audio_devices_t device);
+        // sets the voice volume of the current call device after delayMs
+        // unless the HAL already has it
+        void applyVoiceVolume(int delayMs);
+        // closes the low_latency output and forgets its profile
+        void dropFastOutputs();
+        static bool isFastProfile(const IOProfile *profile);
+
+        // voice volume the HAL applied per output device during this call.
+        // The HAL forgets it between calls, so it's cleared on call start.
+        KeyedVector<audio_devices_t, float> mVoiceVolumes;
 };
 };
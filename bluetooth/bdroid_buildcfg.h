@@ -19,4 +19,10 @@
 
 #define BTM_DEF_LOCAL_NAME   "GT-S7580"
 
+/* a2dp hal raises the hawaii cpufreq floor while the stack can't keep up,
+   audio_a2dp_hw.c defaults to the same values when built without this */
+#define A2DP_HW_SYSFS_TUNER     "/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq"
+#define A2DP_HW_SYSFS_TUNER_ON  "666666"
+#define A2DP_HW_SYSFS_TUNER_OFF "0"
+
 #endif
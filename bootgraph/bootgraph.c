@@ -0,0 +1,494 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Boot-time service graph. init only knows classes, so the hardware daemons
+ * used to come up whenever their class was started, in rc file order. The
+ * ones listed in /system/etc/bootgraph.conf are left 'disabled' in init
+ * instead and started from here as soon as what they need is ready, each
+ * independently of the others. Services init still starts by itself and
+ * plain property milestones are only timed.
+ *
+ * Every node gets sys.bootgraph.<node> = "start=<ms> ready=<ms>" (uptime)
+ * once it is ready, and when the boot completes the whole timeline and the
+ * critical path to the home screen go to /data/log/bootgraph.txt.
+ *
+ * init has no way to tell us about service state changes, so the
+ * init.svc.* and readiness properties are polled; timestamps are good to
+ * POLL_MS.
+ *
+ * If the config can't be loaded, sys.bootgraph.fallback=1 makes init start
+ * the daemons itself once the device node permissions are set.
+ */
+
+#define LOG_TAG "bootgraph"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#define CONFIG_FILE "/system/etc/bootgraph.conf"
+#define REPORT_FILE "/data/log/bootgraph.txt"
+#define PROP_PREFIX "sys.bootgraph."
+
+#define MAX_NODES 32
+#define MAX_DEPS 8
+#define MAX_CONDS 4
+#define NAME_LEN (PROPERTY_KEY_MAX - sizeof(PROP_PREFIX) + 1)
+
+#define POLL_MS 20
+#define SLOW_POLL_MS 250
+#define FAST_POLL_PERIOD_MS 60000
+#define DEP_TIMEOUT_MS 10000    /* a started service that never gets ready */
+#define FINISH_GRACE_MS 10000   /* after sys.boot_completed */
+
+#define PERMS_PROP "sys.hawaii.perms_ready"
+
+enum { KIND_START, KIND_WATCH, KIND_MILESTONE };
+
+static const char *kind_names[] = { "start", "watch", "milestone" };
+
+struct cond {
+    char prop[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];     /* "*" is any non-empty value */
+};
+
+struct node {
+    char name[NAME_LEN];
+    int kind;
+    char dep_names[MAX_DEPS][NAME_LEN];
+    int deps[MAX_DEPS];
+    int ndeps;
+    struct cond ready_on[MAX_CONDS];    /* any of; none is "running" */
+    int nready_on;
+
+    int64_t started;                    /* ctl.start sent */
+    int64_t running;                    /* init.svc.<name> first set */
+    int64_t ready;
+    int timed_out;
+    int forced;                         /* started before its deps were */
+};
+
+static struct node nodes[MAX_NODES];
+static int nnodes;
+
+static int64_t uptime_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int find_node(const char *name)
+{
+    int i;
+    for (i = 0; i < nnodes; i++) {
+        if (!strcmp(nodes[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/* "<prop>=<value>[|<prop>=<value>...]" */
+static int parse_conds(struct node *n, char *spec)
+{
+    char *save = NULL, *tok;
+    for (tok = strtok_r(spec, "|", &save); tok; tok = strtok_r(NULL, "|", &save)) {
+        char *eq = strchr(tok, '=');
+        struct cond *c;
+        if (!eq || eq == tok || n->nready_on == MAX_CONDS)
+            return -1;
+        *eq = '\0';
+        c = &n->ready_on[n->nready_on++];
+        strlcpy(c->prop, tok, sizeof(c->prop));
+        strlcpy(c->value, eq + 1, sizeof(c->value));
+    }
+    return 0;
+}
+
+static int parse_deps(struct node *n, char *spec)
+{
+    char *save = NULL, *tok;
+    for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n->ndeps == MAX_DEPS)
+            return -1;
+        strlcpy(n->dep_names[n->ndeps++], tok, NAME_LEN);
+    }
+    return 0;
+}
+
+static int parse_line(char *line, int lineno)
+{
+    char *save = NULL, *tok;
+    struct node *n;
+
+    tok = strtok_r(line, " \t\r\n", &save);
+    if (!tok || tok[0] == '#')
+        return 0;
+    if (nnodes == MAX_NODES) {
+        ALOGE("%s:%d: too many nodes", CONFIG_FILE, lineno);
+        return -1;
+    }
+
+    n = &nodes[nnodes];
+    memset(n, 0, sizeof(*n));
+    if (!strcmp(tok, "start"))
+        n->kind = KIND_START;
+    else if (!strcmp(tok, "watch"))
+        n->kind = KIND_WATCH;
+    else if (!strcmp(tok, "milestone"))
+        n->kind = KIND_MILESTONE;
+    else {
+        ALOGE("%s:%d: unknown node kind '%s'", CONFIG_FILE, lineno, tok);
+        return -1;
+    }
+
+    tok = strtok_r(NULL, " \t\r\n", &save);
+    if (!tok || strlen(tok) >= NAME_LEN || find_node(tok) >= 0) {
+        ALOGE("%s:%d: missing, too long or duplicate node name", CONFIG_FILE, lineno);
+        return -1;
+    }
+    strlcpy(n->name, tok, sizeof(n->name));
+
+    while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+        char *arg = strtok_r(NULL, " \t\r\n", &save);
+        int err = -1;
+        if (arg && !strcmp(tok, "after"))
+            err = parse_deps(n, arg);
+        else if (arg && !strcmp(tok, "ready"))
+            err = parse_conds(n, arg);
+        if (err) {
+            ALOGE("%s:%d: bad '%s' in node %s", CONFIG_FILE, lineno, tok, n->name);
+            return -1;
+        }
+    }
+    if (n->kind == KIND_MILESTONE && !n->nready_on) {
+        ALOGE("%s:%d: milestone %s needs a ready condition", CONFIG_FILE, lineno, n->name);
+        return -1;
+    }
+
+    n->started = n->running = n->ready = -1;
+    nnodes++;
+    return 0;
+}
+
+/* Resolves dependency names, drops unknown ones and breaks cycles. */
+static void link_nodes(void)
+{
+    int indegree[MAX_NODES];
+    int done[MAX_NODES];
+    int i, j, progress;
+
+    for (i = 0; i < nnodes; i++) {
+        struct node *n = &nodes[i];
+        int ndeps = 0;
+        for (j = 0; j < n->ndeps; j++) {
+            int d = find_node(n->dep_names[j]);
+            if (d < 0 || d == i) {
+                ALOGE("%s: ignoring dependency on '%s'", n->name, n->dep_names[j]);
+                continue;
+            }
+            n->deps[ndeps++] = d;
+        }
+        n->ndeps = ndeps;
+        indegree[i] = ndeps;
+        done[i] = 0;
+    }
+
+    do {
+        progress = 0;
+        for (i = 0; i < nnodes; i++) {
+            if (done[i] || indegree[i])
+                continue;
+            done[i] = progress = 1;
+            for (j = 0; j < nnodes; j++) {
+                int k;
+                for (k = 0; k < nodes[j].ndeps; k++) {
+                    if (nodes[j].deps[k] == i)
+                        indegree[j]--;
+                }
+            }
+        }
+    } while (progress);
+
+    for (i = 0; i < nnodes; i++) {
+        if (!done[i]) {
+            ALOGE("%s: dependency cycle, starting it without dependencies", nodes[i].name);
+            nodes[i].ndeps = 0;
+        }
+    }
+}
+
+static int load_config(void)
+{
+    char line[256];
+    int lineno = 0;
+    FILE *f = fopen(CONFIG_FILE, "r");
+
+    if (!f) {
+        ALOGE("cannot open %s", CONFIG_FILE);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (parse_line(line, ++lineno)) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    link_nodes();
+    return 0;
+}
+
+static int cond_met(const struct cond *c)
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get(c->prop, value, "");
+    if (!strcmp(c->value, "*"))
+        return value[0] != '\0';
+    return !strcmp(value, c->value);
+}
+
+/* When |n| stopped holding up its dependents, -1 if it still does. */
+static int64_t resolved_at(const struct node *n, int64_t now)
+{
+    int64_t since;
+
+    if (n->ready >= 0)
+        return n->ready;
+    if (n->kind == KIND_MILESTONE)
+        return -1;
+    since = n->running >= 0 ? n->running : n->started;
+    if (since >= 0 && now - since >= DEP_TIMEOUT_MS)
+        return since + DEP_TIMEOUT_MS;
+    return -1;
+}
+
+/* The dependency of |n| that got resolved last, -1 if none. */
+static int last_dep(const struct node *n, int64_t now)
+{
+    int64_t latest = -1;
+    int i, last = -1;
+    for (i = 0; i < n->ndeps; i++) {
+        int64_t t = resolved_at(&nodes[n->deps[i]], now);
+        if (t > latest) {
+            latest = t;
+            last = n->deps[i];
+        }
+    }
+    return last;
+}
+
+static int deps_resolved(const struct node *n, int64_t now)
+{
+    int i;
+    for (i = 0; i < n->ndeps; i++) {
+        if (resolved_at(&nodes[n->deps[i]], now) < 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int64_t start_time(const struct node *n)
+{
+    return n->kind == KIND_START ? n->started : n->running;
+}
+
+static void publish(const struct node *n)
+{
+    char prop[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    snprintf(prop, sizeof(prop), PROP_PREFIX "%s", n->name);
+    snprintf(value, sizeof(value), "start=%lld ready=%lld",
+            (long long)start_time(n), (long long)n->ready);
+    property_set(prop, value);
+}
+
+static void start_node(struct node *n, int64_t now, int forced)
+{
+    property_set("ctl.start", n->name);
+    n->started = now;
+    n->forced = forced;
+    ALOGI("%s: started at %lld ms%s", n->name, (long long)now,
+            forced ? " before its dependencies were ready" : "");
+}
+
+/* One pass over the graph, returns the number of nodes not ready yet. */
+static int poll_nodes(int64_t now, int force)
+{
+    int i, pending = 0;
+
+    for (i = 0; i < nnodes; i++) {
+        struct node *n = &nodes[i];
+        char prop[PROPERTY_KEY_MAX];
+        char state[PROPERTY_VALUE_MAX];
+        int ready = 0, c;
+
+        if (n->kind == KIND_START && n->started < 0) {
+            if (deps_resolved(n, now))
+                start_node(n, now, 0);
+            else if (force)
+                start_node(n, now, 1);
+        }
+
+        if (n->kind != KIND_MILESTONE && n->running < 0) {
+            /* init sets it once the service has been forked */
+            snprintf(prop, sizeof(prop), "init.svc.%s", n->name);
+            property_get(prop, state, "");
+            if (state[0])
+                n->running = now;
+        }
+
+        if (n->ready >= 0)
+            continue;
+        if (!n->nready_on)
+            ready = n->running >= 0;
+        for (c = 0; c < n->nready_on && !ready; c++)
+            ready = cond_met(&n->ready_on[c]);
+        if (ready) {
+            n->ready = now;
+            ALOGI("%s: ready at %lld ms", n->name, (long long)now);
+            publish(n);
+        } else {
+            if (!n->timed_out && n->kind != KIND_MILESTONE &&
+                    resolved_at(n, now) >= 0) {
+                n->timed_out = 1;
+                ALOGW("%s: not ready %d ms after it started, no longer waiting for it",
+                        n->name, DEP_TIMEOUT_MS);
+            }
+            pending++;
+        }
+    }
+    return pending;
+}
+
+/* Hands the managed services back to init, see init.hawaii_ss_kylepro.rc. */
+static void fall_back(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    for (;;) {
+        property_get(PERMS_PROP, value, "0");
+        if (!strcmp(value, "1"))
+            break;
+        usleep(POLL_MS * 1000);
+    }
+    ALOGW("no usable %s, leaving the services to init", CONFIG_FILE);
+    property_set(PROP_PREFIX "fallback", "1");
+}
+
+static int boot_completed(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("sys.boot_completed", value, "0");
+    return !strcmp(value, "1");
+}
+
+static void format_ms(char *buf, size_t len, int64_t ms)
+{
+    if (ms < 0)
+        strlcpy(buf, "-", len);
+    else
+        snprintf(buf, len, "%lld", (long long)ms);
+}
+
+static void write_report(int64_t now)
+{
+    char tmp[sizeof(REPORT_FILE) + 4];
+    int i, n;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", REPORT_FILE);
+    f = fopen(tmp, "w");
+    if (!f) {
+        ALOGE("cannot write %s", tmp);
+        return;
+    }
+
+    fprintf(f, "# boot timeline, ms of uptime (+/- %d ms)\n", POLL_MS);
+    fprintf(f, "%-16s %-9s %8s %8s %8s  %s\n",
+            "node", "kind", "start", "running", "ready", "last dependency");
+    for (i = 0; i < nnodes; i++) {
+        const struct node *nd = &nodes[i];
+        char start[16], running[16], ready[16];
+        int dep = last_dep(nd, now);
+        format_ms(start, sizeof(start), start_time(nd));
+        format_ms(running, sizeof(running), nd->running);
+        format_ms(ready, sizeof(ready), nd->ready);
+        fprintf(f, "%-16s %-9s %8s %8s %8s  %s%s\n", nd->name, kind_names[nd->kind],
+                start, running, ready, dep >= 0 ? nodes[dep].name : "-",
+                nd->forced ? " (started without it)" : "");
+    }
+
+    /* walk back from home along whatever each node waited for last */
+    n = find_node("home");
+    if (n >= 0 && nodes[n].ready >= 0) {
+        fprintf(f, "\ncritical path to home, %lld ms:\n", (long long)nodes[n].ready);
+        while (n >= 0) {
+            int dep = last_dep(&nodes[n], now);
+            int64_t from = dep >= 0 ? resolved_at(&nodes[dep], now) : 0;
+            int64_t until = nodes[n].ready >= 0 ? nodes[n].ready : resolved_at(&nodes[n], now);
+            fprintf(f, "  %-16s %8lld ms  +%lld ms\n", nodes[n].name,
+                    (long long)until, (long long)(until - from));
+            n = dep;
+        }
+    }
+
+    fclose(f);
+    chmod(tmp, 0644);
+    if (rename(tmp, REPORT_FILE))
+        ALOGE("cannot write %s", REPORT_FILE);
+}
+
+int main(void)
+{
+    int64_t begin = uptime_ms();
+    int64_t completed = -1;
+
+    if (load_config()) {
+        fall_back();
+        return 1;
+    }
+    ALOGI("%d nodes, started at %lld ms", nnodes, (long long)begin);
+
+    for (;;) {
+        int64_t now = uptime_ms();
+        int pending;
+
+        if (completed < 0 && boot_completed()) {
+            completed = now;
+            ALOGI("boot completed at %lld ms", (long long)completed);
+        }
+
+        /* once the system is up nothing is worth waiting for any more */
+        pending = poll_nodes(now, completed >= 0);
+        if (completed >= 0 && (!pending || now - completed >= FINISH_GRACE_MS)) {
+            write_report(now);
+            property_set(PROP_PREFIX "done", "1");
+            ALOGI("timeline written to %s", REPORT_FILE);
+            return 0;
+        }
+
+        usleep((now - begin < FAST_POLL_PERIOD_MS ? POLL_MS : SLOW_POLL_MS) * 1000);
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fills the stagefright codec capability index (see CodecCapsIndex in
+ * patch/frameworks/av/media/libstagefright/OMXCodec.cpp) by querying every
+ * codec/type pair in media_codecs.xml once. Started by init as the media
+ * user whenever mediaserver comes up. Pairs that are already indexed are
+ * answered from the index and cost nothing, and an index newer than the
+ * build and media_codecs.xml isn't looked at at all.
+ */
+
+#define LOG_TAG "codec_caps"
+#include <utils/Log.h>
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <binder/ProcessState.h>
+#include <cutils/properties.h>
+#include <media/stagefright/foundation/AString.h>
+#include <media/stagefright/MediaCodecList.h>
+#include <media/stagefright/OMXClient.h>
+#include <media/stagefright/OMXCodec.h>
+#include <utils/Vector.h>
+
+using namespace android;
+
+// kCodecCapsIndexPath and kMediaCodecsXmlPath in OMXCodec.cpp
+static const char *kIndexPath = "/data/misc/codec_caps/codec_caps.idx";
+static const char *kCodecsXmlPath = "/system/etc/media_codecs.xml";
+
+// File times under /system are whatever the installer left, the build
+// date is what tells a new /system apart.
+static bool indexIsCurrent() {
+    struct stat index;
+    if (stat(kIndexPath, &index) != 0) {
+        return false;
+    }
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.build.date.utc", value, "0");
+    if (index.st_mtime < strtoll(value, NULL, 10)) {
+        return false;
+    }
+
+    struct stat xml;
+    return stat(kCodecsXmlPath, &xml) != 0 || index.st_mtime >= xml.st_mtime;
+}
+
+int main() {
+    if (indexIsCurrent()) {
+        return 0;
+    }
+
+    ProcessState::self()->startThreadPool();
+
+    OMXClient client;
+    if (client.connect() != OK) {
+        ALOGE("cannot connect to mediaserver");
+        return 1;
+    }
+
+    const MediaCodecList *list = MediaCodecList::getInstance();
+    if (list == NULL) {
+        return 1;
+    }
+
+    size_t queried = 0;
+    for (size_t i = 0; i < list->countCodecs(); ++i) {
+        const char *name = list->getCodecName(i);
+        bool isEncoder = list->isEncoder(i);
+
+        Vector<AString> types;
+        if (list->getSupportedTypes(i, &types) != OK) {
+            continue;
+        }
+
+        for (size_t j = 0; j < types.size(); ++j) {
+            CodecCapabilities caps;
+            if (QueryCodec(client.interface(), name, types[j].c_str(),
+                        isEncoder, &caps) == OK) {
+                ++queried;
+            }
+        }
+    }
+
+    ALOGV("%zu codec/type pairs indexed", queried);
+
+    client.disconnect();
+    return 0;
+}
@@ -26,7 +26,8 @@ PRODUCT_COPY_FILES += \
 PRODUCT_COPY_FILES += \
 	device/samsung/kylepro/configs/media_profiles.xml:system/etc/media_profiles.xml \
 	device/samsung/kylepro/configs/audio_policy.conf:system/etc/audio_policy.conf \
-	device/samsung/kylepro/configs/media_codecs.xml:system/etc/media_codecs.xml 
+	device/samsung/kylepro/configs/media_codecs.xml:system/etc/media_codecs.xml \
+	device/samsung/kylepro/configs/bootgraph.conf:system/etc/bootgraph.conf
 
 # Prebuilt kl keymaps
 PRODUCT_COPY_FILES += \
@@ -59,6 +60,14 @@ PRODUCT_PACKAGES += \
 	fibmap.f2fs \
 	mkfs.f2fs
 		
+# Boot service graph
+PRODUCT_PACKAGES += \
+	bootgraph
+
+# Codec capability index
+PRODUCT_PACKAGES += \
+	codec_caps
+
 # Usb accessory
 PRODUCT_PACKAGES += \
 	com.android.future.usb.accessory
@@ -125,6 +125,9 @@ struct fmradio_vendor_callbacks_t {
     void (*on_automatic_switch) (int new_freq,
                                  enum fmradio_switch_reason_t reason);
     void (*on_forced_reset) (enum fmradio_reset_reason_t reason);
+    /* full_scan progress: all channels found so far, may be NULL */
+    void (*on_full_scan_progress) (int num_found, int *found_freqs,
+                                   int *signal_strengths);
 };
 
 struct fmradio_vendor_methods_t {
@@ -28,9 +28,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
@@ -166,95 +171,333 @@ enum BCM_FM_CMD
 #define BCM4325_FREQ_64MHZ                       64000
 
 #define BCM4325_SEARCH_RSSI_60DB                 94
+#define BCM4325_RSSI_MAX                         0x7f
 
+#define BCM4325_CHANNEL_STEP                     100
 
-int hci_w(int reg, int val)
+
+/*
+ * In-process HCI transport. The FM core sits behind the vendor specific
+ * 0x3f/0x15 I2C command of the Broadcom controller; talk to it through a
+ * raw HCI socket instead of spawning hcitool for every register access.
+ * Commands are synchronous: each one waits for its Command Complete.
+ */
+
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH                             31
+#endif
+#define BTPROTO_HCI                              1
+#define SOL_HCI                                  0
+#define HCI_FILTER                               2
+#define HCI_CHANNEL_RAW                          0
+
+#define HCI_COMMAND_PKT                          0x01
+#define HCI_EVENT_PKT                            0x04
+#define HCI_EV_CMD_COMPLETE                      0x0e
+#define HCI_EV_CMD_STATUS                        0x0f
+#define HCI_EV_VENDOR                            0xff
+#define HCI_MAX_EVENT_SIZE                       260
+
+#define HCI_FM_OPCODE                            ((0x3f << 10) | 0x15)
+#define HCI_FM_WRITE                             0
+#define HCI_FM_READ                              1
+#define HCI_FM_MAX_DATA                          BCM4325_MAX_READ_SIZE
+#define HCI_FM_TIMEOUT_MS                        1000
+
+/* a seek across the whole band takes a few seconds */
+#define HCI_FM_SEEK_TIMEOUT_MS                   10000
+/* flags are re-read at least this often in case the interrupt is lost */
+#define HCI_FM_FLAG_POLL_MS                      20
+
+/* longest run of consecutive registers written by a single command */
+#define HCI_FM_MAX_WRITE_RUN                     2
+
+struct hci_sockaddr {
+    sa_family_t hci_family;
+    unsigned short hci_dev;
+    unsigned short hci_channel;
+};
+
+struct hci_sock_filter {
+    uint32_t type_mask;
+    uint32_t event_mask[2];
+    uint16_t opcode;
+};
+
+struct hci_reg_write {
+    uint8_t reg;
+    uint8_t val;
+};
+
+static pthread_mutex_t hci_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hci_fd = -1;
+
+static int hci_open_locked(void)
 {
-    int returnval = 0;
+    struct hci_sockaddr addr;
+    struct hci_sock_filter flt;
+    int fd;
+
+    if (hci_fd >= 0)
+        return 0;
+
+    fd = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+    if (fd < 0) {
+        LOGE("hci socket failed: %s", strerror(errno));
+        return -errno;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.hci_family = AF_BLUETOOTH;
+    addr.hci_dev = 0;
+    addr.hci_channel = HCI_CHANNEL_RAW;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOGE("hci bind failed: %s", strerror(errno));
+        close(fd);
+        return -errno;
+    }
 
-    char s1[100] = "hcitool cmd 0x3f 0x15 ";
-    char stemp[10] = "";
-    char starget[100] = "";
-    char *pstarget = starget;
+    /*
+     * the completion events of our own command, and vendor events which
+     * carry the FM interrupt. The kernel tests bit (event & 63), so 0xff
+     * lands on bit 63, the top bit of event_mask[1].
+     */
+    memset(&flt, 0, sizeof(flt));
+    flt.type_mask = 1 << HCI_EVENT_PKT;
+    flt.event_mask[0] = (1 << HCI_EV_CMD_COMPLETE) | (1 << HCI_EV_CMD_STATUS);
+    flt.event_mask[1] = 1u << ((HCI_EV_VENDOR & 63) - 32);
+    flt.opcode = HCI_FM_OPCODE;
+    if (setsockopt(fd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+        LOGE("hci filter failed: %s", strerror(errno));
+        close(fd);
+        return -errno;
+    }
 
-    sprintf(stemp, "0x%x ", reg);
-    pstarget = strcat(s1, stemp);
+    hci_fd = fd;
+    return 0;
+}
 
-    sprintf(stemp, "0x%x ", 0);
-    pstarget = strcat(pstarget, stemp);
+static void hci_close(void)
+{
+    pthread_mutex_lock(&hci_lock);
+    if (hci_fd >= 0) {
+        close(hci_fd);
+        hci_fd = -1;
+    }
+    pthread_mutex_unlock(&hci_lock);
+}
 
-    sprintf(stemp, "0x%x ", val);
-    pstarget = strcat(pstarget, stemp);
-    returnval = system(pstarget);
-    return returnval;
+/*
+ * Sends one FM I2C command and waits for its Command Complete. The last
+ * rlen bytes of the return parameters are copied to rsp.
+ */
+static int hci_fm_cmd_locked(uint8_t reg, uint8_t rw, const uint8_t *data, int dlen,
+                             uint8_t *rsp, int rlen)
+{
+    uint8_t cmd[4 + 2 + HCI_FM_MAX_DATA];
+    uint8_t ev[HCI_MAX_EVENT_SIZE];
+    struct pollfd pfd;
+    int ret;
+
+    if (dlen > HCI_FM_MAX_DATA || rlen > HCI_FM_MAX_DATA)
+        return -EINVAL;
+
+    ret = hci_open_locked();
+    if (ret < 0)
+        return ret;
+
+    cmd[0] = HCI_COMMAND_PKT;
+    cmd[1] = HCI_FM_OPCODE & 0xff;
+    cmd[2] = HCI_FM_OPCODE >> 8;
+    cmd[3] = 2 + dlen;
+    cmd[4] = reg;
+    cmd[5] = rw;
+    if (dlen)
+        memcpy(cmd + 6, data, dlen);
+
+    do {
+        ret = write(hci_fd, cmd, 6 + dlen);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        LOGE("hci write reg 0x%x failed: %s", reg, strerror(errno));
+        return -errno;
+    }
+
+    pfd.fd = hci_fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        int len, plen;
+
+        ret = poll(&pfd, 1, HCI_FM_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            LOGE("hci reg 0x%x: %s", reg, ret ? strerror(errno) : "timed out");
+            return ret ? -errno : -ETIMEDOUT;
+        }
+
+        len = read(hci_fd, ev, sizeof(ev));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -errno;
+        }
+        if (len < 3 || ev[0] != HCI_EVENT_PKT)
+            continue;
+        plen = ev[2];
+        if (plen > len - 3)
+            plen = len - 3;
+
+        if (ev[1] == HCI_EV_CMD_STATUS && plen >= 4) {
+            /* status, ncmd, opcode: only failures end up here */
+            if ((ev[5] | (ev[6] << 8)) == HCI_FM_OPCODE && ev[3]) {
+                LOGE("hci reg 0x%x: status 0x%x", reg, ev[3]);
+                return -EIO;
+            }
+        } else if (ev[1] == HCI_EV_CMD_COMPLETE && plen >= 4) {
+            /* ncmd, opcode, status, return parameters */
+            if ((ev[4] | (ev[5] << 8)) != HCI_FM_OPCODE)
+                continue;
+            if (ev[6]) {
+                LOGE("hci reg 0x%x: status 0x%x", reg, ev[6]);
+                return -EIO;
+            }
+            if (rlen) {
+                if (plen - 4 < rlen)
+                    return -EIO;
+                memcpy(rsp, ev + 3 + plen - rlen, rlen);
+            }
+            return 0;
+        }
+    }
 }
 
-int hci_w16(int reg, int val1, int val2)
+static int hci_read(int reg, uint8_t *buf, int len)
 {
-    int returnval = 0;
+    uint8_t n = len;
+    int ret;
 
-    char s1[100] = "hcitool cmd 0x3f 0x15 ";
-    char stemp[10] = "";
-    char starget[100] = "";
-    char *pstarget = starget;
+    pthread_mutex_lock(&hci_lock);
+    ret = hci_fm_cmd_locked(reg, HCI_FM_READ, &n, 1, buf, len);
+    pthread_mutex_unlock(&hci_lock);
+    return ret;
+}
 
-    sprintf(stemp, "0x%x ", reg);
-    pstarget = strcat(s1, stemp);
+/*
+ * Writes a list of registers in one go. Consecutive registers are merged
+ * into a single command, and the transport lock is held once for the batch.
+ */
+static int hci_w_batch(const struct hci_reg_write *w, int count)
+{
+    int i = 0, ret = 0;
 
-    sprintf(stemp, "0x%x ", 0);
-    pstarget = strcat(pstarget, stemp);
+    pthread_mutex_lock(&hci_lock);
+    while (i < count && ret >= 0) {
+        uint8_t data[HCI_FM_MAX_WRITE_RUN];
+        int n = 0;
 
-    sprintf(stemp, "0x%x ", val1);
-    pstarget = strcat(pstarget, stemp);
+        do {
+            data[n] = w[i + n].val;
+            n++;
+        } while (n < HCI_FM_MAX_WRITE_RUN && i + n < count &&
+                 w[i + n].reg == w[i].reg + n);
 
-    sprintf(stemp, "0x%x ", val2);
-    pstarget = strcat(pstarget, stemp);
+        ret = hci_fm_cmd_locked(w[i].reg, HCI_FM_WRITE, data, n, NULL, 0);
+        i += n;
+    }
+    pthread_mutex_unlock(&hci_lock);
+    return ret;
+}
 
-    returnval = system(pstarget);
-    return returnval;
+int hci_w(int reg, int val)
+{
+    struct hci_reg_write w = { reg, val };
+    return hci_w_batch(&w, 1);
+}
+
+int hci_w16(int reg, int val1, int val2)
+{
+    struct hci_reg_write w[2] = { { reg, val1 }, { reg + 1, val2 } };
+    return hci_w_batch(w, 2);
 }
 
 int hci_r(int reg)
 {
-    FILE* returnval;
-    int ulval;
-    char s1[100] = "hcitool cmd 0x3f 0x15 ";
-    char stemp[10] = "";
-    char starget[100] = "";
-    char reading[200] = "";
-    char *pstarget = starget;
-    char *returnv;
+    uint8_t val = 0;
 
-    sprintf(stemp, "0x%x ", reg);
-    pstarget=strcat(s1, stemp);
+    if (hci_read(reg, &val, 1) < 0)
+        return 0;
+    LOGV("hci_r 0x%x \n", val);
+    return val;
+}
 
-    sprintf(stemp, "0x%x ", 1);
-    pstarget=strcat(pstarget, stemp);
+static int64_t now_ms(void)
+{
+    struct timespec ts;
 
-    sprintf(stemp, "0x%x ", 1);
-    pstarget = strcat(pstarget, stemp);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    returnval = popen(pstarget,"r");
+/* Reads, and thereby clears, the FM flag register. */
+static int hci_read_flags_locked(void)
+{
+    uint8_t n = 1, flags;
+    int ret;
 
-    if(!returnval){
-      LOGE("Could not open pipe for output.\n");
-      return 0;
-    }
+    ret = hci_fm_cmd_locked(BCM4325_I2C_FM_RDS_FLAG0, HCI_FM_READ, &n, 1, &flags, 1);
+    return ret < 0 ? ret : flags;
+}
 
-    // Grab data from process execution
-    // Skip the first 3 lines
-    fgets(reading, 200 , returnval);
-    fgets(reading, 200 , returnval);
-    fgets(reading, 200 , returnval);
-    fgets(reading, 200 , returnval);
+static int hci_clear_flags(void)
+{
+    int ret;
 
-    if (pclose(returnval) != 0)
-        fprintf(stderr," Error: Failed to close command stream \n");
+    pthread_mutex_lock(&hci_lock);
+    ret = hci_read_flags_locked();
+    pthread_mutex_unlock(&hci_lock);
+    return ret;
+}
 
-    returnv = strndup(reading + (strlen(reading)-4), 2);
-    ulval= strtoul(returnv, NULL, 16);
-    LOGD("hci_r 0x%x \n", ulval);
-    return ulval;
+/*
+ * Sleeps until one of the mask bits shows up in the flag register. The FM
+ * core signals the end of a search/tune with a vendor event; the flags are
+ * checked on every event and every HCI_FM_FLAG_POLL_MS. The transport lock
+ * is dropped between checks so that stop_scan can get through. Returns the
+ * flags, or a negative errno on error, timeout or when *aborted gets set.
+ */
+static int hci_wait_flags(int mask, int timeout_ms, volatile bool *aborted)
+{
+    uint8_t ev[HCI_MAX_EVENT_SIZE];
+    int64_t deadline = now_ms() + timeout_ms;
+    struct pollfd pfd;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&hci_lock);
+        ret = hci_open_locked();
+        if (ret == 0) {
+            pfd.fd = hci_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, HCI_FM_FLAG_POLL_MS) > 0) {
+                /* no command is in flight, whatever is queued is an interrupt */
+                while (recv(hci_fd, ev, sizeof(ev), MSG_DONTWAIT) > 0)
+                    ;
+            }
+            ret = hci_read_flags_locked();
+        }
+        pthread_mutex_unlock(&hci_lock);
+
+        if (ret < 0 || (ret & mask))
+            return ret;
+        if (aborted && *aborted)
+            return -ECANCELED;
+        if (now_ms() >= deadline) {
+            LOGE("timed out waiting for flags 0x%x", mask);
+            return -ETIMEDOUT;
+        }
+    }
 }
 
 /* state */
@@ -262,6 +505,9 @@ int hci_r(int reg)
 struct bcm4325_session {
     bool radioInitialised;
     int defaultFreq;
+    int lowFreq;
+    int highFreq;
+    volatile bool scanAborted;
     const struct fmradio_vendor_callbacks_t *cb;
 };
 
@@ -296,6 +542,11 @@ static int radioOn(struct bcm4325_session *priv)
             return FMRADIO_INVALID_STATE;
     }
 #endif
+        /* Raise the FM interrupt when a search or tune ends */
+        if (hci_w(BCM4325_I2C_FM_RDS_MASK0,
+                  BCM4325_FM_FLAG_SEARCH_TUNE_FINISHED | BCM4325_FM_FLAG_SEARCH_TUNE_FAIL) < 0) {
+            LOGW("fail unmasking search interrupt, polling flags");
+        }
         priv->radioInitialised = true;
     }
 
@@ -313,6 +564,7 @@ static int radioOff(struct bcm4325_session *priv)
 //            return FMRADIO_INVALID_STATE;
         }
     }
+    hci_close();
 
     LOGD("FMRadio off");
     return 0;
@@ -325,14 +577,14 @@ static int setFreq(struct bcm4325_session *priv, int freq)
     /* Adjust frequency to be an offset from 64MHz */
     freq -= BCM4325_FREQ_64MHZ;
 
-    /* Write the FREQ0 register */
-    hci_w(BCM4325_I2C_FM_FREQ0, freq & 0xFF);
-
-    /* Write the FREQ1 register */
-    hci_w(BCM4325_I2C_FM_FREQ1, freq >> 8);
-
-    /* Write the TUNER_MODE register to PRESET to actually start tuning */
-    if (hci_w(BCM4325_I2C_FM_SEARCH_TUNE_MODE, BCM4325_FM_PRE_SET_MODE) < 0){
+    struct hci_reg_write w[] = {
+        /* FREQ0 and FREQ1 go out as one command */
+        { BCM4325_I2C_FM_FREQ0, freq & 0xFF },
+        { BCM4325_I2C_FM_FREQ1, freq >> 8 },
+        /* Write the TUNER_MODE register to PRESET to actually start tuning */
+        { BCM4325_I2C_FM_SEARCH_TUNE_MODE, BCM4325_FM_PRE_SET_MODE },
+    };
+    if (hci_w_batch(w, sizeof(w) / sizeof(w[0])) < 0) {
         LOGE("fail\n");
     }
 
@@ -341,9 +593,94 @@ static int setFreq(struct bcm4325_session *priv, int freq)
 
 static int setBand(struct bcm4325_session *priv, int low, int high)
 {
+    priv->lowFreq = low;
+    priv->highFreq = high;
     return FMRADIO_OK;
 }
 
+/* Tunes to freq and waits for the tuner to settle. */
+static int tuneAndWait(struct bcm4325_session *priv, int freq)
+{
+    int ret;
+
+    hci_clear_flags();
+    setFreq(priv, freq);
+    ret = hci_wait_flags(BCM4325_FM_FLAG_SEARCH_TUNE_FINISHED | BCM4325_FM_FLAG_SEARCH_TUNE_FAIL,
+                         HCI_FM_TIMEOUT_MS, &priv->scanAborted);
+    if (ret < 0)
+        return ret;
+    return (ret & BCM4325_FM_FLAG_SEARCH_TUNE_FAIL) ? -EIO : 0;
+}
+
+static int readFreq(void)
+{
+    uint8_t val[2];
+
+    /* FREQ0 and FREQ1 in a single read */
+    if (hci_read(BCM4325_I2C_FM_FREQ0, val, 2) < 0) {
+        return FMRADIO_IO_ERROR;
+    }
+
+    return ((val[1] << 8) | val[0]) + BCM4325_FREQ_64MHZ;
+}
+
+static int readRssi(void)
+{
+    uint8_t rssi;
+
+    if (hci_read(BCM4325_I2C_FM_RSSI, &rssi, 1) < 0) {
+        return FMRADIO_IO_ERROR;
+    }
+
+    return rssi & BCM4325_RSSI_MAX;
+}
+
+/* The framework wants signal strengths in 0-1000 */
+static int rssiToLevel(int rssi)
+{
+    return rssi * 1000 / BCM4325_RSSI_MAX;
+}
+
+/*
+ * Lets the chip seek from the tuned channel to the next one above the
+ * BCM4325_SEARCH_RSSI_60DB stop level. Returns the new frequency, with
+ * its RSSI in *rssi, or a negative value if nothing was found.
+ */
+static int seek(struct bcm4325_session *priv, enum fmradio_seek_direction_t dir, int *rssi)
+{
+    int ret;
+
+    struct hci_reg_write w[] = {
+        { BCM4325_I2C_FM_SEARCH_METHOD, BCM4325_SEARCH_NORMAL },
+        { BCM4325_I2C_FM_SEARCH_CTRL1, BCM4325_I2C_FM_AF_FREQ0 },
+        { BCM4325_I2C_FM_MAX_PRESET, 0 },
+        { BCM4325_I2C_FM_SEARCH_CTRL0,
+          (dir ? BCM4325_FM_SEARCH_CTRL0_UP : BCM4325_FM_SEARCH_CTRL0_DOWN) | BCM4325_SEARCH_RSSI_60DB },
+        { BCM4325_I2C_FM_SEARCH_TUNE_MODE, BCM4325_FM_AUTO_SEARCH_MODE },
+    };
+
+    hci_clear_flags();
+    if (hci_w_batch(w, sizeof(w) / sizeof(w[0])) < 0) {
+        LOGE("fail search setup\n");
+        return FMRADIO_IO_ERROR;
+    }
+
+    ret = hci_wait_flags(BCM4325_FM_FLAG_SEARCH_TUNE_FINISHED | BCM4325_FM_FLAG_SEARCH_TUNE_FAIL,
+                         HCI_FM_SEEK_TIMEOUT_MS, &priv->scanAborted);
+    if (ret < 0) {
+        /* don't leave the chip searching */
+        hci_w(BCM4325_I2C_FM_SEARCH_TUNE_MODE, BCM4325_FM_TERMINATE_SEARCH_TUNE_MODE);
+        return ret;
+    }
+    if (ret & BCM4325_FM_FLAG_SEARCH_TUNE_FAIL) {
+        LOGD("Seek %s hit the end of the band", dir ? "up" : "down");
+        return FMRADIO_IO_ERROR;
+    }
+
+    *rssi = readRssi();
+    return readFreq();
+}
+
 static int
 bcm4325_rx_start(void **session_data,
                 const struct fmradio_vendor_callbacks_t *callbacks,
@@ -356,6 +693,9 @@ bcm4325_rx_start(void **session_data,
     LOGI("rx_start low_freq=%d high_freq=%d default_freq=%d grid=%d",
             low_freq, high_freq, default_freq, grid);
 
+    if (priv == NULL)
+        return FMRADIO_IO_ERROR;
+
     priv->cb = callbacks;
     priv->defaultFreq = default_freq;
 
@@ -399,31 +739,34 @@ bcm4325_set_frequency(void **session_data, int frequency)
 static int
 bcm4325_get_frequency(void **session_data)
 {
-    struct bcm4325_session *priv = (struct bcm4325_session *)*session_data;
+    int freq = readFreq();
 
-    int retval;
-    int freq = 0;
+    LOGI("get_frequency frequency=%d", freq);
 
-    retval = hci_r(BCM4325_I2C_FM_FREQ1);
-    freq = retval << 8;
-    retval = hci_r(BCM4325_I2C_FM_FREQ0);
+    return freq;
+}
 
-    freq += (retval + BCM4325_FREQ_64MHZ);
+static int
+bcm4325_get_signal_strength(void **session_data)
+{
+    int rssi = readRssi();
 
-    LOGI("get_frequency frequency=%d", freq);
+    if (rssi < 0)
+        return rssi;
 
-    return freq;
+    return rssiToLevel(rssi);
 }
 
 static int
 bcm4325_scan(void **session_data, enum fmradio_seek_direction_t dir)
 {
     struct bcm4325_session *priv = (struct bcm4325_session *)*session_data;
-    int oldFreq = bcm4325_get_frequency(session_data); 
-    int upDownFreq = oldFreq + (dir ? 100 : -100);
-    int newStation = 0;
-    bool found = false;
-    int i = 0;
+    int oldFreq = bcm4325_get_frequency(session_data);
+    int upDownFreq = oldFreq + (dir ? BCM4325_CHANNEL_STEP : -BCM4325_CHANNEL_STEP);
+    int newStation, rssi;
+
+    if (oldFreq < 0)
+        return oldFreq;
 
     if ((oldFreq-100 <= 87500 && !dir) || (oldFreq+100 >= 108000 && dir)) {
         LOGD("Can't seek %s. Already at end of band.", dir?"up":"down");
@@ -432,85 +775,100 @@ bcm4325_scan(void **session_data, enum fmradio_seek_direction_t dir)
 
     LOGI("Begin scan %s, current:%d", (dir?"up":"down"), oldFreq);
 
-    if (hci_w(BCM4325_I2C_FM_SEARCH_METHOD, BCM4325_SEARCH_NORMAL) < 0) {
-        LOGE("fail search method\n");
-        return oldFreq;
-    }
-    if (hci_w(BCM4325_I2C_FM_SEARCH_CTRL1, BCM4325_I2C_FM_AF_FREQ0) < 0) {
-        LOGE("fail search set SEARCH_CTRL1 reg\n");
-        return oldFreq;
-    }
-    if (hci_w(BCM4325_I2C_FM_MAX_PRESET, 0) < 0 ) {
-        LOGE("fail search set MAX_PRESET reg\n");
-        return oldFreq;
-    }
-    if (hci_w(BCM4325_I2C_FM_SEARCH_CTRL0,
-             (dir ? BCM4325_FM_SEARCH_CTRL0_UP : BCM4325_FM_SEARCH_CTRL0_DOWN ) | BCM4325_FLAG_STEREO_ACTIVE | BCM4325_FLAG_STEREO_DETECTION) < 0) {
-        LOGE("fail search set SEARCH_CTRL0 reg\n");
-        return oldFreq;
-    }
+    priv->scanAborted = false;
 
-    // Start tuning (up/down)
-    setFreq(priv, upDownFreq);
-    if (hci_w(BCM4325_I2C_FM_SEARCH_TUNE_MODE, BCM4325_FM_AUTO_SEARCH_MODE) < 0) {
-        LOGE("fail tuning\n");
+    // Step off the current station, then let the chip search
+    if (tuneAndWait(priv, upDownFreq) < 0 ||
+            (newStation = seek(priv, dir, &rssi)) < 0) {
+        if (!priv->scanAborted)
+            setFreq(priv, oldFreq);
         return oldFreq;
     }
 
-    // Found new station?
-    newStation = bcm4325_get_frequency(session_data);
-    found = newStation != oldFreq;
-    while (!found)
-    {
-        LOGD("Seeking...");
-        usleep(100);
-
-        newStation = bcm4325_get_frequency(session_data);
-        found = newStation != oldFreq;
-        i++;
-
-        if (found || i >= 20)
-            break;
-    }
-
-    if (found) {
-        LOGI("New station:%d", newStation);
-        return newStation;
-    }
-
-    return oldFreq;
+    LOGI("New station:%d rssi:%d", newStation, rssi);
+    return newStation;
 }
 
+/*
+ * Single pass over the band: every stop of an upward seek is a channel
+ * above the stop level. Progress is reported after each channel.
+ */
 static int
 bcm4325_full_scan(void **session_data, int **found_freqs,
                  int **signal_strengths)
 {
     struct bcm4325_session *priv = (struct bcm4325_session *)*session_data;
-    int i;
-    int lastFreq = priv->defaultFreq;
+    int oldFreq = bcm4325_get_frequency(session_data);
+    int cursor = priv->lowFreq;
+    int count = 0;
+    int freq, rssi = 0;
 
     *found_freqs      = calloc(MAX_SCAN_STATIONS, sizeof(int));
     *signal_strengths = calloc(MAX_SCAN_STATIONS, sizeof(int));
+    if (*found_freqs == NULL || *signal_strengths == NULL)
+        return FMRADIO_IO_ERROR;
+
+    if (oldFreq < 0)
+        oldFreq = priv->defaultFreq;
+
+    priv->scanAborted = false;
+
+    LOGI("Begin full scan %d-%d", priv->lowFreq, priv->highFreq);
+
+    /* seeks start above the tuned channel, check the edge of the band itself */
+    if (tuneAndWait(priv, cursor) < 0) {
+        freq = -1;
+    } else {
+        freq = cursor;
+        rssi = readRssi();
+    }
 
-    setFreq(priv, priv->defaultFreq);
+    while (freq > 0 && count < MAX_SCAN_STATIONS) {
+        if (freq >= cursor && rssi >= BCM4325_SEARCH_RSSI_60DB &&
+                (count == 0 || freq > (*found_freqs)[count - 1])) {
+            (*found_freqs)[count] = freq;
+            (*signal_strengths)[count] = rssiToLevel(rssi);
+            count++;
+            LOGD("Found %d rssi %d", freq, rssi);
+            if (priv->cb && priv->cb->on_full_scan_progress)
+                priv->cb->on_full_scan_progress(count, *found_freqs, *signal_strengths);
+        }
+
+        if (priv->scanAborted)
+            break;
 
-    for (i = 0; i < MAX_SCAN_STATIONS; i++) {
-        int found = bcm4325_scan(session_data, FMRADIO_SEEK_UP);
-        if (found <= 0 || found <= lastFreq)
+        freq = seek(priv, FMRADIO_SEEK_UP, &rssi);
+        if (freq == cursor) {
+            /* the seek stopped where it started, step over the channel */
+            cursor += BCM4325_CHANNEL_STEP;
+            if (cursor > priv->highFreq || tuneAndWait(priv, cursor) < 0)
+                break;
+            freq = cursor;
+            rssi = readRssi();
+        } else if (freq < cursor) {
+            /* end of band, wrapped around or failed */
             break;
-        (*found_freqs)[i] = found;
-        (*signal_strengths)[i] = 75;
-        lastFreq = found;
+        } else {
+            cursor = freq;
+        }
     }
 
-    setFreq(priv, priv->defaultFreq);
+    LOGI("Full scan found %d stations%s", count, priv->scanAborted ? " (aborted)" : "");
 
-    return i-1;
+    if (!priv->scanAborted)
+        setFreq(priv, oldFreq);
+
+    return count;
 }
 
 static int
 bcm4325_stop_scan(void **session_data)
 {
+    struct bcm4325_session *priv = (struct bcm4325_session *)*session_data;
+
+    if (priv)
+        priv->scanAborted = true;
+
     if (hci_w(BCM4325_I2C_FM_SEARCH_TUNE_MODE, BCM4325_FM_TERMINATE_SEARCH_TUNE_MODE) < 0){
         LOGE("fail cancel search\n");
         return FMRADIO_INVALID_STATE;
@@ -556,6 +914,7 @@ int register_fmradio_functions(unsigned int *sig,
     funcs->scan = bcm4325_scan;
     funcs->stop_scan = bcm4325_stop_scan;
     funcs->full_scan = bcm4325_full_scan;
+    funcs->get_signal_strength = bcm4325_get_signal_strength;
     funcs->is_rds_data_supported = bcm4325_rds_supported;
 
     *sig = FMRADIO_SIGNATURE;
@@ -15,24 +15,278 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <healthd.h>
 
+// battery needs to be used instead of bcm59056_charger
+#define BATTERY_PATH "/sys/class/power_supply/battery/"
+#define BACKLIGHT_PATH "/sys/class/backlight/panel/brightness"
+
+// BatteryMonitor opens, reads and closes every attribute on each update.
+// The attributes we keep open are handed to it as this empty file instead,
+// healthd_board_battery_update() then fills in what they really read.
+#define CACHED_ATTR_PATH "/dev/null"
+
+// Used while discharging. Capacity uevents from the bcm59056 driver are not
+// relied upon, so this stays the healthd default as long as the screen is
+// on or the battery is getting low.
+#define POLL_INTERVAL_SLOW (10 * 60)        // seconds, healthd default
+#define POLL_INTERVAL_SCREEN_OFF (20 * 60)  // seconds
+#define SCREEN_OFF_MIN_LEVEL 20             // percent
+
+// A charger plug-in sends several power_supply uevents in a row, each one
+// an update. Within this window the fuel gauge (I2C) attributes of the
+// previous update are reused, the charger state is always re-read.
+#define FUEL_GAUGE_COALESCE_MS 500
+
+enum {
+    ATTR_STATUS,
+    ATTR_HEALTH,
+    ATTR_PRESENT,
+    ATTR_CAPACITY,
+    ATTR_VOLTAGE,
+    ATTR_TEMPERATURE,
+    ATTR_TECHNOLOGY,
+    ATTR_COUNT
+};
+
+struct cached_attr {
+    const char *name;
+    bool fuel_gauge;
+    int fd;
+    char value[32];        // last contents, newline stripped
+    ssize_t len;
+};
+
+static struct cached_attr attrs[ATTR_COUNT] = {
+    { "status",      false, -1, "", -1 },
+    { "health",      false, -1, "", -1 },
+    { "present",     false, -1, "", -1 },
+    { "capacity",    true,  -1, "", -1 },
+    { "voltage_now", true,  -1, "", -1 },
+    { "temp",        true,  -1, "", -1 },
+    { "technology",  false, -1, "", -1 },
+};
+
+// parsed from attrs[] whenever their contents change
+static int battery_status = android::BATTERY_STATUS_UNKNOWN;
+static int battery_health = android::BATTERY_HEALTH_UNKNOWN;
+static bool battery_present;
+static int battery_level;
+static int battery_voltage;
+static int battery_temperature;
+
+static struct healthd_config *healthd_config;
+static int backlight_fd = -1;
+static int64_t last_fuel_gauge_read_ms;
+
+struct sysfs_string_enum_map {
+    const char *s;
+    int val;
+};
+
+static int map_sysfs_string(const char *str, const struct sysfs_string_enum_map *map)
+{
+    for (int i = 0; map[i].s; i++) {
+        if (!strcmp(str, map[i].s))
+            return map[i].val;
+    }
+    return -1;
+}
+
+static int parse_status(const char *status)
+{
+    static const struct sysfs_string_enum_map map[] = {
+        { "Unknown", android::BATTERY_STATUS_UNKNOWN },
+        { "Charging", android::BATTERY_STATUS_CHARGING },
+        { "Discharging", android::BATTERY_STATUS_DISCHARGING },
+        { "Not charging", android::BATTERY_STATUS_NOT_CHARGING },
+        { "Full", android::BATTERY_STATUS_FULL },
+        { NULL, 0 },
+    };
+    int ret = map_sysfs_string(status, map);
+    return ret < 0 ? android::BATTERY_STATUS_UNKNOWN : ret;
+}
+
+static int parse_health(const char *health)
+{
+    static const struct sysfs_string_enum_map map[] = {
+        { "Unknown", android::BATTERY_HEALTH_UNKNOWN },
+        { "Good", android::BATTERY_HEALTH_GOOD },
+        { "Overheat", android::BATTERY_HEALTH_OVERHEAT },
+        { "Dead", android::BATTERY_HEALTH_DEAD },
+        { "Over voltage", android::BATTERY_HEALTH_OVER_VOLTAGE },
+        { "Unspecified failure", android::BATTERY_HEALTH_UNSPECIFIED_FAILURE },
+        { "Cold", android::BATTERY_HEALTH_COLD },
+        { NULL, 0 },
+    };
+    int ret = map_sysfs_string(health, map);
+    return ret < 0 ? android::BATTERY_HEALTH_UNKNOWN : ret;
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    // keeps counting in suspend, a read from before it is never fresh
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// sysfs regenerates an attribute on every read from offset 0
+static ssize_t read_fd(int fd, char *buf, size_t size)
+{
+    ssize_t len = TEMP_FAILURE_RETRY(pread(fd, buf, size - 1, 0));
+    if (len < 0)
+        return -1;
+    if (len > 0 && buf[len - 1] == '\n')
+        len--;
+    buf[len] = '\0';
+    return len;
+}
+
+// Re-reads |a|, returns true if its contents changed since the last read.
+static bool sample(struct cached_attr *a)
+{
+    char buf[sizeof(a->value)];
+    ssize_t len = read_fd(a->fd, buf, sizeof(buf));
+
+    if (len < 0 || (len == a->len && !memcmp(buf, a->value, len)))
+        return false;
+    memcpy(a->value, buf, len + 1);
+    a->len = len;
+    return true;
+}
+
+static void parse(int attr)
+{
+    const char *value = attrs[attr].value;
+
+    switch (attr) {
+    case ATTR_STATUS:
+        battery_status = parse_status(value);
+        break;
+    case ATTR_HEALTH:
+        battery_health = parse_health(value);
+        break;
+    case ATTR_PRESENT:
+        battery_present = strtol(value, NULL, 0) != 0;
+        break;
+    case ATTR_CAPACITY:
+        battery_level = strtol(value, NULL, 0);
+        break;
+    case ATTR_VOLTAGE:
+        battery_voltage = strtol(value, NULL, 0) / 1000;
+        break;
+    case ATTR_TEMPERATURE:
+        battery_temperature = strtol(value, NULL, 0);
+        break;
+    }
+}
+
+static bool screen_off(void)
+{
+    char buf[16];
+
+    if (backlight_fd < 0 || read_fd(backlight_fd, buf, sizeof(buf)) <= 0)
+        return false;
+    return strtol(buf, NULL, 0) == 0;
+}
+
+static android::String8 *config_path(struct healthd_config *config, int attr)
+{
+    switch (attr) {
+    case ATTR_STATUS:
+        return &config->batteryStatusPath;
+    case ATTR_HEALTH:
+        return &config->batteryHealthPath;
+    case ATTR_PRESENT:
+        return &config->batteryPresentPath;
+    case ATTR_CAPACITY:
+        return &config->batteryCapacityPath;
+    case ATTR_VOLTAGE:
+        return &config->batteryVoltagePath;
+    case ATTR_TEMPERATURE:
+        return &config->batteryTemperaturePath;
+    case ATTR_TECHNOLOGY:
+        return &config->batteryTechnologyPath;
+    }
+    return NULL;
+}
+
 void
 healthd_board_init(struct healthd_config *config)
 {
-    // battery needs to be used instead of bcm59056_charger
-    config->batteryStatusPath      = "/sys/class/power_supply/battery/status";
-    config->batteryHealthPath      = "/sys/class/power_supply/battery/health";
-    config->batteryPresentPath     = "/sys/class/power_supply/battery/present";
-    config->batteryCapacityPath    = "/sys/class/power_supply/battery/capacity";
-    config->batteryVoltagePath     = "/sys/class/power_supply/battery/voltage_now";
-    config->batteryTemperaturePath = "/sys/class/power_supply/battery/temp";
-    config->batteryTechnologyPath  = "/sys/class/power_supply/battery/technology";
+    healthd_config = config;
+    config->periodic_chores_interval_slow = POLL_INTERVAL_SLOW;
+
+    for (int i = 0; i < ATTR_COUNT; i++) {
+        android::String8 path(BATTERY_PATH);
+        path.append(attrs[i].name);
+
+        // an attribute we can't keep open is left to BatteryMonitor
+        attrs[i].fd = open(path.string(), O_RDONLY | O_CLOEXEC);
+        if (attrs[i].fd < 0) {
+            *config_path(config, i) = path;
+            continue;
+        }
+        *config_path(config, i) = CACHED_ATTR_PATH;
+        if (sample(&attrs[i]))
+            parse(i);
+    }
+
+    // the technology never changes, no need to keep it open
+    if (attrs[ATTR_TECHNOLOGY].fd >= 0) {
+        close(attrs[ATTR_TECHNOLOGY].fd);
+        attrs[ATTR_TECHNOLOGY].fd = -1;
+    }
+
+    backlight_fd = open(BACKLIGHT_PATH, O_RDONLY | O_CLOEXEC);
+    last_fuel_gauge_read_ms = now_ms();
 }
 
 int
 healthd_board_battery_update(struct android::BatteryProperties *props)
 {
+    const int64_t now = now_ms();
+    const bool coalesce = now - last_fuel_gauge_read_ms < FUEL_GAUGE_COALESCE_MS;
+
+    if (!coalesce)
+        last_fuel_gauge_read_ms = now;
+
+    for (int i = 0; i < ATTR_COUNT; i++) {
+        if (attrs[i].fd < 0 || (coalesce && attrs[i].fuel_gauge))
+            continue;
+        // unchanged contents keep the value parsed last time
+        if (sample(&attrs[i]))
+            parse(i);
+    }
+
+    if (attrs[ATTR_STATUS].fd >= 0)
+        props->batteryStatus = battery_status;
+    if (attrs[ATTR_HEALTH].fd >= 0)
+        props->batteryHealth = battery_health;
+    if (attrs[ATTR_PRESENT].fd >= 0)
+        props->batteryPresent = battery_present;
+    if (attrs[ATTR_CAPACITY].fd >= 0)
+        props->batteryLevel = battery_level;
+    if (attrs[ATTR_VOLTAGE].fd >= 0)
+        props->batteryVoltage = battery_voltage;
+    if (attrs[ATTR_TEMPERATURE].fd >= 0)
+        props->batteryTemperature = battery_temperature;
+    if (attrs[ATTR_TECHNOLOGY].len >= 0)
+        props->batteryTechnology = attrs[ATTR_TECHNOLOGY].value;
+
+    // healthd picks the slow interval up right after this returns
+    healthd_config->periodic_chores_interval_slow =
+            (screen_off() && props->batteryLevel > SCREEN_OFF_MIN_LEVEL) ?
+            POLL_INTERVAL_SCREEN_OFF : POLL_INTERVAL_SLOW;
+
     // don't log to kernel
     return 1;
-}
\ No newline at end of file
+}
@@ -33,14 +33,19 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/poll.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <cutils/atomic.h>
 #include <cutils/str_parms.h>
 #include <cutils/sockets.h>
 
@@ -50,6 +55,23 @@
 #include <hardware/hardware.h>
 #include "audio_a2dp_hw.h"
 
+#ifdef HAS_BDROID_BUILDCFG
+#include "bdroid_buildcfg.h"
+#endif
+
+/* audio.a2dp.default is built without HAS_BDROID_BUILDCFG and the board
+   include dir, so the tuner of bluetooth/bdroid_buildcfg.h isn't seen
+   here. Default it to the same hawaii cpufreq floor. */
+#ifndef A2DP_HW_SYSFS_TUNER
+#define A2DP_HW_SYSFS_TUNER     "/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq"
+#endif
+#ifndef A2DP_HW_SYSFS_TUNER_ON
+#define A2DP_HW_SYSFS_TUNER_ON  "666666"
+#endif
+#ifndef A2DP_HW_SYSFS_TUNER_OFF
+#define A2DP_HW_SYSFS_TUNER_OFF "0"
+#endif
+
 #define LOG_TAG "audio_a2dp_hw"
 /* #define LOG_NDEBUG 0 */
 #include <cutils/log.h>
@@ -74,6 +96,50 @@ static int number =0;
 #define CTRL_CHAN_RETRY_COUNT 3
 #define USEC_PER_SEC 1000000L
 
+/* audio queued between out_write and the sender thread */
+#define A2DP_RING_MS 200
+/* how long standby waits for the queued audio to go out */
+#define A2DP_RING_DRAIN_EXTRA_MS 100
+/* same as the audioflinger playback threads */
+#define A2DP_SENDER_PRIORITY (-16)
+
+/* writes timestamped for the write-to-send latency at any one time */
+#define A2DP_STATS_STAMPS 16
+/* upper bounds of the write-to-send latency histogram buckets, the last
+   bucket takes everything above */
+#define A2DP_STATS_LAT_BUCKETS 8
+static const int a2dp_stats_lat_ms[A2DP_STATS_LAT_BUCKETS - 1] = {
+    5, 10, 20, 50, 100, 200, 500
+};
+
+/* get_parameters key returning the stream counters */
+#define A2DP_STATS_KEY "a2dp_stats"
+
+#ifdef A2DP_HW_SYSFS_TUNER
+/* If kernel supports some kind of A2DP related tuning, the sender thread
+   raises it while the stack can't keep up with the stream and lowers it
+   again once the stream has been running clean for a while.
+   Specify in BLUEDROID BUILDCFG the following values:
+   A2DP_HW_SYSFS_TUNER "/sysfs/path/to/tuner/or/scaling_min_freq"
+   A2DP_HW_SYSFS_TUNER_OFF "0"   # value to switch tuning off,
+                                 # "0" or a Min Freq off value
+                                 # like "0"
+   A2DP_HW_SYSFS_TUNER_ON "1"    # value to switch tuning on
+                                 # "1", or Min Freq boost value
+                                 # like "205000"
+*/
+/* period the back-pressure is judged over */
+#define A2DP_TUNER_WINDOW_MS 1000
+/* clean windows in a row before the boost is dropped */
+#define A2DP_TUNER_RELAX_WINDOWS 5
+/* the stack must drain at least this much of real time while it has
+   audio queued, or it is short of cpu */
+#define A2DP_TUNER_HEADROOM_PCT 95
+/* level kept after the stream stops, and idle time after which a new
+   stream starts boosted again */
+#define A2DP_TUNER_HOLD_MS 3000
+#endif
+
 #define CASE_RETURN_STR(const) case const: return #const;
 
 #define FNLOG()             ALOGV("%s", __FUNCTION__);
@@ -109,6 +175,70 @@ struct a2dp_config {
     int                     format;
 };
 
+/* Single producer (out_write) single consumer (sender thread) ring. The
+   indices are free running byte counts, each owned by one side; the lock
+   and cond are only used to sleep and wake up. */
+
+struct a2dp_ring {
+    uint8_t                 *buf;
+    uint32_t                size;
+    volatile int32_t        wr;          /* owned by out_write */
+    volatile int32_t        rd;          /* owned by the sender, or whoever paused it */
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    int                     fd;          /* socket to send to, -1 while paused */
+    bool                    busy;        /* sender is in skt_write */
+    bool                    exit;
+    volatile int32_t        error;       /* send failed, out_write resets the path */
+    volatile int32_t        frames_sent;
+    pthread_t               thread;
+    bool                    thread_running;
+};
+
+/* Counters kept for the life of the output stream, reported by out_dump
+   and the A2DP_STATS_KEY parameter. Updated atomically from out_write and
+   the sender thread. */
+
+struct a2dp_stamp {
+    int32_t                 end;         /* ring write index after the write */
+    int64_t                 queued_us;
+};
+
+struct a2dp_stats {
+    volatile int32_t        writes;
+    volatile int32_t        bytes_dropped;   /* ring full */
+    volatile int32_t        poll_timeouts;
+    volatile int32_t        short_sends;
+    volatile int32_t        send_errors;
+    volatile int32_t        emulated_delays; /* writes failed while starting */
+    volatile int32_t        emulated_delay_ms;
+    volatile int32_t        suspends;
+    volatile int32_t        standbys;
+    volatile int32_t        lat_hist[A2DP_STATS_LAT_BUCKETS];
+    volatile int32_t        lat_max_us;
+
+    /* queue times of the last writes, out_write adds, the sender retires */
+    struct a2dp_stamp       stamps[A2DP_STATS_STAMPS];
+    volatile int32_t        stamp_wr;
+    volatile int32_t        stamp_rd;
+};
+
+#ifdef A2DP_HW_SYSFS_TUNER
+/* owned by the sender thread */
+struct a2dp_tuner {
+    int                     fd;
+    bool                    boosted;
+    bool                    streamed;        /* a stream ran since the open */
+    int64_t                 idle_since_us;   /* stream paused, 0 while streaming */
+    int64_t                 window_start_us;
+    int64_t                 window_audio_us; /* audio sent within the window */
+    bool                    window_stress;   /* poll timed out within the window */
+    bool                    window_starved;  /* ran out of audio within the window */
+    int32_t                 window_dropped;  /* stats.bytes_dropped at the start */
+    int                     relax_windows;
+};
+#endif
+
 /* move ctrl_fd outside output stream and keep open until HAL unloaded ? */
 
 struct a2dp_stream_out {
@@ -119,6 +249,11 @@ struct a2dp_stream_out {
     size_t                  buffer_sz;
     a2dp_state_t            state;
     struct a2dp_config      cfg;
+    struct a2dp_ring        ring;
+    struct a2dp_stats       stats;
+#ifdef A2DP_HW_SYSFS_TUNER
+    struct a2dp_tuner       tuner;
+#endif
 };
 
 struct a2dp_stream_in {
@@ -162,34 +297,6 @@ static const char* dump_a2dp_ctrl_event(char event)
     }
 }
 
-#ifdef A2DP_HW_SYSFS_TUNER
-/* If kernel supports some kind of A2DP related tuning,
-   this function should be used to switch tuning on/off.
-   Specify in BLUEDROID BUILDCFG the following values:
-   A2DP_HW_SYSFS_TUNER "/sysfs/path/to/tuner/or/scaling_min_freq"
-   A2DP_HW_SYSFS_TUNER_OFF "0"   # value to switch tuning off,
-                                 # "0" or a Min Freq off value
-                                 # like "0"
-   A2DP_HW_SYSFS_TUNER_ON "1"    # value to switch tuning on
-                                 # "1", or Min Freq boost value
-                                 # like "205000"
-*/
-static void a2dp_hw_sysfs_tuning(int state)
-{
-    int fd = open( A2DP_HW_SYSFS_TUNER, O_WRONLY);
-    if(fd > 0) {
-        char *val = A2DP_HW_SYSFS_TUNER_OFF;
-        if (state)
-        {
-            val = A2DP_HW_SYSFS_TUNER_ON;
-        }
-        write(fd, val, strlen(val));
-        INFO("a2dp tuning set to %s", val);
-        close(fd);
-    }
-}
-#endif
-
 static int calc_audiotime(struct a2dp_config cfg, int bytes)
 {
     int chan_count = popcount(cfg.channel_flags);
@@ -200,6 +307,22 @@ static int calc_audiotime(struct a2dp_config cfg, int bytes)
     return bytes*(1000000/(chan_count*2))/cfg.rate;
 }
 
+/* inverse of calc_audiotime */
+static int calc_audiobytes(struct a2dp_config cfg, int us)
+{
+    int frame_sz = popcount(cfg.channel_flags) * 2;
+
+    return (int)((long long)us * cfg.rate / USEC_PER_SEC) * frame_sz;
+}
+
+static int64_t now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
 static void ts_error_log(char *tag, int val, int buff_size, struct a2dp_config cfg)
 {
     struct timespec now;
@@ -338,6 +461,545 @@ static int skt_disconnect(int fd)
     return 0;
 }
 
+/*****************************************************************************
+**
+**  STREAM STATISTICS
+**
+*****************************************************************************/
+
+/* remembers when the audio up to the current ring write index was queued,
+   skipped if the sender is that far behind */
+static void a2dp_stats_stamp(struct a2dp_stream_out *out)
+{
+    struct a2dp_stats *stats = &out->stats;
+    int32_t wr = stats->stamp_wr;
+    struct a2dp_stamp *stamp;
+
+    if (wr - android_atomic_acquire_load(&stats->stamp_rd) >= A2DP_STATS_STAMPS)
+        return;
+
+    stamp = &stats->stamps[(uint32_t)wr % A2DP_STATS_STAMPS];
+    stamp->end = out->ring.wr;
+    stamp->queued_us = now_us();
+    android_atomic_release_store(wr + 1, &stats->stamp_wr);
+}
+
+/* retires the writes fully sent once the ring read index reached rd */
+static void a2dp_stats_sent(struct a2dp_stream_out *out, int32_t rd)
+{
+    struct a2dp_stats *stats = &out->stats;
+    int32_t i = stats->stamp_rd;
+    int64_t now = 0;
+
+    while (i != android_atomic_acquire_load(&stats->stamp_wr))
+    {
+        struct a2dp_stamp *stamp = &stats->stamps[(uint32_t)i % A2DP_STATS_STAMPS];
+        int lat_us, b;
+
+        if (rd - stamp->end < 0)
+            break;
+
+        if (!now)
+            now = now_us();
+        lat_us = (int)(now - stamp->queued_us);
+
+        for (b = 0; b < A2DP_STATS_LAT_BUCKETS - 1; b++)
+            if (lat_us < a2dp_stats_lat_ms[b] * 1000)
+                break;
+        android_atomic_inc(&stats->lat_hist[b]);
+
+        /* only the sender updates it */
+        if (lat_us > stats->lat_max_us)
+            android_atomic_release_store(lat_us, &stats->lat_max_us);
+        i++;
+    }
+    android_atomic_release_store(i, &stats->stamp_rd);
+}
+
+/* forgets the queued writes along with the ring contents */
+static void a2dp_stats_drop_stamps(struct a2dp_stream_out *out)
+{
+    android_atomic_release_store(android_atomic_acquire_load(&out->stats.stamp_wr),
+                                 &out->stats.stamp_rd);
+}
+
+/* prints the counters as <name><kv><value> separated by sep */
+static int a2dp_stats_format(struct a2dp_stream_out *out, char *buf, size_t len,
+                             const char *kv, const char *sep)
+{
+    struct a2dp_stats *stats = &out->stats;
+    const struct {
+        const char *name;
+        volatile int32_t *val;
+    } counters[] = {
+        { "writes",             &stats->writes },
+        { "bytes_dropped",      &stats->bytes_dropped },
+        { "poll_timeouts",      &stats->poll_timeouts },
+        { "short_sends",        &stats->short_sends },
+        { "send_errors",        &stats->send_errors },
+        { "emulated_delays",    &stats->emulated_delays },
+        { "emulated_delay_ms",  &stats->emulated_delay_ms },
+        { "suspends",           &stats->suspends },
+        { "standbys",           &stats->standbys },
+        { "latency_max_us",     &stats->lat_max_us },
+    };
+    size_t i, n = 0;
+
+    buf[0] = 0;
+    for (i = 0; i < sizeof(counters) / sizeof(counters[0]) && n < len; i++)
+        n += snprintf(buf + n, len - n, "%s%s%s%d", i ? sep : "", counters[i].name, kv,
+                      android_atomic_acquire_load(counters[i].val));
+
+    for (i = 0; i < A2DP_STATS_LAT_BUCKETS && n < len; i++)
+    {
+        if (i < A2DP_STATS_LAT_BUCKETS - 1)
+            n += snprintf(buf + n, len - n, "%slatency_lt_%dms%s%d", sep,
+                          a2dp_stats_lat_ms[i], kv,
+                          android_atomic_acquire_load(&stats->lat_hist[i]));
+        else
+            n += snprintf(buf + n, len - n, "%slatency_ge_%dms%s%d", sep,
+                          a2dp_stats_lat_ms[i - 1], kv,
+                          android_atomic_acquire_load(&stats->lat_hist[i]));
+    }
+
+    return n < len ? (int)n : (int)len - 1;
+}
+
+#ifdef A2DP_HW_SYSFS_TUNER
+/*****************************************************************************
+**
+**  CPU FREQUENCY TUNING
+**
+*****************************************************************************/
+
+static void a2dp_tuner_open(struct a2dp_stream_out *out)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+
+    memset(tuner, 0, sizeof(*tuner));
+    tuner->fd = open(A2DP_HW_SYSFS_TUNER, O_WRONLY);
+    if (tuner->fd < 0)
+        ERROR("can't open %s (%s)", A2DP_HW_SYSFS_TUNER, strerror(errno));
+}
+
+static void a2dp_tuner_set(struct a2dp_stream_out *out, bool boost)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+    const char *val = boost ? A2DP_HW_SYSFS_TUNER_ON : A2DP_HW_SYSFS_TUNER_OFF;
+
+    if (tuner->fd < 0 || tuner->boosted == boost)
+        return;
+
+    if (pwrite(tuner->fd, val, strlen(val), 0) < 0)
+    {
+        ERROR("a2dp tuning failed (%s)", strerror(errno));
+        return;
+    }
+    tuner->boosted = boost;
+    INFO("a2dp tuning set to %s", val);
+}
+
+static void a2dp_tuner_close(struct a2dp_stream_out *out)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+
+    if (tuner->fd < 0)
+        return;
+
+    a2dp_tuner_set(out, false);
+    close(tuner->fd);
+    tuner->fd = -1;
+}
+
+static void a2dp_tuner_window_reset(struct a2dp_stream_out *out, int64_t now)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+
+    tuner->window_start_us = now;
+    tuner->window_audio_us = 0;
+    tuner->window_stress = false;
+    tuner->window_starved = false;
+    tuner->window_dropped = android_atomic_acquire_load(&out->stats.bytes_dropped);
+}
+
+/* Called by the sender waiting with the ring lock held. Returns true if it
+   did the waiting itself, to drop the boost once the hold time expired. */
+static bool a2dp_tuner_wait(struct a2dp_stream_out *out)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+    struct a2dp_ring *ring = &out->ring;
+    int64_t now, left_us;
+    struct timespec ts;
+
+    if (ring->fd >= 0)
+    {
+        /* streaming, out_write didn't keep up: nothing to judge the
+           stack's headroom by in this window */
+        tuner->window_starved = true;
+        return false;
+    }
+
+    now = now_us();
+    if (!tuner->idle_since_us)
+        tuner->idle_since_us = now;
+
+    if (!tuner->boosted)
+        return false;
+
+    left_us = tuner->idle_since_us + A2DP_TUNER_HOLD_MS * 1000LL - now;
+    if (left_us <= 0)
+    {
+        a2dp_tuner_set(out, false);
+        return true;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += left_us / USEC_PER_SEC;
+    ts.tv_nsec += (left_us % USEC_PER_SEC) * 1000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+    return true;
+}
+
+/* the sender is about to send after having been paused */
+static void a2dp_tuner_resume(struct a2dp_stream_out *out)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+    int64_t now = now_us();
+
+    /* a quick pause/resume keeps whatever level the stream was at, a new
+       stream starts boosted as setting up the codec is the costly part */
+    if (!tuner->streamed || now - tuner->idle_since_us >= A2DP_TUNER_HOLD_MS * 1000LL)
+    {
+        a2dp_tuner_set(out, true);
+        tuner->relax_windows = 0;
+    }
+    tuner->streamed = true;
+    tuner->idle_since_us = 0;
+    a2dp_tuner_window_reset(out, now);
+}
+
+/* accounts one skt_write, sent is its result */
+static void a2dp_tuner_sent(struct a2dp_stream_out *out, int sent)
+{
+    struct a2dp_tuner *tuner = &out->tuner;
+    int64_t now, wall_us;
+    bool stressed;
+
+    if (sent > 0)
+        tuner->window_audio_us += calc_audiotime(out->cfg, sent);
+    else if (sent == 0)
+        tuner->window_stress = true;
+
+    now = now_us();
+    wall_us = now - tuner->window_start_us;
+    if (wall_us < A2DP_TUNER_WINDOW_MS * 1000LL)
+        return;
+
+    stressed = tuner->window_stress ||
+               android_atomic_acquire_load(&out->stats.bytes_dropped) != tuner->window_dropped ||
+               (!tuner->window_starved &&
+                tuner->window_audio_us * 100 < wall_us * A2DP_TUNER_HEADROOM_PCT);
+
+    if (stressed)
+    {
+        /* raise right away, lower only after a clean streak */
+        a2dp_tuner_set(out, true);
+        tuner->relax_windows = 0;
+    }
+    else if (tuner->boosted && ++tuner->relax_windows >= A2DP_TUNER_RELAX_WINDOWS)
+    {
+        a2dp_tuner_set(out, false);
+        tuner->relax_windows = 0;
+    }
+
+    a2dp_tuner_window_reset(out, now);
+}
+#endif
+
+/*****************************************************************************
+**
+**  SENDER THREAD
+**
+**  out_write only queues the audio, the socket writes to the media task
+**  happen here so a stalled stack doesn't stall the audioflinger mixer.
+**
+*****************************************************************************/
+
+static uint32_t a2dp_ring_used(struct a2dp_ring *ring)
+{
+    return (uint32_t)(android_atomic_acquire_load(&ring->wr) -
+                      android_atomic_acquire_load(&ring->rd));
+}
+
+static void a2dp_ring_wakeup(struct a2dp_ring *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void *a2dp_sender_thread(void *arg)
+{
+    struct a2dp_stream_out *out = (struct a2dp_stream_out *)arg;
+    struct a2dp_ring *ring = &out->ring;
+    int frame_sz = popcount(out->cfg.channel_flags) * 2;
+
+    prctl(PR_SET_NAME, (unsigned long)"a2dp_sender", 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, A2DP_SENDER_PRIORITY);
+
+    pthread_mutex_lock(&ring->lock);
+    for (;;)
+    {
+        uint32_t used, offset, len;
+        int fd, sent;
+
+        while (!ring->exit && (ring->fd < 0 || a2dp_ring_used(ring) == 0))
+        {
+#ifdef A2DP_HW_SYSFS_TUNER
+            if (a2dp_tuner_wait(out))
+                continue;
+#endif
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        }
+
+        if (ring->exit)
+            break;
+
+        fd = ring->fd;
+        ring->busy = true;
+        pthread_mutex_unlock(&ring->lock);
+
+#ifdef A2DP_HW_SYSFS_TUNER
+        if (out->tuner.idle_since_us || !out->tuner.streamed)
+            a2dp_tuner_resume(out);
+#endif
+
+        /* one contiguous chunk, at most what the socket buffer holds */
+        used = a2dp_ring_used(ring);
+        offset = (uint32_t)ring->rd % ring->size;
+        len = ring->size - offset;
+        if (len > used)
+            len = used;
+        if (len > out->buffer_sz)
+            len = out->buffer_sz;
+
+        sent = skt_write(fd, ring->buf + offset, len);
+
+        if (sent > 0)
+        {
+            if ((uint32_t)sent < len)
+                android_atomic_inc(&out->stats.short_sends);
+            android_atomic_release_store(ring->rd + sent, &ring->rd);
+            android_atomic_add(sent / frame_sz, &ring->frames_sent);
+            a2dp_stats_sent(out, ring->rd);
+        }
+        else if (sent == 0)
+        {
+            /* skt_write poll timed out, the stack isn't reading */
+            android_atomic_inc(&out->stats.poll_timeouts);
+        }
+        else
+        {
+            /* drop what is queued, out_write takes it from here */
+            android_atomic_inc(&out->stats.send_errors);
+            android_atomic_release_store(android_atomic_acquire_load(&ring->wr), &ring->rd);
+            a2dp_stats_drop_stamps(out);
+            android_atomic_release_store(1, &ring->error);
+        }
+
+#ifdef A2DP_HW_SYSFS_TUNER
+        a2dp_tuner_sent(out, sent);
+#endif
+
+        pthread_mutex_lock(&ring->lock);
+        ring->busy = false;
+        if (sent < 0)
+            ring->fd = -1;
+        /* wakes up out_write waiting for space, and pause/drain */
+        pthread_cond_broadcast(&ring->cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+static int a2dp_ring_init(struct a2dp_stream_out *out)
+{
+    struct a2dp_ring *ring = &out->ring;
+    uint32_t size = calc_audiobytes(out->cfg, A2DP_RING_MS * 1000);
+
+    /* at least two writes, in whole writes */
+    if (size < 2 * out->buffer_sz)
+        size = 2 * out->buffer_sz;
+    size = (size + out->buffer_sz - 1) / out->buffer_sz * out->buffer_sz;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->buf = malloc(size);
+    if (!ring->buf)
+        return -ENOMEM;
+    ring->size = size;
+    ring->fd = -1;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+#ifdef A2DP_HW_SYSFS_TUNER
+    a2dp_tuner_open(out);
+#endif
+
+    if (pthread_create(&ring->thread, NULL, a2dp_sender_thread, out) != 0)
+    {
+        ERROR("sender thread failed (%s)", strerror(errno));
+#ifdef A2DP_HW_SYSFS_TUNER
+        a2dp_tuner_close(out);
+#endif
+        free(ring->buf);
+        ring->buf = NULL;
+        return -1;
+    }
+    ring->thread_running = true;
+
+    INFO("ring %d bytes (%d ms)", size, calc_audiotime(out->cfg, size) / 1000);
+    return 0;
+}
+
+static void a2dp_ring_destroy(struct a2dp_stream_out *out)
+{
+    struct a2dp_ring *ring = &out->ring;
+
+    if (ring->thread_running)
+    {
+        pthread_mutex_lock(&ring->lock);
+        ring->exit = true;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->thread, NULL);
+        ring->thread_running = false;
+    }
+#ifdef A2DP_HW_SYSFS_TUNER
+    a2dp_tuner_close(out);
+#endif
+    free(ring->buf);
+    ring->buf = NULL;
+}
+
+/* lets the sender write to fd from now on */
+static void a2dp_sender_resume(struct a2dp_stream_out *out, int fd)
+{
+    struct a2dp_ring *ring = &out->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    android_atomic_release_store(0, &ring->error);
+    ring->fd = fd;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Stops the sender before the socket goes away. Queued audio is dropped,
+   unless drain_ms is set: then it is given that long to go out first. */
+static void a2dp_sender_pause(struct a2dp_stream_out *out, int drain_ms)
+{
+    struct a2dp_ring *ring = &out->ring;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += drain_ms / 1000;
+    ts.tv_nsec += (drain_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while (drain_ms > 0 && ring->fd >= 0 && a2dp_ring_used(ring) > 0)
+    {
+        if (pthread_cond_timedwait(&ring->cond, &ring->lock, &ts) == ETIMEDOUT)
+        {
+            INFO("drain timed out, %d bytes dropped", a2dp_ring_used(ring));
+            break;
+        }
+    }
+
+    ring->fd = -1;
+    while (ring->busy)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+
+    /* sender is idle, the read side is ours */
+    android_atomic_release_store(android_atomic_acquire_load(&ring->wr), &ring->rd);
+    a2dp_stats_drop_stamps(out);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Queues the buffer. Waits at most the time the buffer represents for
+   room, anything that doesn't fit by then is dropped. */
+static void a2dp_ring_write(struct a2dp_stream_out *out, const void *buffer, size_t bytes)
+{
+    struct a2dp_ring *ring = &out->ring;
+    const uint8_t *src = buffer;
+    size_t left = bytes;
+    struct timespec ts;
+    bool waited = false;
+
+    while (left > 0)
+    {
+        uint32_t space = ring->size - a2dp_ring_used(ring);
+        uint32_t offset, len;
+
+        if (space == 0)
+        {
+            int us = calc_audiotime(out->cfg, bytes);
+            int ret = 0;
+
+            pthread_mutex_lock(&ring->lock);
+            if (!waited)
+            {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += us / USEC_PER_SEC;
+                ts.tv_nsec += (us % USEC_PER_SEC) * 1000L;
+                if (ts.tv_nsec >= 1000000000L)
+                {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                waited = true;
+            }
+            while (ret == 0 && a2dp_ring_used(ring) == ring->size)
+                ret = pthread_cond_timedwait(&ring->cond, &ring->lock, &ts);
+            pthread_mutex_unlock(&ring->lock);
+
+            if (ret == ETIMEDOUT)
+            {
+                DEBUG("ring full, dropping %d bytes", left);
+                android_atomic_add(left, &out->stats.bytes_dropped);
+                break;
+            }
+            continue;
+        }
+
+        offset = (uint32_t)ring->wr % ring->size;
+        len = ring->size - offset;
+        if (len > space)
+            len = space;
+        if (len > left)
+            len = left;
+
+        memcpy(ring->buf + offset, src, len);
+        android_atomic_release_store(ring->wr + len, &ring->wr);
+        src += len;
+        left -= len;
+
+        a2dp_ring_wakeup(ring);
+    }
+
+    if (left < bytes)
+        a2dp_stats_stamp(out);
+}
+
 
 
 /*****************************************************************************
@@ -484,9 +1146,13 @@ static int start_audio_datapath(struct a2dp_stream_out *out)
         out->state = AUDIO_A2DP_STATE_STARTED;
     }
 
-#ifdef A2DP_HW_SYSFS_TUNER
-    a2dp_hw_sysfs_tuning(1);
-#endif
+    /* the render position counts from the end of standby, the sender is
+       still paused here */
+    if (oldstate == AUDIO_A2DP_STATE_STANDBY)
+        android_atomic_release_store(0, &out->ring.frames_sent);
+
+    a2dp_sender_resume(out, out->audio_fd);
+
     return 0;
 }
 
@@ -497,11 +1163,6 @@ static int stop_audio_datapath(struct a2dp_stream_out *out)
 
     INFO("state %s", dump_a2dp_hal_state(out->state));
 
-#ifdef A2DP_HW_SYSFS_TUNER
-    /* disable a2dp tuning  ASAP */
-    a2dp_hw_sysfs_tuning(0);
-#endif
-
     if (out->ctrl_fd == AUDIO_SKT_DISCONNECTED)
          return -1;
 
@@ -519,6 +1180,7 @@ static int stop_audio_datapath(struct a2dp_stream_out *out)
     out->state = AUDIO_A2DP_STATE_STOPPED;
 
     /* disconnect audio path */
+    a2dp_sender_pause(out, 0);
     skt_disconnect(out->audio_fd);
     out->audio_fd = AUDIO_SKT_DISCONNECTED;
 
@@ -529,24 +1191,32 @@ static int suspend_audio_datapath(struct a2dp_stream_out *out, bool standby)
 {
     INFO("state %s", dump_a2dp_hal_state(out->state));
 
-#ifdef A2DP_HW_SYSFS_TUNER
-    /* disable a2dp tuning ASAP */
-    a2dp_hw_sysfs_tuning(0);
-#endif
-
     if (out->ctrl_fd == AUDIO_SKT_DISCONNECTED)
          return -1;
 
     if (out->state == AUDIO_A2DP_STATE_STOPPING)
         return -1;
 
+    /* on standby let the tail of the stream play out, a suspend is now */
+    a2dp_sender_pause(out, standby ? calc_audiotime(out->cfg, out->ring.size) / 1000 +
+                                     A2DP_RING_DRAIN_EXTRA_MS : 0);
+
     if (a2dp_command(out, A2DP_CTRL_CMD_SUSPEND) < 0)
+    {
+        a2dp_sender_resume(out, out->audio_fd);
         return -1;
+    }
 
     if (standby)
+    {
         out->state = AUDIO_A2DP_STATE_STANDBY;
+        android_atomic_inc(&out->stats.standbys);
+    }
     else
+    {
         out->state = AUDIO_A2DP_STATE_SUSPENDED;
+        android_atomic_inc(&out->stats.suspends);
+    }
 
     /* disconnect audio path */
     skt_disconnect(out->audio_fd);
@@ -592,7 +1262,6 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
     struct a2dp_stream_out *out = (struct a2dp_stream_out *)stream;
-    int sent;
     #ifdef BT_AUDIO_SYSTRACE_LOG
     char trace_buf[512];
     #endif
@@ -600,6 +1269,21 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     DEBUG("write %d bytes (fd %d)", bytes, out->audio_fd);
 
     pthread_mutex_lock(&out->lock);
+
+    /* the sender failed writing the socket */
+    if (android_atomic_and(0, &out->ring.error))
+    {
+        a2dp_sender_pause(out, 0);
+        skt_disconnect(out->audio_fd);
+        out->audio_fd = AUDIO_SKT_DISCONNECTED;
+        if (out->state != AUDIO_A2DP_STATE_SUSPENDED)
+            out->state = AUDIO_A2DP_STATE_STOPPED;
+        else
+            ERROR("write failed : stream suspended, avoid resetting state");
+        pthread_mutex_unlock(&out->lock);
+        return -1;
+    }
+
     if (out->state == AUDIO_A2DP_STATE_SUSPENDED)
     {
         INFO("stream suspended");
@@ -619,6 +1303,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
             int us_delay = calc_audiotime(out->cfg, bytes);
 
             ERROR("emulate a2dp write delay (%d us)", us_delay);
+            android_atomic_inc(&out->stats.emulated_delays);
+            android_atomic_add(us_delay / 1000, &out->stats.emulated_delay_ms);
 
             usleep(us_delay);
             pthread_mutex_unlock(&out->lock);
@@ -651,7 +1337,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     }
     #endif
 
-    sent = skt_write(out->audio_fd, buffer,  bytes);
+    android_atomic_inc(&out->stats.writes);
+    a2dp_ring_write(out, buffer, bytes);
 
     #ifdef BT_AUDIO_SYSTRACE_LOG
     if (PERF_SYSTRACE)
@@ -660,18 +1347,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     }
     #endif
 
-    if (sent == -1)
-    {
-        skt_disconnect(out->audio_fd);
-        out->audio_fd = AUDIO_SKT_DISCONNECTED;
-        if (out->state != AUDIO_A2DP_STATE_SUSPENDED)
-            out->state = AUDIO_A2DP_STATE_STOPPED;
-        else
-            ERROR("write failed : stream suspended, avoid resetting state");
-    }
-
-    DEBUG("wrote %d bytes out of %d bytes", sent, bytes);
-    return sent;
+    DEBUG("queued %d bytes", bytes);
+    return bytes;
 }
 
 
@@ -757,7 +1434,17 @@ static int out_standby(struct audio_stream *stream)
 static int out_dump(const struct audio_stream *stream, int fd)
 {
     struct a2dp_stream_out *out = (struct a2dp_stream_out *)stream;
+    char buf[1024];
+    int len;
+
     FNLOG();
+
+    len = snprintf(buf, sizeof(buf), "A2DP output stream:\n  state: %s\n  ",
+                   dump_a2dp_hal_state(out->state));
+    write(fd, buf, len);
+    len = a2dp_stats_format(out, buf, sizeof(buf) - 1, ": ", "\n  ");
+    buf[len++] = '\n';
+    write(fd, buf, len);
     return 0;
 }
 
@@ -825,12 +1512,32 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
 {
     struct a2dp_stream_out *out = (struct a2dp_stream_out *)stream;
+    struct str_parms *query;
+    struct str_parms *reply;
+    char value[1024];
+    char *str;
 
     FNLOG();
 
-    /* add populating param here */
+    query = str_parms_create_str(keys);
+    if (!query || !str_parms_has_key(query, A2DP_STATS_KEY))
+    {
+        if (query)
+            str_parms_destroy(query);
+        return strdup("");
+    }
+
+    /* counters as name:value,name:value so they survive the key=value;
+       encoding */
+    a2dp_stats_format(out, value, sizeof(value), ":", ",");
 
-    return strdup("");
+    reply = str_parms_create();
+    str_parms_add_str(reply, A2DP_STATS_KEY, value);
+    str = str_parms_to_str(reply);
+    str_parms_destroy(reply);
+    str_parms_destroy(query);
+
+    return str;
 }
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
@@ -845,6 +1552,8 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
                     audio_stream_frame_size(&out->stream.common) /
                     out->cfg.rate) * 1000;
 
+    /* plus what is queued in the ring right now */
+    latency_us += calc_audiotime(out->cfg, a2dp_ring_used(&out->ring));
 
     return (latency_us / 1000) + 200;
 }
@@ -861,11 +1570,19 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
 
 
 
+/* frames handed to the media task since the stream last left standby */
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
+    struct a2dp_stream_out *out = (struct a2dp_stream_out *)stream;
+
     FNLOG();
-    return -EINVAL;
+
+    if (!dsp_frames)
+        return -EINVAL;
+
+    *dsp_frames = (uint32_t)android_atomic_acquire_load(&out->ring.frames_sent);
+    return 0;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -1022,6 +1739,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     /* initialize a2dp specifics */
     a2dp_stream_out_init(out);
 
+    if (a2dp_ring_init(out) < 0)
+    {
+        free(out);
+        *stream_out = NULL;
+        return -ENOMEM;
+    }
+
    /* set output config values */
    if (config)
    {
@@ -1065,6 +1789,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     return 0;
 
 err_open:
+    a2dp_ring_destroy(out);
     free(out);
     *stream_out = NULL;
     a2dp_dev->output = NULL;
@@ -1088,6 +1813,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     fclose (outputpcmsamplefile);
     #endif
 
+    a2dp_ring_destroy(out);
     skt_disconnect(out->ctrl_fd);
     free(stream);
     a2dp_dev->output = NULL;
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <utils/Errors.h>
+#include <utils/Vector.h>
 
 #include <OMX_Video.h>
 
@@ -51,6 +52,16 @@ struct ColorConverter {
             size_t dstCropLeft, size_t dstCropTop,
             size_t dstCropRight, size_t dstCropBottom);
 
+    // Splits each conversion into up to |count| horizontal stripes, aligned
+    // to chroma row pairs, that run on a worker pool shared by all
+    // converters in the process. 0 or 1 converts on the caller's thread.
+    // Defaults to the value of media.stagefright.cc-stripes.
+    void setStripeCount(size_t count);
+
+    // Returns how long each stripe of the last convert() took, in us.
+    // Empty if the last conversion ran on the caller's thread only.
+    void getLastStripeTimesUs(Vector<int64_t> *timesUs) const;
+
 private:
     struct BitmapParams {
         BitmapParams(
@@ -70,29 +81,50 @@ private:
     OMX_COLOR_FORMATTYPE mSrcFormat, mDstFormat;
     uint8_t *mClip;
 
+    // True if the NEON row kernels may be used, decided once at construction
+    // from the CPU's hwcaps.
+    bool mUseNeon;
+
+    size_t mStripeCount;
+    Vector<int64_t> mLastStripeTimesUs;
+
+    struct StripeContext;
+    static void ConvertStripe(void *cookie, size_t index);
+
 #ifdef MTK_HARDWARE
     MtkColorConverter *mMtkColorConverter;
 #endif
 
     uint8_t *initClip();
 
+    // Converts the crop rows [yStart, yEnd) of |src|, yStart must be even.
+    status_t convertRows(
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);
+
     status_t convertCbYCrY(
-            const BitmapParams &src, const BitmapParams &dst);
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);
 			
 	status_t convertYCbYCr(
-            const BitmapParams &src, const BitmapParams &dst);		
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);		
 
     status_t convertYUV420Planar(
-            const BitmapParams &src, const BitmapParams &dst);
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);
 
     status_t convertQCOMYUV420SemiPlanar(
-            const BitmapParams &src, const BitmapParams &dst);
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);
 
     status_t convertYUV420SemiPlanar(
-            const BitmapParams &src, const BitmapParams &dst);
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);
 
     status_t convertTIYUV420PackedSemiPlanar(
-            const BitmapParams &src, const BitmapParams &dst);
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t yStart, size_t yEnd);
 
     ColorConverter(const ColorConverter &);
     ColorConverter &operator=(const ColorConverter &);
@@ -49,6 +49,8 @@
 #endif
 
 #include "include/avc_utils.h"
+#include "include/BrcmFormatCache.h"
+#include "include/BrcmPatchTrace.h"
 #ifdef QCOM_HARDWARE
 #include "include/ExtendedUtils.h"
 #endif
@@ -654,20 +656,19 @@ status_t ACodec::configureOutputBuffersFromNativeWindow(
 	
 	OMX_COLOR_FORMATTYPE HalColorFormat;
 	
-	ALOGI("PATCH:ACodec:configureOutputBuffersFromNativeWindow def.format.video.eColorFormat: %i", def.format.video.eColorFormat);
 	switch (def.format.video.eColorFormat) {
 		case OMX_COLOR_FormatYCbYCr:
-			ALOGI("PATCH:ACodec:configureOutputBuffersFromNativeWindow def.format.video.eColorFormat: OMX_COLOR_FormatYCbYCr (%i) -> (%i)", OMX_COLOR_FormatYCbYCr, (OMX_COLOR_FORMATTYPE)19);
 			def.format.video.eColorFormat = OMX_COLOR_FormatYUV420Planar;
 			mOMX->setParameter(mNode, OMX_IndexParamPortDefinition, &def, sizeof(def));
-			ALOGI("PATCH:ACodec:configureOutputBuffersFromNativeWindow def.format.video.eColorFormat: OMX_COLOR_FormatYCbYCr (%i) -> (%i) -> HAL_PIXEL_FORMAT_YV12 (%i)", OMX_COLOR_FormatYCbYCr, (OMX_COLOR_FORMATTYPE)19, (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12);
 			HalColorFormat = (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12;	
 		break;
 		default:
-			ALOGI("PATCH:ACodec:configureOutputBuffersFromNativeWindow def.format.video.eColorFormat: default(%i) -> HAL_PIXEL_FORMAT_YV12 (%i)", def.format.video.eColorFormat, (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12);
 			HalColorFormat = (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12;	
 		break;
 	}
+	PATCH_TRACE_FORMAT("ACodec:configureOutputBuffersFromNativeWindow",
+			mComponentName.c_str(), def.format.video.eColorFormat,
+			HalColorFormat);
 	
     err = native_window_set_buffers_geometry(
             mNativeWindow.get(),
@@ -1841,30 +1842,50 @@ status_t ACodec::setVideoPortFormatType(
     format.nIndex = 0;
     bool found = false;
 	
-	ALOGI("PATCH:ACodec:setVideoPortFormatType Begin colorFormat: %i", colorFormat);
-	ALOGI("PATCH:ACodec:setVideoPortFormatType Begin format.eColorFormat: %i", format.eColorFormat);
+	PATCH_TRACE("ACodec:setVideoPortFormatType Begin colorFormat: %i", colorFormat);
+	PATCH_TRACE("ACodec:setVideoPortFormatType Begin format.eColorFormat: %i", format.eColorFormat);
 	
 	if(format.eColorFormat == OMX_COLOR_FormatYCbYCr){
 		if (!strncmp(mComponentName.c_str(), "OMX.brcm.", 9)){
-			ALOGI("PATCH:ACodec:setVideoPortFormatType is brcm");
+			PATCH_TRACE("ACodec:setVideoPortFormatType is brcm");
 			format.eColorFormat = OMX_COLOR_FormatYUV420Planar;
 			status_t errs = mOMX->setParameter(mNode, OMX_IndexParamVideoPortFormat, &format, sizeof(format));
 				if (errs != OK){
 					ALOGE("PATCH:ACodec:setVideoPortFormatType setParameter failed: %d", errs);
 				}
-			ALOGI("PATCH:ACodec:setVideoPortFormatType format.eColorFormat set %i", format.eColorFormat);
+			PATCH_TRACE("ACodec:setVideoPortFormatType format.eColorFormat set %i", format.eColorFormat);
 		}
 	}
-	ALOGI("PATCH:ACodec:setVideoPortFormatType End format.eColorFormat : %i", format.eColorFormat);
+	PATCH_TRACE("ACodec:setVideoPortFormatType End format.eColorFormat : %i", format.eColorFormat);
 	if(colorFormat == OMX_COLOR_FormatYCbYCr){
 		if (!strncmp(mComponentName.c_str(), "OMX.brcm.", 9)){
-			ALOGI("PATCH:ACodec:setVideoPortFormatType is brcm");
+			PATCH_TRACE("ACodec:setVideoPortFormatType is brcm");
 			colorFormat = OMX_COLOR_FormatYUV420Planar;
-			ALOGI("PATCH:ACodec:setVideoPortFormatType colorFormat set %i", colorFormat);
+			PATCH_TRACE("ACodec:setVideoPortFormatType colorFormat set %i", colorFormat);
 		}
 	}
-	ALOGI("PATCH:ACodec:setVideoPortFormatType End format.eColorFormat : %i", colorFormat);
+	PATCH_TRACE("ACodec:setVideoPortFormatType End format.eColorFormat : %i", colorFormat);
 	
+	String8 cacheKey;
+	bool cacheable = BrcmFormatCache::isCacheable(mComponentName.c_str());
+	if (cacheable) {
+		cacheKey = BrcmFormatCache::makeKey(
+				mComponentName.c_str(),
+				String8::format("%d:%d", compressionFormat, colorFormat).string(),
+				0, 0, portIndex);
+
+		BrcmFormatCache::Entry cached;
+		if (BrcmFormatCache::lookup(cacheKey, &cached)) {
+			status_t err = mOMX->setParameter(
+					mNode, OMX_IndexParamVideoPortFormat,
+					&cached.mPortFormat, sizeof(cached.mPortFormat));
+			if (err == OK && BrcmFormatCache::verify(
+						mOMX, mNode, cached.mPortFormat)) {
+				return OK;
+			}
+			BrcmFormatCache::invalidate(cacheKey);
+		}
+	}
 
     OMX_U32 index = 0;
     for (;;) {
@@ -1905,25 +1926,29 @@ status_t ACodec::setVideoPortFormatType(
     }
 
     if (!found) {
-		ALOGI("PATCH:ACodec:setVideoPortFormatType UNKNOWN_ERROR");
+		PATCH_TRACE("ACodec:setVideoPortFormatType UNKNOWN_ERROR");
         return UNKNOWN_ERROR;
     }
 	
-	ALOGI("PATCH:ACodec:setVideoPortFormatType : %i", format.eColorFormat);
+	PATCH_TRACE("ACodec:setVideoPortFormatType : %i", format.eColorFormat);
 	
 	if(format.eColorFormat == OMX_COLOR_FormatYCbYCr){
 		if (!strncmp(mComponentName.c_str(), "OMX.brcm.", 9)){
-			ALOGI("PATCH:ACodec:setVideoPortFormatType is brcm");
+			PATCH_TRACE("ACodec:setVideoPortFormatType is brcm");
 			format.eColorFormat = OMX_COLOR_FormatYUV420Planar;
-			ALOGI("PATCH:ACodec:setVideoPortFormatType set %i", format.eColorFormat);
+			PATCH_TRACE("ACodec:setVideoPortFormatType set %i", format.eColorFormat);
 		}
 	}
-	ALOGI("PATCH:ACodec:setVideoPortFormatType end : %i", format.eColorFormat);
+	PATCH_TRACE("ACodec:setVideoPortFormatType end : %i", format.eColorFormat);
 
     status_t err = mOMX->setParameter(
             mNode, OMX_IndexParamVideoPortFormat,
             &format, sizeof(format));
 
+    if (err == OK && cacheable) {
+        BrcmFormatCache::storePortFormat(cacheKey, format);
+    }
+
     return err;
 }
 
@@ -1937,23 +1962,23 @@ status_t ACodec::setSupportedOutputFormat() {
             mNode, OMX_IndexParamVideoPortFormat,
             &format, sizeof(format));
 			
-	ALOGI("PATCH:ACodec:setSupportedOutputFormat : %i", format.eColorFormat);
+	PATCH_TRACE("ACodec:setSupportedOutputFormat : %i", format.eColorFormat);
 	
     CHECK_EQ(err, (status_t)OK);
     CHECK_EQ((int)format.eCompressionFormat, (int)OMX_VIDEO_CodingUnused);
 	
 	if(format.eColorFormat == OMX_COLOR_FormatYCbYCr){
 		if (!strncmp(mComponentName.c_str(), "OMX.brcm.", 9)){
-			ALOGI("PATCH:ACodec:setSupportedOutputFormat is brcm");
+			PATCH_TRACE("ACodec:setSupportedOutputFormat is brcm");
 			format.eColorFormat = OMX_COLOR_FormatYUV420Planar;
 			status_t errs = mOMX->setParameter(mNode, OMX_IndexParamVideoPortFormat, &format, sizeof(format));
 				if (errs != OK){
 					ALOGE("PATCH:ACodec:setSupportedOutputFormat setParameter failed: %d", errs);
 				}
-			ALOGI("PATCH:ACodec:setSupportedOutputFormat format.eColorFormat set %i", format.eColorFormat);
+			PATCH_TRACE("ACodec:setSupportedOutputFormat format.eColorFormat set %i", format.eColorFormat);
 		}
 	}
-	ALOGI("PATCH:ACodec:setSupportedOutputFormat end : %i", format.eColorFormat);
+	PATCH_TRACE("ACodec:setSupportedOutputFormat end : %i", format.eColorFormat);
 	
 	mOMX->setParameter(
             mNode, OMX_IndexParamVideoPortFormat,
@@ -2653,11 +2678,11 @@ status_t ACodec::setVideoFormatOnPort(
 
     CHECK_EQ(err, (status_t)OK);
 	
-	ALOGI("PATCH:ACodec:setVideoFormatOnPort: %i", def.format.video.eColorFormat);
+	PATCH_TRACE("ACodec:setVideoFormatOnPort: %i", def.format.video.eColorFormat);
 	
 	if(def.format.video.eColorFormat == OMX_COLOR_FormatYCbYCr){
 		if (!strncmp(mComponentName.c_str(), "OMX.brcm.", 9)){
-			ALOGI("PATCH:ACodec:setVideoFormatOnPort set %i", OMX_COLOR_FormatYUV420Planar);
+			PATCH_TRACE("ACodec:setVideoFormatOnPort set %i", OMX_COLOR_FormatYUV420Planar);
 			def.format.video.eColorFormat = OMX_COLOR_FormatYUV420Planar;
 			status_t errs = mOMX->setParameter(mNode, OMX_IndexParamPortDefinition, &def, sizeof(def));
 			if (errs != OK){
@@ -2666,7 +2691,7 @@ status_t ACodec::setVideoFormatOnPort(
 		}		
 	}
 	
-	ALOGI("PATCH:ACodec:setVideoFormatOnPort: %i end", def.format.video.eColorFormat);
+	PATCH_TRACE("ACodec:setVideoFormatOnPort: %i end", def.format.video.eColorFormat);
 
     if (portIndex == kPortIndexInput) {
         // XXX Need a (much) better heuristic to compute input buffer sizes.
@@ -2829,7 +2854,7 @@ void ACodec::sendFormatChange(const sp<AMessage> &reply) {
                 notify->setInt32("slice-height", videoDef->nSliceHeight);
                 notify->setInt32("color-format", videoDef->eColorFormat);
 				
-				ALOGI("PATCH:ACodec:sendFormatChange: %i", videoDef->eColorFormat);
+				PATCH_TRACE("ACodec:sendFormatChange: %i", videoDef->eColorFormat);
 
                 OMX_CONFIG_RECTTYPE rect;
                 InitOMXParams(&rect);
@@ -29,10 +29,13 @@
 #endif
 
 #include "include/ESDS.h"
+#include "include/BrcmFormatCache.h"
+#include "include/BrcmPatchTrace.h"
 
 #include <binder/IServiceManager.h>
 #include <binder/MemoryDealer.h>
 #include <binder/ProcessState.h>
+#include <private/android_filesystem_config.h>
 #include <HardwareAPI.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/IMediaPlayerService.h>
@@ -45,6 +48,7 @@
 #include <media/stagefright/OMXCodec.h>
 #include <media/stagefright/Utils.h>
 #include <media/stagefright/SkipCutBuffer.h>
+#include <utils/KeyedVector.h>
 #include <utils/Vector.h>
 
 #include <OMX_Audio.h>
@@ -84,6 +88,13 @@
 #include <bufferallocator/OMXCodecBufferAllocator.h>
 #endif
 
+#include <cutils/properties.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace android {
 
 #ifdef USE_SAMSUNG_COLORFORMAT
@@ -501,7 +512,7 @@ sp<MediaSource> OMXCodec::Create(
     CHECK(success);
     Vector<CodecNameAndQuirks> matchingCodecs;
 	
-	ALOGI("PATCH:OMXCodec:Create mime: %s", mime);
+	PATCH_TRACE("OMXCodec:Create mime: %s", mime);
 
 #ifdef QCOM_HARDWARE
     ExtendedCodec::kHEVCCodecType hevc_codectype = ExtendedCodec::useHEVCDecoder(mime);
@@ -1099,7 +1110,7 @@ status_t OMXCodec::setVideoPortFormatType(
         status_t err = mOMX->getParameter(
                 mNode, OMX_IndexParamVideoPortFormat,
                 &format, sizeof(format));
-		ALOGI("PATCH:OMXCodec:setVideoPortFormatType : %i", format.eColorFormat);
+		PATCH_TRACE("OMXCodec:setVideoPortFormatType : %i", format.eColorFormat);
         if (err != OK) {
             return err;
         }
@@ -1152,7 +1163,7 @@ status_t OMXCodec::setVideoPortFormatType(
     status_t err = mOMX->setParameter(
             mNode, OMX_IndexParamVideoPortFormat,
             &format, sizeof(format));
-	ALOGI("PATCH:OMXCodec:setVideoPortFormatType end : %i", format.eColorFormat);		
+	PATCH_TRACE("OMXCodec:setVideoPortFormatType end : %i", format.eColorFormat);		
 
     return err;
 }
@@ -1789,8 +1800,38 @@ status_t OMXCodec::setVideoOutputFormat(
         return err;
     }
 
+    // Only the default output format is cached, an explicitly requested
+    // color format still goes through the enumeration below.
+    int32_t requestedColorFormat;
+    bool cacheable = BrcmFormatCache::isCacheable(mComponentName)
+        && !meta->findInt32(kKeyColorFormat, &requestedColorFormat);
+
+    String8 cacheKey;
+    bool usedCachedFormat = false;
+    if (cacheable) {
+        cacheKey = BrcmFormatCache::makeKey(
+                mComponentName, mime, width, height, kPortIndexOutput);
+
+        BrcmFormatCache::Entry cached;
+        if (BrcmFormatCache::lookup(cacheKey, &cached)) {
+            err = mOMX->setParameter(
+                    mNode, OMX_IndexParamVideoPortFormat,
+                    &cached.mPortFormat, sizeof(cached.mPortFormat));
+
+            if (err == OK && BrcmFormatCache::verify(
+                        mOMX, mNode, cached.mPortFormat)) {
+                PATCH_TRACE_FORMAT("OMXCodec:setVideoOutputFormat cached",
+                        mComponentName, cached.mPortFormat.eColorFormat,
+                        cached.mHalFormat);
+                usedCachedFormat = true;
+            } else {
+                BrcmFormatCache::invalidate(cacheKey);
+            }
+        }
+    }
+
 #if 1
-    {
+    if (!usedCachedFormat) {
         OMX_VIDEO_PARAM_PORTFORMATTYPE format;
         InitOMXParams(&format);
         format.nPortIndex = kPortIndexOutput;
@@ -1801,15 +1842,14 @@ status_t OMXCodec::setVideoOutputFormat(
                 &format, sizeof(format));
         CHECK_EQ(err, (status_t)OK);
 		
-		ALOGI("PATCH:OMXCodec:setVideoOutputFormat begin : %i, component %s", format.eColorFormat, mComponentName);
+		PATCH_TRACE_FORMAT("OMXCodec:setVideoOutputFormat",
+				mComponentName, format.eColorFormat, -1);
         CHECK_EQ((int)format.eCompressionFormat, (int)OMX_VIDEO_CodingUnused);
 		
 		if (format.eColorFormat == OMX_COLOR_FormatYCbYCr) {
-			ALOGI("PATCH:OMXCodec:setVideoOutputFormat: OMX_COLOR_FormatYCbYCr");
 			if (!strncmp(mComponentName, "OMX.brcm.", 9)){
-				ALOGI("PATCH:OMXCodec:setVideoOutputFormat: OMX.brcm.");
 				format.eColorFormat = OMX_COLOR_FormatYUV420Planar;
-				ALOGI("PATCH:OMXCodec:setVideoOutputFormat: OMX_COLOR_FormatYCbYCr -> OMX_COLOR_FormatYUV420Planar");
+				PATCH_TRACE("OMXCodec:setVideoOutputFormat: OMX_COLOR_FormatYCbYCr -> OMX_COLOR_FormatYUV420Planar");
 				status_t errs = mOMX->setParameter(mNode, OMX_IndexParamVideoPortFormat, &format, sizeof(format));
 				if (errs != OK){
 					ALOGE("PATCH:OMXCodec:setVideoOutputFormat: setParameter failed: %d", errs);
@@ -1851,7 +1891,7 @@ status_t OMXCodec::setVideoOutputFormat(
                 err = mOMX->getParameter(
                         mNode, OMX_IndexParamVideoPortFormat,
                             &format, sizeof(format));
-				ALOGI("PATCH:OMXCodec:setVideoOutputFormat : %i", format.eColorFormat);			
+				PATCH_TRACE("OMXCodec:setVideoOutputFormat : %i", format.eColorFormat);			
                 if (format.eColorFormat == colorFormat) {
                     break;
                 }
@@ -1869,6 +1909,10 @@ status_t OMXCodec::setVideoOutputFormat(
         if (err != OK) {
             return err;
         }
+
+        if (cacheable) {
+            BrcmFormatCache::storePortFormat(cacheKey, format);
+        }
     }
 #endif
 
@@ -2109,6 +2153,8 @@ OMXCodec::~OMXCodec() {
 
     mNode = NULL;
 
+    gNativeWindowBufferPool.forget(this);
+
 #ifdef MTK_HARDWARE
     if (!strncmp(mComponentName, "OMX.MTK.", 8)) {
         mMtkBufferAllocator->releaseBuffers();
@@ -2183,7 +2229,7 @@ bool OMXCodec::isIntermediateState(State state) {
 }
 
 status_t OMXCodec::allocateBuffers() {
-	ALOGI("PATCH:OMXCodec:allocateBuffers");
+	PATCH_TRACE("OMXCodec:allocateBuffers");
     status_t err = allocateBuffersOnPort(kPortIndexInput);
 
     if (err != OK) {
@@ -2195,9 +2241,9 @@ status_t OMXCodec::allocateBuffers() {
 
 status_t OMXCodec::allocateBuffersOnPort(OMX_U32 portIndex) {
 
-	ALOGI("PATCH:OMXCodec:allocateBuffersOnPort");
-	ALOGI("PATCH:OMXCodec:allocateBuffersOnPort dump port");
+#ifdef BRCM_PATCH_TRACE
 	dumpPortStatus(portIndex);
+#endif
 
 #ifdef MTK_HARDWARE
     if (!strncmp(mComponentName, "OMX.MTK.", 8)) {
@@ -2405,13 +2451,101 @@ status_t OMXCodec::applyRotation() {
     return err;
 }
 
+// Remembers how the native window's buffers were last set up by each
+// OMXCodec, and which buffers those were, so that an
+// OMX_EventPortSettingsChanged reconfiguration that still fits them skips
+// native_window_set_buffer_count. That call makes the BufferQueue free
+// every slot, and each following dequeue reallocates an ION buffer.
+//
+// Fitting means the same allocation: the size and HAL format given to
+// native_window_set_buffers_geometry, the usage, and no more buffers than
+// before. Stride, slice height or crop may change. A new frame size, as in
+// an HLS resolution switch, never fits: the BufferQueue reallocates every
+// buffer whose size differs from the requested one on dequeue anyway.
+//
+// Without it the BufferQueue keeps its state, and the consumer may still
+// hold a buffer, so only as many buffers as may be dequeued get dequeued;
+// the rest are known from the pool to be in the queue already.
+struct NativeWindowBufferPool {
+    // what the BufferQueue allocates the buffers from
+    struct Geometry {
+        Geometry() : mWidth(0), mHeight(0), mHalFormat(0), mUsage(0) {}
+
+        bool operator==(const Geometry &other) const {
+            return mWidth == other.mWidth && mHeight == other.mHeight
+                && mHalFormat == other.mHalFormat && mUsage == other.mUsage;
+        }
+
+        OMX_U32 mWidth;
+        OMX_U32 mHeight;
+        int32_t mHalFormat;
+        OMX_U32 mUsage;
+    };
+
+    NativeWindowBufferPool() : mHits(0), mMisses(0) {}
+
+    // Returns true and the pooled buffers if |geometry| can be served by the
+    // buffers |codec| allocated last time.
+    bool fits(const OMXCodec *codec, const Geometry &geometry,
+            OMX_U32 bufferCount, Vector<sp<GraphicBuffer> > *pooled) {
+        Mutex::Autolock autoLock(mLock);
+
+        ssize_t index = mEntries.indexOfKey(codec);
+        bool hit = index >= 0
+            && mEntries.valueAt(index).mGeometry == geometry
+            && mEntries.valueAt(index).mBuffers.size() >= bufferCount;
+
+        if (hit) {
+            *pooled = mEntries.valueAt(index).mBuffers;
+            ++mHits;
+        } else {
+            ++mMisses;
+        }
+
+        ATRACE_INT("NativeWindowBufferPool hits", mHits);
+        ATRACE_INT("NativeWindowBufferPool misses", mMisses);
+        ALOGV("native window buffer pool %s (%d hits, %d misses)",
+                hit ? "hit" : "miss", (int)mHits, (int)mMisses);
+
+        return hit;
+    }
+
+    void record(const OMXCodec *codec, const Geometry &geometry,
+            const Vector<sp<GraphicBuffer> > &buffers) {
+        Mutex::Autolock autoLock(mLock);
+
+        Entry entry;
+        entry.mGeometry = geometry;
+        entry.mBuffers = buffers;
+        mEntries.replaceValueFor(codec, entry);
+    }
+
+    void forget(const OMXCodec *codec) {
+        Mutex::Autolock autoLock(mLock);
+        mEntries.removeItem(codec);
+    }
+
+private:
+    struct Entry {
+        Geometry mGeometry;
+        Vector<sp<GraphicBuffer> > mBuffers;
+    };
+
+    Mutex mLock;
+    KeyedVector<const OMXCodec *, Entry> mEntries;
+    size_t mHits;
+    size_t mMisses;
+};
+
+static NativeWindowBufferPool gNativeWindowBufferPool;
+
 status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
     // Get the number of buffers needed.
     OMX_PARAM_PORTDEFINITIONTYPE def;
     InitOMXParams(&def);
     def.nPortIndex = kPortIndexOutput;
 	
-	ALOGI("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow -> [%s]", mComponentName);
+	PATCH_TRACE_SCOPE("OMXCodec:allocateOutputBuffersFromNativeWindow");
 
     status_t err = mOMX->getParameter(
             mNode, OMX_IndexParamPortDefinition, &def, sizeof(def));
@@ -2420,8 +2554,11 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
         return err;
     }
 	
-	ALOGI("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow dump port");
+#ifdef BRCM_PATCH_TRACE
 	dumpPortStatus(kPortIndexOutput);
+#endif
+
+    NativeWindowBufferPool::Geometry geometry;
 
 #ifndef USE_SAMSUNG_COLORFORMAT
 #ifdef MTK_HARDWARE
@@ -2449,6 +2586,9 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
 #endif
     }
 
+    geometry.mWidth = def.format.video.nStride;
+    geometry.mHeight = def.format.video.nSliceHeight;
+    geometry.mHalFormat = eHalColorFormat;
     err = native_window_set_buffers_geometry(
             mNativeWindow.get(),
             def.format.video.nStride,
@@ -2459,28 +2599,50 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
 	OMX_COLOR_FORMATTYPE HalColorFormat;
 	status_t errss;
 	
-	ALOGI("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow def.format.video.eColorFormat: %i", def.format.video.eColorFormat);
-	switch (def.format.video.eColorFormat) {
-		case OMX_COLOR_FormatYCbYCr:
-			ALOGI("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow OMX_COLOR_FormatYCbYCr(%i) -> (%i)", OMX_COLOR_FormatYCbYCr, (OMX_COLOR_FORMATTYPE)19);
-			ALOGI("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow OMX_COLOR_FormatYCbYCr(%i) -> HAL_PIXEL_FORMAT_YV12(%i)", OMX_COLOR_FormatYCbYCr, (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12);
-			def.format.video.eColorFormat = OMX_COLOR_FormatYUV420Planar;
-			errss = mOMX->setParameter(mNode, OMX_IndexParamPortDefinition, &def, sizeof(def));
-			if (errss != OK){
-				ALOGE("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow setParameter failed: %d", errss);
-			}		
-			HalColorFormat = (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12;
-		break;
-		case OMX_COLOR_FormatYUV420Planar:
-			ALOGE("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow OMX_COLOR_FormatYUV420Planar(%i) -> HAL_PIXEL_FORMAT_YV12(%i)", OMX_COLOR_FormatYUV420Planar, (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12);
-			HalColorFormat = (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12;
-		break;
-		default:
-			ALOGE("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow default(%i) -> default(%i)", def.format.video.eColorFormat, def.format.video.eColorFormat);
-			HalColorFormat = def.format.video.eColorFormat;
-		break;
+	String8 cacheKey;
+	BrcmFormatCache::Entry cached;
+	bool cacheable = BrcmFormatCache::isCacheable(mComponentName);
+	if (cacheable) {
+		cacheKey = BrcmFormatCache::makeKey(
+				mComponentName, mMIME,
+				def.format.video.nFrameWidth, def.format.video.nFrameHeight,
+				kPortIndexOutput);
+	}
+
+	PATCH_TRACE_FORMAT("OMXCodec:allocateOutputBuffersFromNativeWindow",
+			mComponentName, def.format.video.eColorFormat, -1);
+	if (cacheable && BrcmFormatCache::lookup(cacheKey, &cached)
+			&& cached.mHalFormat >= 0
+			&& cached.mPortFormat.eColorFormat == def.format.video.eColorFormat) {
+		// The port is already in its negotiated format.
+		HalColorFormat = (OMX_COLOR_FORMATTYPE)cached.mHalFormat;
+	} else {
+		switch (def.format.video.eColorFormat) {
+			case OMX_COLOR_FormatYCbYCr:
+				def.format.video.eColorFormat = OMX_COLOR_FormatYUV420Planar;
+				errss = mOMX->setParameter(mNode, OMX_IndexParamPortDefinition, &def, sizeof(def));
+				if (errss != OK){
+					ALOGE("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow setParameter failed: %d", errss);
+				}		
+				HalColorFormat = (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12;
+			break;
+			case OMX_COLOR_FormatYUV420Planar:
+				HalColorFormat = (OMX_COLOR_FORMATTYPE)HAL_PIXEL_FORMAT_YV12;
+			break;
+			default:
+				HalColorFormat = def.format.video.eColorFormat;
+			break;
+		}
+	}
+	PATCH_TRACE_FORMAT("OMXCodec:allocateOutputBuffersFromNativeWindow",
+			mComponentName, def.format.video.eColorFormat, HalColorFormat);
+	if (cacheable) {
+		BrcmFormatCache::storeHalFormat(cacheKey, HalColorFormat);
 	}
 	
+    geometry.mWidth = def.format.video.nFrameWidth;
+    geometry.mHeight = def.format.video.nFrameHeight;
+    geometry.mHalFormat = HalColorFormat;
     err = native_window_set_buffers_geometry(
             mNativeWindow.get(),
             def.format.video.nFrameWidth,
@@ -2503,6 +2665,9 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
         break;
     }
 
+    geometry.mWidth = def.format.video.nFrameWidth;
+    geometry.mHeight = def.format.video.nFrameHeight;
+    geometry.mHalFormat = eColorFormat;
     err = native_window_set_buffers_geometry(
             mNativeWindow.get(),
             def.format.video.nFrameWidth,
@@ -2558,8 +2723,9 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
     usage |= (GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_OFTEN);
 #endif
 
-    err = native_window_set_usage(
-            mNativeWindow.get(), usage | GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_EXTERNAL_DISP);
+    usage |= GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_EXTERNAL_DISP;
+
+    err = native_window_set_usage(mNativeWindow.get(), usage);
 
     if (err != 0) {
         ALOGE("native_window_set_usage failed: %s (%d)", strerror(-err), -err);
@@ -2601,31 +2767,101 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
         }
     }
 
-    err = native_window_set_buffer_count(
-            mNativeWindow.get(), def.nBufferCountActual);
-    if (err != 0) {
-        ALOGE("native_window_set_buffer_count failed: %s (%d)", strerror(-err),
-                -err);
-        return err;
+    geometry.mUsage = usage;
+
+    Vector<sp<GraphicBuffer> > pooled;
+    bool reuseBuffers = gNativeWindowBufferPool.fits(
+            this, geometry, def.nBufferCountActual, &pooled);
+
+    if (reuseBuffers && pooled.size() != def.nBufferCountActual) {
+        // Keep all the pooled buffers rather than shrinking the queue.
+        OMX_U32 oldBufferCount = def.nBufferCountActual;
+        def.nBufferCountActual = pooled.size();
+        if (mOMX->setParameter(
+                    mNode, OMX_IndexParamPortDefinition,
+                    &def, sizeof(def)) != OK) {
+            def.nBufferCountActual = oldBufferCount;
+            reuseBuffers = false;
+        }
     }
 
-    CODEC_LOGV("allocating %lu buffers from a native window of size %lu on "
-            "output port", def.nBufferCountActual, def.nBufferSize);
+    // The buffers to hand to OMX, the first |dequeuedCount| of them are
+    // dequeued, the others are still queued in the native window.
+    Vector<sp<GraphicBuffer> > buffers;
+    OMX_U32 dequeuedCount = 0;
+
+    if (reuseBuffers) {
+        // The queue still counts the last setup's buffers, only this many
+        // may be dequeued at once.
+        for (OMX_U32 i = 0; i < def.nBufferCountActual - minUndequeuedBufs; i++) {
+            ANativeWindowBuffer* buf;
+            err = native_window_dequeue_buffer_and_wait(mNativeWindow.get(), &buf);
+            if (err != 0) {
+                break;
+            }
+            buffers.push(new GraphicBuffer(buf, false));
+        }
+
+        // Order the pooled buffers after the dequeued ones. Any dequeued
+        // buffer that isn't pooled means the queue was reallocated.
+        Vector<sp<GraphicBuffer> > queued(pooled);
+        for (size_t i = 0; i < buffers.size() && err == 0; i++) {
+            size_t j = 0;
+            while (j < queued.size() && queued[j]->handle != buffers[i]->handle) {
+                j++;
+            }
+            if (j == queued.size()) {
+                err = -ENOENT;
+            } else {
+                queued.removeAt(j);
+            }
+        }
 
-    // Dequeue buffers and send them to OMX
-    for (OMX_U32 i = 0; i < def.nBufferCountActual; i++) {
-        ANativeWindowBuffer* buf;
-        err = native_window_dequeue_buffer_and_wait(mNativeWindow.get(), &buf);
         if (err != 0) {
-            ALOGE("dequeueBuffer failed: %s (%d)", strerror(-err), -err);
-            break;
+            CODEC_LOGV("pooled buffers are gone (%d), reallocating", err);
+            for (size_t i = 0; i < buffers.size(); i++) {
+                mNativeWindow->cancelBuffer(mNativeWindow.get(), buffers[i].get(), -1);
+            }
+            buffers.clear();
+            reuseBuffers = false;
+            err = 0;
+        } else {
+            dequeuedCount = buffers.size();
+            buffers.appendVector(queued);
+        }
+    }
+
+    if (!reuseBuffers) {
+        err = native_window_set_buffer_count(
+                mNativeWindow.get(), def.nBufferCountActual);
+        if (err != 0) {
+            ALOGE("native_window_set_buffer_count failed: %s (%d)", strerror(-err),
+                    -err);
+            return err;
         }
 
-        sp<GraphicBuffer> graphicBuffer(new GraphicBuffer(buf, false));
+        for (OMX_U32 i = 0; i < def.nBufferCountActual; i++) {
+            ANativeWindowBuffer* buf;
+            err = native_window_dequeue_buffer_and_wait(mNativeWindow.get(), &buf);
+            if (err != 0) {
+                ALOGE("dequeueBuffer failed: %s (%d)", strerror(-err), -err);
+                break;
+            }
+            buffers.push(new GraphicBuffer(buf, false));
+        }
+        dequeuedCount = buffers.size();
+    }
+
+    CODEC_LOGV("allocating %lu buffers from a native window of size %lu on "
+            "output port", def.nBufferCountActual, def.nBufferSize);
+
+    // Send them to OMX
+    for (size_t i = 0; i < buffers.size() && err == 0; i++) {
+        const sp<GraphicBuffer> &graphicBuffer(buffers[i]);
         BufferInfo info;
         info.mData = NULL;
         info.mSize = def.nBufferSize;
-        info.mStatus = OWNED_BY_US;
+        info.mStatus = i < dequeuedCount ? OWNED_BY_US : OWNED_BY_NATIVE_WINDOW;
         info.mMem = NULL;
         info.mMediaBuffer = new MediaBuffer(graphicBuffer);
         info.mMediaBuffer->setObserver(this);
@@ -2648,6 +2884,13 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
                 bufferId, graphicBuffer.get());
     }
 
+    if (err != 0) {
+        // Dequeued buffers that never made it into mPortBuffers
+        for (size_t i = mPortBuffers[kPortIndexOutput].size(); i < dequeuedCount; i++) {
+            mNativeWindow->cancelBuffer(mNativeWindow.get(), buffers[i].get(), -1);
+        }
+    }
+
     OMX_U32 cancelStart;
     OMX_U32 cancelEnd;
     if (err != 0) {
@@ -2655,10 +2898,15 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
         // that were dequeued.
         cancelStart = 0;
         cancelEnd = mPortBuffers[kPortIndexOutput].size();
+
+        gNativeWindowBufferPool.forget(this);
     } else {
-        // Return the last two buffers to the native window.
-        cancelStart = def.nBufferCountActual - minUndequeuedBufs;
-        cancelEnd = def.nBufferCountActual;
+        gNativeWindowBufferPool.record(this, geometry, buffers);
+
+        // Return the last two buffers to the native window, reused ones
+        // never left it.
+        cancelStart = reuseBuffers ? 0 : def.nBufferCountActual - minUndequeuedBufs;
+        cancelEnd = reuseBuffers ? 0 : def.nBufferCountActual;
     }
 
 
@@ -2668,12 +2916,15 @@ status_t OMXCodec::allocateOutputBuffersFromNativeWindow() {
     } else {
         for (OMX_U32 i = cancelStart; i < cancelEnd; i++) {
             BufferInfo *info = &mPortBuffers[kPortIndexOutput].editItemAt(i);
-            cancelBufferToNativeWindow(info);
+            if (info->mStatus == OWNED_BY_US) {
+                cancelBufferToNativeWindow(info);
+            }
         }
     }
 	
-	ALOGI("PATCH:OMXCodec:allocateOutputBuffersFromNativeWindow end dump port");
+#ifdef BRCM_PATCH_TRACE
 	dumpPortStatus(kPortIndexOutput);
+#endif
 
     return err;
 }
@@ -6002,7 +6253,7 @@ void OMXCodec::initNativeWindowCrop() {
 }
 
 void OMXCodec::initOutputFormat(const sp<MetaData> &inputFormat) {
-	ALOGI("PATCH:OMXCodec:initOutputFormat");
+	PATCH_TRACE("OMXCodec:initOutputFormat");
     mOutputFormat = new MetaData;
     mOutputFormat->setCString(kKeyDecoderComponent, mComponentName);
     if (mIsEncoder) {
@@ -6026,7 +6277,7 @@ void OMXCodec::initOutputFormat(const sp<MetaData> &inputFormat) {
     switch (def.eDomain) {
         case OMX_PortDomainImage:
         {
-			ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainImage");
+			PATCH_TRACE("OMXCodec:initOutputFormat OMX_PortDomainImage");
             OMX_IMAGE_PORTDEFINITIONTYPE *imageDef = &def.format.image;
             CHECK_EQ((int)imageDef->eCompressionFormat,
                      (int)OMX_IMAGE_CodingUnused);
@@ -6040,7 +6291,7 @@ void OMXCodec::initOutputFormat(const sp<MetaData> &inputFormat) {
 
         case OMX_PortDomainAudio:
         {
-			ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainAudio");
+			PATCH_TRACE("OMXCodec:initOutputFormat OMX_PortDomainAudio");
             OMX_AUDIO_PORTDEFINITIONTYPE *audio_def = &def.format.audio;
 
             if (audio_def->eEncoding == OMX_AUDIO_CodingPCM) {
@@ -6148,13 +6399,16 @@ void OMXCodec::initOutputFormat(const sp<MetaData> &inputFormat) {
 
         case OMX_PortDomainVideo:
         {
-			ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo");
+			PATCH_TRACE("OMXCodec:initOutputFormat OMX_PortDomainVideo");
 			
-			if (!strncmp(mComponentName, "OMX.brcm.", 9)){
-					ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo Codec is brcm");
+			// Skip the round trip if the port was already switched by
+			// setVideoOutputFormat / allocateOutputBuffersFromNativeWindow.
+			if (!strncmp(mComponentName, "OMX.brcm.", 9)
+					&& def.format.video.eColorFormat != OMX_COLOR_FormatYUV420Planar){
+					PATCH_TRACE("OMXCodec:initOutputFormat OMX_PortDomainVideo Codec is brcm");
 					OMX_VIDEO_PORTDEFINITIONTYPE *vdef = &def.format.video;
 					vdef->eColorFormat = OMX_COLOR_FormatYUV420Planar;
-					ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo Codec is brcm set OMX_IndexParamPortDefinition eColorFormat = OMX_COLOR_FormatYUV420Planar");
+					PATCH_TRACE("OMXCodec:initOutputFormat OMX_PortDomainVideo Codec is brcm set OMX_IndexParamPortDefinition eColorFormat = OMX_COLOR_FormatYUV420Planar");
 					mOMX->setParameter(mNode, OMX_IndexParamPortDefinition, &def, sizeof(def));
 			}
 			
@@ -6183,18 +6437,15 @@ void OMXCodec::initOutputFormat(const sp<MetaData> &inputFormat) {
             mOutputFormat->setInt32(kKeySliceHeight, video_def->nSliceHeight);
 #endif
 
-			ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo BEGIN video_def->eColorFormat %i", video_def->eColorFormat);
-			
 			if(video_def->eColorFormat == OMX_COLOR_FormatYCbYCr){
-				ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo eColorFormat == OMX_COLOR_FormatYCbYCr");
 				if (!strncmp(mComponentName, "OMX.brcm.", 9)){
-					ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo kKeyColorFormat set %i", OMX_COLOR_FormatYUV420Planar);
 					video_def->eColorFormat = OMX_COLOR_FormatYUV420Planar;
 				}
 			}
 			
 			mOutputFormat->setInt32(kKeyColorFormat, video_def->eColorFormat);
-			ALOGI("PATCH:OMXCodec:initOutputFormat OMX_PortDomainVideo END video_def->eColorFormat %i", video_def->eColorFormat);
+			PATCH_TRACE_FORMAT("OMXCodec:initOutputFormat",
+					mComponentName, video_def->eColorFormat, -1);
 
             if (!mIsEncoder) {
                 OMX_CONFIG_RECTTYPE rect;
@@ -6337,6 +6588,306 @@ void OMXCodec::restorePatchedDataPointer(BufferInfo *info) {
 }
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+
+// Persisted QueryCodec() results, so that MediaCodecList users and the media
+// scanner do not allocate and free an OMX node per component every time.
+// The index is a flat array of fixed size records mapped read-only. It is
+// thrown away whenever the build fingerprint or media_codecs.xml changes;
+// the vendor OMX components cannot change without the former. Only the
+// media uid appends entries, /system/bin/codec_caps does it for every codec
+// once mediaserver is up. Other processes only read the index and pick up
+// a rewritten one on their next miss.
+
+static const char *kCodecCapsIndexPath = "/data/misc/codec_caps/codec_caps.idx";
+static const char *kMediaCodecsXmlPath = "/system/etc/media_codecs.xml";
+
+struct CodecCapsIndexHeader {
+    enum {
+        kMagic = 0x58494343,  // 'CCIX'
+        kVersion = 1,
+    };
+
+    uint32_t mMagic;
+    uint32_t mVersion;
+    char mFingerprint[PROPERTY_VALUE_MAX];
+    int64_t mCodecsXmlMTime;
+    uint32_t mNumEntries;
+};
+
+struct CodecCapsIndexEntry {
+    enum {
+        kMaxProfileLevels = 32,
+        kMaxColorFormats = 16,
+    };
+
+    char mComponentName[128];
+    char mMime[64];
+    uint32_t mIsEncoder;
+    uint32_t mFlags;
+    uint32_t mNumProfileLevels;
+    uint32_t mNumColorFormats;
+    uint32_t mProfileLevels[kMaxProfileLevels][2];
+    uint32_t mColorFormats[kMaxColorFormats];
+};
+
+struct CodecCapsIndex {
+    static CodecCapsIndex *get();
+
+    bool lookup(
+            const char *componentName, const char *mime, bool isEncoder,
+            CodecCapabilities *caps);
+
+    void store(
+            const char *componentName, const char *mime, bool isEncoder,
+            const CodecCapabilities &caps);
+
+private:
+    Mutex mLock;
+    CodecCapsIndexHeader mCurrent;
+    void *mData;
+    size_t mSize;
+    ino_t mInode;       // of the file mData, or the last rejected one, came from
+    time_t mMTime;
+
+    CodecCapsIndex();
+
+    void mapLocked();
+    void unmapLocked();
+    void remapIfChangedLocked();
+
+    const CodecCapsIndexEntry *findLocked(
+            const char *componentName, const char *mime,
+            bool isEncoder) const;
+
+    CodecCapsIndex(const CodecCapsIndex &);
+    CodecCapsIndex &operator=(const CodecCapsIndex &);
+};
+
+// static
+CodecCapsIndex *CodecCapsIndex::get() {
+    static CodecCapsIndex *sIndex = new CodecCapsIndex;
+    return sIndex;
+}
+
+CodecCapsIndex::CodecCapsIndex()
+    : mData(NULL),
+      mSize(0),
+      mInode(0),
+      mMTime(0) {
+    memset(&mCurrent, 0, sizeof(mCurrent));
+    mCurrent.mMagic = CodecCapsIndexHeader::kMagic;
+    mCurrent.mVersion = CodecCapsIndexHeader::kVersion;
+    property_get("ro.build.fingerprint", mCurrent.mFingerprint, "");
+
+    struct stat st;
+    if (stat(kMediaCodecsXmlPath, &st) == 0) {
+        mCurrent.mCodecsXmlMTime = st.st_mtime;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+    mapLocked();
+}
+
+void CodecCapsIndex::mapLocked() {
+    int fd = open(kCodecCapsIndexPath, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+    mInode = st.st_ino;
+    mMTime = st.st_mtime;
+    if ((size_t)st.st_size < sizeof(CodecCapsIndexHeader)) {
+        close(fd);
+        return;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    const CodecCapsIndexHeader *header =
+        static_cast<const CodecCapsIndexHeader *>(data);
+
+    if (header->mMagic != mCurrent.mMagic
+            || header->mVersion != mCurrent.mVersion
+            || strncmp(header->mFingerprint, mCurrent.mFingerprint,
+                    sizeof(mCurrent.mFingerprint))
+            || header->mCodecsXmlMTime != mCurrent.mCodecsXmlMTime
+            || (size_t)st.st_size != sizeof(CodecCapsIndexHeader)
+                    + header->mNumEntries * sizeof(CodecCapsIndexEntry)) {
+        ALOGI("ignoring stale codec capability index");
+        munmap(data, st.st_size);
+        return;
+    }
+
+    mData = data;
+    mSize = st.st_size;
+}
+
+void CodecCapsIndex::unmapLocked() {
+    if (mData != NULL) {
+        munmap(mData, mSize);
+        mData = NULL;
+        mSize = 0;
+    }
+}
+
+void CodecCapsIndex::remapIfChangedLocked() {
+    // the writer renames a new file into place, so a new inode means news
+    struct stat st;
+    if (stat(kCodecCapsIndexPath, &st) != 0
+            || (st.st_ino == mInode && st.st_mtime == mMTime)) {
+        return;
+    }
+    unmapLocked();
+    mapLocked();
+}
+
+const CodecCapsIndexEntry *CodecCapsIndex::findLocked(
+        const char *componentName, const char *mime, bool isEncoder) const {
+    if (mData == NULL) {
+        return NULL;
+    }
+
+    const CodecCapsIndexHeader *header =
+        static_cast<const CodecCapsIndexHeader *>(mData);
+    const CodecCapsIndexEntry *entries =
+        reinterpret_cast<const CodecCapsIndexEntry *>(header + 1);
+
+    for (uint32_t i = 0; i < header->mNumEntries; ++i) {
+        const CodecCapsIndexEntry &entry = entries[i];
+        if (entry.mIsEncoder == (isEncoder ? 1 : 0)
+                && !strcmp(entry.mComponentName, componentName)
+                && !strcasecmp(entry.mMime, mime)) {
+            return &entry;
+        }
+    }
+
+    return NULL;
+}
+
+bool CodecCapsIndex::lookup(
+        const char *componentName, const char *mime, bool isEncoder,
+        CodecCapabilities *caps) {
+    Mutex::Autolock autoLock(mLock);
+
+    const CodecCapsIndexEntry *entry =
+        findLocked(componentName, mime, isEncoder);
+    if (entry == NULL) {
+        remapIfChangedLocked();
+        entry = findLocked(componentName, mime, isEncoder);
+    }
+
+    if (entry == NULL) {
+        return false;
+    }
+
+    caps->mComponentName = componentName;
+    caps->mFlags = entry->mFlags;
+
+    for (uint32_t i = 0; i < entry->mNumProfileLevels; ++i) {
+        CodecProfileLevel profileLevel;
+        profileLevel.mProfile = entry->mProfileLevels[i][0];
+        profileLevel.mLevel = entry->mProfileLevels[i][1];
+        caps->mProfileLevels.push(profileLevel);
+    }
+
+    for (uint32_t i = 0; i < entry->mNumColorFormats; ++i) {
+        caps->mColorFormats.push(entry->mColorFormats[i]);
+    }
+
+    return true;
+}
+
+void CodecCapsIndex::store(
+        const char *componentName, const char *mime, bool isEncoder,
+        const CodecCapabilities &caps) {
+    // /data/misc/codec_caps belongs to media, apps and the media scanner
+    // only read the index
+    if (getuid() != AID_MEDIA) {
+        return;
+    }
+
+    CodecCapsIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+
+    if (strlcpy(entry.mComponentName, componentName,
+                sizeof(entry.mComponentName)) >= sizeof(entry.mComponentName)
+            || strlcpy(entry.mMime, mime, sizeof(entry.mMime))
+                    >= sizeof(entry.mMime)
+            || caps.mProfileLevels.size()
+                    > CodecCapsIndexEntry::kMaxProfileLevels
+            || caps.mColorFormats.size()
+                    > CodecCapsIndexEntry::kMaxColorFormats) {
+        return;
+    }
+
+    entry.mIsEncoder = isEncoder ? 1 : 0;
+    entry.mFlags = caps.mFlags;
+    entry.mNumProfileLevels = caps.mProfileLevels.size();
+    for (size_t i = 0; i < caps.mProfileLevels.size(); ++i) {
+        entry.mProfileLevels[i][0] = caps.mProfileLevels[i].mProfile;
+        entry.mProfileLevels[i][1] = caps.mProfileLevels[i].mLevel;
+    }
+    entry.mNumColorFormats = caps.mColorFormats.size();
+    for (size_t i = 0; i < caps.mColorFormats.size(); ++i) {
+        entry.mColorFormats[i] = caps.mColorFormats[i];
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    remapIfChangedLocked();
+    if (findLocked(componentName, mime, isEncoder) != NULL) {
+        return;
+    }
+
+    // Rewrite the whole index and rename it into place, readers keep their
+    // existing mapping of the old file.
+    String8 tmpPath = String8::format("%s.%d", kCodecCapsIndexPath, getpid());
+    int fd = open(tmpPath.string(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ALOGW("cannot write codec capability index (%s)", strerror(errno));
+        return;
+    }
+
+    size_t numOld = 0;
+    const CodecCapsIndexEntry *oldEntries = NULL;
+    if (mData != NULL) {
+        const CodecCapsIndexHeader *header =
+            static_cast<const CodecCapsIndexHeader *>(mData);
+        numOld = header->mNumEntries;
+        oldEntries = reinterpret_cast<const CodecCapsIndexEntry *>(header + 1);
+    }
+
+    CodecCapsIndexHeader header = mCurrent;
+    header.mNumEntries = numOld + 1;
+
+    size_t oldSize = numOld * sizeof(CodecCapsIndexEntry);
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)
+        && (oldSize == 0 || write(fd, oldEntries, oldSize) == (ssize_t)oldSize)
+        && write(fd, &entry, sizeof(entry)) == (ssize_t)sizeof(entry);
+
+    close(fd);
+
+    if (!ok || rename(tmpPath.string(), kCodecCapsIndexPath) != 0) {
+        ALOGW("failed to update codec capability index (%s)", strerror(errno));
+        unlink(tmpPath.string());
+        return;
+    }
+
+    unmapLocked();
+    mapLocked();
+}
+
 status_t QueryCodecs(
         const sp<IOMX> &omx,
         const char *mime, bool queryDecoders, bool hwCodecOnly,
@@ -6353,7 +6904,7 @@ status_t QueryCodecs(
     for (size_t c = 0; c < matchingCodecs.size(); c++) {
         const char *componentName = matchingCodecs.itemAt(c).mName.string();
 		
-			ALOGI("PATCH:QueryCodecs: %s", componentName);
+			PATCH_TRACE("QueryCodecs: %s", componentName);
 
         results->push();
         CodecCapabilities *caps = &results->editItemAt(results->size() - 1);
@@ -6374,18 +6925,23 @@ status_t QueryCodec(
         const char *componentName, const char *mime,
         bool isEncoder,
         CodecCapabilities *caps) {
-		ALOGI("PATCH:QueryCodec: %s", componentName);	
+		PATCH_TRACE("QueryCodec: %s", componentName);	
     if (strncmp(componentName, "OMX.", 4)) {
         // Not an OpenMax component but a software codec.
         caps->mFlags = 0;
         caps->mComponentName = componentName;
         return OK;
     }
+
+    if (CodecCapsIndex::get()->lookup(componentName, mime, isEncoder, caps)) {
+        return OK;
+    }
+
 	caps->mColorFormats.push(OMX_COLOR_FormatYUV420Planar);
 
     sp<OMXCodecObserver> observer = new OMXCodecObserver;
     IOMX::node_id node;
-	ALOGI("PATCH:QueryCodec->allocateNode");
+	PATCH_TRACE("QueryCodec->allocateNode");
     status_t err = omx->allocateNode(componentName, observer, &node);
 
     if (err != OK) {
@@ -6428,7 +6984,7 @@ status_t QueryCodec(
 #endif
 
     for (OMX_U32 index = 0;;index++) {
-		ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE:begin");
+		PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE:begin");
         portFormat.nIndex = index;
         err = omx->getParameter(
                 node, OMX_IndexParamVideoPortFormat,
@@ -6436,27 +6992,27 @@ status_t QueryCodec(
         if (err != OK) {
             break;
         }
-		ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE:Begin portFormat.eColorFormat = %i, componentName = %s", portFormat.eColorFormat, componentName);
+		PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE:Begin portFormat.eColorFormat = %i, componentName = %s", portFormat.eColorFormat, componentName);
 		if (portFormat.eColorFormat == OMX_COLOR_FormatYCbYCr) {
-			ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE: OMX_COLOR_FormatYCbYCr");
+			PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE: OMX_COLOR_FormatYCbYCr");
 			if (!strncmp(componentName, "OMX.brcm.", 9)){
-				ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE (%s)", componentName);
+				PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE (%s)", componentName);
 				portFormat.eColorFormat	= OMX_COLOR_FormatYUV420Planar;
-				ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE portFormat.eColorFormat(%i)", portFormat.eColorFormat);
+				PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE portFormat.eColorFormat(%i)", portFormat.eColorFormat);
 				status_t errs = omx->setParameter(node, OMX_IndexParamVideoPortFormat, &portFormat, sizeof(portFormat));
 				if (errs != OK){
 					ALOGE("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE setParameter failed: %d", errs);
 				}
 				caps->mColorFormats.push(OMX_COLOR_FormatYUV420Planar);
 			}else{
-				ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE color is YCbYCr but not brcm (%s)", componentName);
+				PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE color is YCbYCr but not brcm (%s)", componentName);
 				caps->mColorFormats.push(portFormat.eColorFormat);
 			}
 		}else{
-			ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE color not YCbYCr (%i)", portFormat.eColorFormat);
+			PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE color not YCbYCr (%i)", portFormat.eColorFormat);
 			caps->mColorFormats.push(portFormat.eColorFormat);
 		}
-		ALOGI("PATCH:QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE:End portFormat.eColorFormat = %i, componentName = %s", portFormat.eColorFormat, componentName);	
+		PATCH_TRACE("QueryCodec->OMX_VIDEO_PARAM_PORTFORMATTYPE:End portFormat.eColorFormat = %i, componentName = %s", portFormat.eColorFormat, componentName);	
    }
 	
     if (!isEncoder && !strncmp(mime, "video/", 6)) {
@@ -6471,6 +7027,8 @@ status_t QueryCodec(
 
     CHECK_EQ(omx->freeNode(node), (status_t)OK);
 
+    CodecCapsIndex::get()->store(componentName, mime, isEncoder, *caps);
+
     return OK;
 }
 
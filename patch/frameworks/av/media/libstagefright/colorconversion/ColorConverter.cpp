@@ -22,20 +22,380 @@
 #include <media/stagefright/ColorConverter.h>
 #include <media/stagefright/MediaErrors.h>
 
+#include "../include/BrcmPatchTrace.h"
+
 #ifdef MTK_HARDWARE
 #include <mtkcolorconverter/MtkColorConverter.h>
 #endif
 
+#include <cutils/properties.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#define HAVE_NEON_COLOR_CONVERSION 1
+#endif
+
 namespace android {
 
+static bool neonAvailable() {
+#ifdef HAVE_NEON_COLOR_CONVERSION
+    if (!(getauxval(AT_HWCAP) & HWCAP_NEON)) {
+        return false;
+    }
+
+    // Allows the scalar path to be forced for comparison.
+    char value[PROPERTY_VALUE_MAX];
+    property_get("debug.stagefright.ccneon", value, "1");
+    return atoi(value) != 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef HAVE_NEON_COLOR_CONVERSION
+
+// The NEON row kernels below handle 16 pixels per iteration and return the
+// number of pixels converted; the caller finishes the row with the scalar
+// loop. They use the same 8.8 fixed point coefficients as the scalar code:
+//
+// B = 298/256 * (Y - 16) + 517/256 * (U - 128)
+// G = 298/256 * (Y - 16) - 208/256 * (V - 128) - 100/256 * (U - 128)
+// R = 298/256 * (Y - 16) + 409/256 * (V - 128)
+//
+// Intermediates are kept in 32 bits and saturated with vqmovun, which gives
+// the same result as the kAdjustedClip lookup. Negative values round towards
+// -infinity instead of zero, but those clip to 0 either way.
+
+static inline int16x8_t neonBiasChroma(uint8x8_t c) {
+    return vreinterpretq_s16_u16(vsubl_u8(c, vdup_n_u8(128)));
+}
+
+static inline uint8x8_t neonClipShift(int32x4_t lo, int32x4_t hi) {
+    return vqmovun_s16(vcombine_s16(vshrn_n_s32(lo, 8), vshrn_n_s32(hi, 8)));
+}
+
+static inline uint16x8_t neonPackRGB565(
+        uint8x8_t hi, uint8x8_t g, uint8x8_t lo) {
+    uint16x8_t rgb = vshll_n_u8(hi, 8);
+    rgb = vsriq_n_u16(rgb, vshll_n_u8(g, 8), 5);
+    rgb = vsriq_n_u16(rgb, vshll_n_u8(lo, 8), 11);
+    return rgb;
+}
+
+// Converts 8 pixel pairs sharing the chroma samples |u| and |v|. Even and
+// odd pixels are returned in out->val[0] and out->val[1], ready for vst2q.
+// If |swapRB| is set blue ends up in the top bits, matching the QCOM and
+// semi planar scalar paths.
+static inline void neonYUVToRGB565(
+        uint8x8_t yEven, uint8x8_t yOdd, int16x8_t u, int16x8_t v,
+        bool swapRB, uint16x8x2_t *out) {
+    int16x4_t uLo = vget_low_s16(u);
+    int16x4_t uHi = vget_high_s16(u);
+    int16x4_t vLo = vget_low_s16(v);
+    int16x4_t vHi = vget_high_s16(v);
+
+    int32x4_t ubLo = vmull_n_s16(uLo, 517);
+    int32x4_t ubHi = vmull_n_s16(uHi, 517);
+    int32x4_t uvgLo = vmlal_n_s16(vmull_n_s16(uLo, -100), vLo, -208);
+    int32x4_t uvgHi = vmlal_n_s16(vmull_n_s16(uHi, -100), vHi, -208);
+    int32x4_t vrLo = vmull_n_s16(vLo, 409);
+    int32x4_t vrHi = vmull_n_s16(vHi, 409);
+
+    uint8x8_t luma[2] = { yEven, yOdd };
+
+    for (int i = 0; i < 2; ++i) {
+        int16x8_t y = vsubq_s16(
+                vreinterpretq_s16_u16(vmovl_u8(luma[i])), vdupq_n_s16(16));
+
+        int32x4_t tmpLo = vmull_n_s16(vget_low_s16(y), 298);
+        int32x4_t tmpHi = vmull_n_s16(vget_high_s16(y), 298);
+
+        uint8x8_t b = neonClipShift(
+                vaddq_s32(tmpLo, ubLo), vaddq_s32(tmpHi, ubHi));
+        uint8x8_t g = neonClipShift(
+                vaddq_s32(tmpLo, uvgLo), vaddq_s32(tmpHi, uvgHi));
+        uint8x8_t r = neonClipShift(
+                vaddq_s32(tmpLo, vrLo), vaddq_s32(tmpHi, vrHi));
+
+        out->val[i] = swapRB ? neonPackRGB565(b, g, r)
+                             : neonPackRGB565(r, g, b);
+    }
+}
+
+static size_t neonRowYUV420Planar(
+        const uint8_t *src_y, const uint8_t *src_u, const uint8_t *src_v,
+        uint16_t *dst_ptr, size_t width) {
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x2_t y = vld2_u8(src_y + x);
+        int16x8_t u = neonBiasChroma(vld1_u8(src_u + x / 2));
+        int16x8_t v = neonBiasChroma(vld1_u8(src_v + x / 2));
+
+        uint16x8x2_t rgb;
+        neonYUVToRGB565(y.val[0], y.val[1], u, v, false, &rgb);
+        vst2q_u16(dst_ptr + x, rgb);
+    }
+    return x;
+}
+
+// |src_uv| holds interleaved chroma, U first unless |vFirst| is set.
+static size_t neonRowYUV420SemiPlanar(
+        const uint8_t *src_y, const uint8_t *src_uv,
+        uint16_t *dst_ptr, size_t width, bool vFirst, bool swapRB) {
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x2_t y = vld2_u8(src_y + x);
+        uint8x8x2_t uv = vld2_u8(src_uv + x);
+        int16x8_t u = neonBiasChroma(uv.val[vFirst ? 1 : 0]);
+        int16x8_t v = neonBiasChroma(uv.val[vFirst ? 0 : 1]);
+
+        uint16x8x2_t rgb;
+        neonYUVToRGB565(y.val[0], y.val[1], u, v, swapRB, &rgb);
+        vst2q_u16(dst_ptr + x, rgb);
+    }
+    return x;
+}
+
+// Packed 4:2:2, either Cb Y0 Cr Y1 (CbYCrY) or Y0 Cb Y1 Cr (YCbYCr).
+static size_t neonRowYUV422Packed(
+        const uint8_t *src_ptr, uint16_t *dst_ptr, size_t width,
+        bool lumaFirst) {
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x4_t p = vld4_u8(src_ptr + 2 * x);
+
+        uint16x8x2_t rgb;
+        if (lumaFirst) {
+            neonYUVToRGB565(p.val[0], p.val[2],
+                    neonBiasChroma(p.val[1]), neonBiasChroma(p.val[3]),
+                    false, &rgb);
+        } else {
+            neonYUVToRGB565(p.val[1], p.val[3],
+                    neonBiasChroma(p.val[0]), neonBiasChroma(p.val[2]),
+                    false, &rgb);
+        }
+        vst2q_u16(dst_ptr + x, rgb);
+    }
+    return x;
+}
+
+#endif  // HAVE_NEON_COLOR_CONVERSION
+
+// Worker threads shared by every ColorConverter in the process. run() hands
+// out indices [0, count) to the workers and to the calling thread and returns
+// once all of them are done. Only one run() is in flight at a time; a second
+// caller does its whole job itself rather than waiting for the pool.
+struct StripePool {
+    typedef void (*JobFunc)(void *cookie, size_t index);
+
+    static StripePool *get();
+
+    void run(JobFunc func, void *cookie, size_t count);
+
+private:
+    enum {
+        kMaxWorkers = 3,
+    };
+
+    Mutex mRunLock;
+
+    Mutex mLock;
+    Condition mWorkCondition;
+    Condition mDoneCondition;
+    JobFunc mFunc;
+    void *mCookie;
+    size_t mCount;
+    size_t mNext;
+    size_t mRemaining;
+
+    StripePool();
+
+    // Runs jobs until none are left to claim, called with mLock held.
+    void drainLocked(JobFunc func, void *cookie);
+
+    static int ThreadWrapper(void *me);
+    void threadLoop();
+
+    StripePool(const StripePool &);
+    StripePool &operator=(const StripePool &);
+};
+
+static pthread_once_t gStripePoolOnce = PTHREAD_ONCE_INIT;
+static StripePool *gStripePool;
+
+static void createStripePool() {
+    gStripePool = new StripePool;
+}
+
+// static
+StripePool *StripePool::get() {
+    pthread_once(&gStripePoolOnce, createStripePool);
+    return gStripePool;
+}
+
+StripePool::StripePool()
+    : mFunc(NULL),
+      mCookie(NULL),
+      mCount(0),
+      mNext(0),
+      mRemaining(0) {
+    long numWorkers = sysconf(_SC_NPROCESSORS_CONF) - 1;
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    } else if (numWorkers > kMaxWorkers) {
+        numWorkers = kMaxWorkers;
+    }
+
+    for (long i = 0; i < numWorkers; ++i) {
+        if (!androidCreateRawThreadEtc(
+                    ThreadWrapper, this, "ColorConverter",
+                    ANDROID_PRIORITY_FOREGROUND, 0, NULL)) {
+            ALOGW("failed to start color conversion worker %ld", i);
+        }
+    }
+}
+
+void StripePool::run(JobFunc func, void *cookie, size_t count) {
+    if (mRunLock.tryLock() != OK) {
+        for (size_t i = 0; i < count; ++i) {
+            func(cookie, i);
+        }
+        return;
+    }
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        mFunc = func;
+        mCookie = cookie;
+        mCount = count;
+        mNext = 0;
+        mRemaining = count;
+
+        mWorkCondition.broadcast();
+
+        drainLocked(func, cookie);
+
+        while (mRemaining > 0) {
+            mDoneCondition.wait(mLock);
+        }
+
+        mFunc = NULL;
+        mCookie = NULL;
+    }
+
+    mRunLock.unlock();
+}
+
+void StripePool::drainLocked(JobFunc func, void *cookie) {
+    while (mNext < mCount) {
+        size_t index = mNext++;
+
+        mLock.unlock();
+        func(cookie, index);
+        mLock.lock();
+
+        if (--mRemaining == 0) {
+            mDoneCondition.signal();
+        }
+    }
+}
+
+// static
+int StripePool::ThreadWrapper(void *me) {
+    static_cast<StripePool *>(me)->threadLoop();
+    return 0;
+}
+
+void StripePool::threadLoop() {
+    Mutex::Autolock autoLock(mLock);
+
+    for (;;) {
+        while (mFunc == NULL || mNext >= mCount) {
+            mWorkCondition.wait(mLock);
+        }
+
+        drainLocked(mFunc, mCookie);
+    }
+}
+
+struct ColorConverter::StripeContext {
+    StripeContext(
+            ColorConverter *converter,
+            const BitmapParams &src, const BitmapParams &dst,
+            size_t rows, size_t stripes)
+        : mConverter(converter),
+          mSrc(src),
+          mDst(dst),
+          mRows(rows),
+          mErr(OK) {
+        // Every stripe but the last starts on a chroma row pair.
+        mStripeRows = ((rows + stripes - 1) / stripes + 1) & ~1;
+        mTimesUs.insertAt(0, 0, stripes);
+    }
+
+    ColorConverter *mConverter;
+    const BitmapParams &mSrc;
+    const BitmapParams &mDst;
+    size_t mRows;
+    size_t mStripeRows;
+
+    Mutex mLock;
+    status_t mErr;
+    Vector<int64_t> mTimesUs;
+};
+
+// static
+void ColorConverter::ConvertStripe(void *cookie, size_t index) {
+    StripeContext *context = static_cast<StripeContext *>(cookie);
+
+    size_t yStart = index * context->mStripeRows;
+    size_t yEnd = yStart + context->mStripeRows;
+    if (yEnd > context->mRows) {
+        yEnd = context->mRows;
+    }
+
+    status_t err = OK;
+    nsecs_t startTime = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    if (yStart < yEnd) {
+        err = context->mConverter->convertRows(
+                context->mSrc, context->mDst, yStart, yEnd);
+    }
+
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - startTime;
+
+    Mutex::Autolock autoLock(context->mLock);
+    context->mTimesUs.editItemAt(index) = ns2us(elapsed);
+    if (context->mErr == OK) {
+        context->mErr = err;
+    }
+}
+
 ColorConverter::ColorConverter(
         OMX_COLOR_FORMATTYPE from, OMX_COLOR_FORMATTYPE to)
     : mSrcFormat(from),
       mDstFormat(to),
-      mClip(NULL) {
+      mClip(NULL),
+      mUseNeon(neonAvailable()),
+      mStripeCount(0) {
 #ifdef MTK_HARDWARE
     mMtkColorConverter = new MtkColorConverter(this);
 #endif
+
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get("media.stagefright.cc-stripes", value, NULL) > 0) {
+        int count = atoi(value);
+        setStripeCount(count > 0 ? count : 0);
+    }
 }
 
 ColorConverter::~ColorConverter() {
@@ -71,6 +431,14 @@ bool ColorConverter::isValid() const {
     }
 }
 
+void ColorConverter::setStripeCount(size_t count) {
+    mStripeCount = count;
+}
+
+void ColorConverter::getLastStripeTimesUs(Vector<int64_t> *timesUs) const {
+    *timesUs = mLastStripeTimesUs;
+}
+
 ColorConverter::BitmapParams::BitmapParams(
         void *bits,
         size_t width, size_t height,
@@ -103,8 +471,8 @@ status_t ColorConverter::convert(
         size_t dstCropLeft, size_t dstCropTop,
         size_t dstCropRight, size_t dstCropBottom) {
 			
-	ALOGE("PATCH:ColorConverter:convert: mSrcFormat: %i", mSrcFormat);
-	ALOGE("PATCH:ColorConverter:convert: mDstFormat: %i", mDstFormat);		
+	PATCH_TRACE_SCOPE("ColorConverter:convert");
+	PATCH_TRACE("ColorConverter:convert src=%d dst=%d", mSrcFormat, mDstFormat);
 			
     if (mDstFormat != OMX_COLOR_Format16bitRGB565) {
         return ERROR_UNSUPPORTED;
@@ -120,6 +488,43 @@ status_t ColorConverter::convert(
             dstWidth, dstHeight,
             dstCropLeft, dstCropTop, dstCropRight, dstCropBottom);
 
+    mLastStripeTimesUs.clear();
+
+    size_t rows = src.cropHeight();
+    size_t stripes = mStripeCount;
+
+#ifdef MTK_HARDWARE
+    // The hardware converter always does the whole frame.
+    if (mSrcFormat == OMX_COLOR_FormatYUV420Planar
+            || mSrcFormat == OMX_MTK_COLOR_FormatYV12
+            || mSrcFormat == OMX_COLOR_FormatVendorMTKYUV
+            || mSrcFormat == OMX_COLOR_FormatVendorMTKYUV_FCM) {
+        stripes = 1;
+    }
+#endif
+
+    if (stripes > rows / 2) {
+        stripes = rows / 2;
+    }
+
+    if (stripes <= 1) {
+        return convertRows(src, dst, 0, rows);
+    }
+
+    // Stripes share the clip table, make sure it exists before they start.
+    initClip();
+
+    StripeContext context(this, src, dst, rows, stripes);
+    StripePool::get()->run(ConvertStripe, &context, stripes);
+
+    mLastStripeTimesUs = context.mTimesUs;
+
+    return context.mErr;
+}
+
+status_t ColorConverter::convertRows(
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     status_t err;
 
     switch (mSrcFormat) {
@@ -127,28 +532,28 @@ status_t ColorConverter::convert(
 #ifdef MTK_HARDWARE
             err = mMtkColorConverter->convertYUVToRGBHW(src, dst);
 #else
-            err = convertYUV420Planar(src, dst);
+            err = convertYUV420Planar(src, dst, yStart, yEnd);
 #endif
             break;
 
         case OMX_COLOR_FormatCbYCrY:
-            err = convertCbYCrY(src, dst);
+            err = convertCbYCrY(src, dst, yStart, yEnd);
             break;
 		
 		case OMX_COLOR_FormatYCbYCr:
-            err = convertYCbYCr(src, dst);
+            err = convertYCbYCr(src, dst, yStart, yEnd);
             break;	
 
         case OMX_QCOM_COLOR_FormatYVU420SemiPlanar:
-            err = convertQCOMYUV420SemiPlanar(src, dst);
+            err = convertQCOMYUV420SemiPlanar(src, dst, yStart, yEnd);
             break;
 
         case OMX_COLOR_FormatYUV420SemiPlanar:
-            err = convertYUV420SemiPlanar(src, dst);
+            err = convertYUV420SemiPlanar(src, dst, yStart, yEnd);
             break;
 
         case OMX_TI_COLOR_FormatYUV420PackedSemiPlanar:
-            err = convertTIYUV420PackedSemiPlanar(src, dst);
+            err = convertTIYUV420PackedSemiPlanar(src, dst, yStart, yEnd);
             break;
 
 #ifdef MTK_HARDWARE
@@ -170,8 +575,8 @@ status_t ColorConverter::convert(
 }
 
 status_t ColorConverter::convertCbYCrY(
-        const BitmapParams &src, const BitmapParams &dst) {
-		ALOGE("PATCH:ColorConverter:convertCbYCrY");	
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     // XXX Untested
 
     uint8_t *kAdjustedClip = initClip();
@@ -188,8 +593,18 @@ status_t ColorConverter::convertCbYCrY(
     const uint8_t *src_ptr = (const uint8_t *)src.mBits
         + (src.mCropTop * dst.mWidth + src.mCropLeft) * 2;
 
-    for (size_t y = 0; y < src.cropHeight(); ++y) {
-        for (size_t x = 0; x < src.cropWidth(); x += 2) {
+    src_ptr += yStart * src.mWidth * 2;
+    dst_ptr += yStart * dst.mWidth;
+
+    for (size_t y = yStart; y < yEnd; ++y) {
+        size_t x = 0;
+#ifdef HAVE_NEON_COLOR_CONVERSION
+        if (mUseNeon) {
+            x = neonRowYUV422Packed(src_ptr, dst_ptr, src.cropWidth(), false);
+        }
+#endif
+
+        for (; x < src.cropWidth(); x += 2) {
             signed y1 = (signed)src_ptr[2 * x + 1] - 16;
             signed y2 = (signed)src_ptr[2 * x + 3] - 16;
             signed u = (signed)src_ptr[2 * x] - 128;
@@ -235,8 +650,8 @@ status_t ColorConverter::convertCbYCrY(
 }
 
 status_t ColorConverter::convertYCbYCr(
-        const BitmapParams &src, const BitmapParams &dst) {
-		ALOGE("PATCH:ColorConverter:convertYCbYCr");
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     // XXX Untested
 
     uint8_t *kAdjustedClip = initClip();
@@ -253,8 +668,18 @@ status_t ColorConverter::convertYCbYCr(
     const uint8_t *src_ptr = (const uint8_t *)src.mBits
         + (src.mCropTop * dst.mWidth + src.mCropLeft) * 2;
 
-    for (size_t y = 0; y < src.cropHeight(); ++y) {
-        for (size_t x = 0; x < src.cropWidth(); x += 2) {
+    src_ptr += yStart * src.mWidth * 2;
+    dst_ptr += yStart * dst.mWidth;
+
+    for (size_t y = yStart; y < yEnd; ++y) {
+        size_t x = 0;
+#ifdef HAVE_NEON_COLOR_CONVERSION
+        if (mUseNeon) {
+            x = neonRowYUV422Packed(src_ptr, dst_ptr, src.cropWidth(), true);
+        }
+#endif
+
+        for (; x < src.cropWidth(); x += 2) {
 			signed y1 = (signed)src_ptr[2 * x ] - 16;
             signed y2 = (signed)src_ptr[2 * x + 2] - 16;
             signed u = (signed)src_ptr[2 * x + 1] - 128;  
@@ -300,8 +725,8 @@ status_t ColorConverter::convertYCbYCr(
 }
 
 status_t ColorConverter::convertYUV420Planar(
-        const BitmapParams &src, const BitmapParams &dst) {
-		ALOGE("PATCH:ColorConverter:convertYUV420Planar");	
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     if (!((src.mCropLeft & 1) == 0
             && src.cropWidth() == dst.cropWidth()
             && src.cropHeight() == dst.cropHeight())) {
@@ -323,8 +748,21 @@ status_t ColorConverter::convertYUV420Planar(
     const uint8_t *src_v =
         src_u + (src.mWidth / 2) * (src.mHeight / 2);
 
-    for (size_t y = 0; y < src.cropHeight(); ++y) {
-        for (size_t x = 0; x < src.cropWidth(); x += 2) {
+    src_y += yStart * src.mWidth;
+    src_u += (yStart / 2) * (src.mWidth / 2);
+    src_v += (yStart / 2) * (src.mWidth / 2);
+    dst_ptr += yStart * dst.mWidth;
+
+    for (size_t y = yStart; y < yEnd; ++y) {
+        size_t x = 0;
+#ifdef HAVE_NEON_COLOR_CONVERSION
+        if (mUseNeon) {
+            x = neonRowYUV420Planar(
+                    src_y, src_u, src_v, dst_ptr, src.cropWidth());
+        }
+#endif
+
+        for (; x < src.cropWidth(); x += 2) {
             // B = 1.164 * (Y - 16) + 2.018 * (U - 128)
             // G = 1.164 * (Y - 16) - 0.813 * (V - 128) - 0.391 * (U - 128)
             // R = 1.164 * (Y - 16) + 1.596 * (V - 128)
@@ -395,7 +833,8 @@ status_t ColorConverter::convertYUV420Planar(
 }
 
 status_t ColorConverter::convertQCOMYUV420SemiPlanar(
-        const BitmapParams &src, const BitmapParams &dst) {
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     uint8_t *kAdjustedClip = initClip();
 
     if (!((src.mCropLeft & 1) == 0
@@ -414,8 +853,20 @@ status_t ColorConverter::convertQCOMYUV420SemiPlanar(
         (const uint8_t *)src_y + src.mWidth * src.mHeight
         + src.mCropTop * src.mWidth + src.mCropLeft;
 
-    for (size_t y = 0; y < src.cropHeight(); ++y) {
-        for (size_t x = 0; x < src.cropWidth(); x += 2) {
+    src_y += yStart * src.mWidth;
+    src_u += (yStart / 2) * src.mWidth;
+    dst_ptr += yStart * dst.mWidth;
+
+    for (size_t y = yStart; y < yEnd; ++y) {
+        size_t x = 0;
+#ifdef HAVE_NEON_COLOR_CONVERSION
+        if (mUseNeon) {
+            x = neonRowYUV420SemiPlanar(
+                    src_y, src_u, dst_ptr, src.cropWidth(), false, true);
+        }
+#endif
+
+        for (; x < src.cropWidth(); x += 2) {
             signed y1 = (signed)src_y[x] - 16;
             signed y2 = (signed)src_y[x + 1] - 16;
 
@@ -467,7 +918,8 @@ status_t ColorConverter::convertQCOMYUV420SemiPlanar(
 }
 
 status_t ColorConverter::convertYUV420SemiPlanar(
-        const BitmapParams &src, const BitmapParams &dst) {
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     // XXX Untested
 
     uint8_t *kAdjustedClip = initClip();
@@ -488,8 +940,20 @@ status_t ColorConverter::convertYUV420SemiPlanar(
         (const uint8_t *)src_y + src.mWidth * src.mHeight
         + src.mCropTop * src.mWidth + src.mCropLeft;
 
-    for (size_t y = 0; y < src.cropHeight(); ++y) {
-        for (size_t x = 0; x < src.cropWidth(); x += 2) {
+    src_y += yStart * src.mWidth;
+    src_u += (yStart / 2) * src.mWidth;
+    dst_ptr += yStart * dst.mWidth;
+
+    for (size_t y = yStart; y < yEnd; ++y) {
+        size_t x = 0;
+#ifdef HAVE_NEON_COLOR_CONVERSION
+        if (mUseNeon) {
+            x = neonRowYUV420SemiPlanar(
+                    src_y, src_u, dst_ptr, src.cropWidth(), true, true);
+        }
+#endif
+
+        for (; x < src.cropWidth(); x += 2) {
             signed y1 = (signed)src_y[x] - 16;
             signed y2 = (signed)src_y[x + 1] - 16;
 
@@ -541,7 +1005,8 @@ status_t ColorConverter::convertYUV420SemiPlanar(
 }
 
 status_t ColorConverter::convertTIYUV420PackedSemiPlanar(
-        const BitmapParams &src, const BitmapParams &dst) {
+        const BitmapParams &src, const BitmapParams &dst,
+        size_t yStart, size_t yEnd) {
     uint8_t *kAdjustedClip = initClip();
 
     if (!((src.mCropLeft & 1) == 0
@@ -558,8 +1023,20 @@ status_t ColorConverter::convertTIYUV420PackedSemiPlanar(
     const uint8_t *src_u =
         (const uint8_t *)src_y + src.mWidth * (src.mHeight - src.mCropTop / 2);
 
-    for (size_t y = 0; y < src.cropHeight(); ++y) {
-        for (size_t x = 0; x < src.cropWidth(); x += 2) {
+    src_y += yStart * src.mWidth;
+    src_u += (yStart / 2) * src.mWidth;
+    dst_ptr += yStart * dst.mWidth;
+
+    for (size_t y = yStart; y < yEnd; ++y) {
+        size_t x = 0;
+#ifdef HAVE_NEON_COLOR_CONVERSION
+        if (mUseNeon) {
+            x = neonRowYUV420SemiPlanar(
+                    src_y, src_u, dst_ptr, src.cropWidth(), false, false);
+        }
+#endif
+
+        for (; x < src.cropWidth(); x += 2) {
             signed y1 = (signed)src_y[x] - 16;
             signed y2 = (signed)src_y[x + 1] - 16;
 
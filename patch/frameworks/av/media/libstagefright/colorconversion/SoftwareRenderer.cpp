@@ -26,6 +26,10 @@
 #include <ui/GraphicBufferMapper.h>
 #include <gui/IGraphicBufferProducer.h>
 
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 namespace android {
 
 static bool runningInEmulator() {
@@ -146,6 +150,56 @@ static int ALIGN(int x, int y) {
     return (x + y - 1) & ~(y - 1);
 }
 
+// Copies a |width| x |height| plane. If source and destination share the
+// same stride the rows are contiguous and the whole plane is moved with a
+// single memcpy (which bionic already implements with NEON).
+static void copyPlane(
+        uint8_t *dst, size_t dstStride,
+        const uint8_t *src, size_t srcStride,
+        size_t width, size_t height) {
+    // an empty plane would underflow the single-memcpy length below
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    if (dstStride == srcStride) {
+        memcpy(dst, src, dstStride * (height - 1) + width);
+        return;
+    }
+
+    for (size_t y = 0; y < height; ++y) {
+        memcpy(dst, src, width);
+
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+// Splits interleaved UV rows into separate U and V planes.
+static void deinterleavePlane(
+        uint8_t *dst_u, uint8_t *dst_v, size_t dstStride,
+        const uint8_t *src_uv, size_t srcStride,
+        size_t width, size_t height) {
+    for (size_t y = 0; y < height; ++y) {
+        size_t x = 0;
+#if defined(__ARM_NEON__)
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x2_t uv = vld2q_u8(src_uv + 2 * x);
+            vst1q_u8(dst_u + x, uv.val[0]);
+            vst1q_u8(dst_v + x, uv.val[1]);
+        }
+#endif
+        for (; x < width; ++x) {
+            dst_u[x] = src_uv[2 * x];
+            dst_v[x] = src_uv[2 * x + 1];
+        }
+
+        src_uv += srcStride;
+        dst_u += dstStride;
+        dst_v += dstStride;
+    }
+}
+
 void SoftwareRenderer::render(
         const void *data, size_t size, void *platformPrivate) {
     ANativeWindowBuffer *buf;
@@ -197,23 +251,12 @@ void SoftwareRenderer::render(
         uint8_t *dst_u = dst_v + dst_c_size;
 #endif
 
-        for (int y = 0; y < mCropHeight; ++y) {
-            memcpy(dst_y, src_y, mCropWidth);
-
-            src_y += mWidth;
-            dst_y += buf->stride;
-        }
+        copyPlane(dst_y, buf->stride, src_y, mWidth, mCropWidth, mCropHeight);
 
-        for (int y = 0; y < (mCropHeight + 1) / 2; ++y) {
-			
-			memcpy(dst_u, src_v, (mCropWidth + 1) / 2);
-            memcpy(dst_v, src_u, (mCropWidth + 1) / 2);
-			
-            src_u += mWidth / 2;
-            src_v += mWidth / 2;
-            dst_u += dst_c_stride;
-            dst_v += dst_c_stride;
-        }
+        copyPlane(dst_u, dst_c_stride, src_v, mWidth / 2,
+                (mCropWidth + 1) / 2, (mCropHeight + 1) / 2);
+        copyPlane(dst_v, dst_c_stride, src_u, mWidth / 2,
+                (mCropWidth + 1) / 2, (mCropHeight + 1) / 2);
     } else {
         CHECK_EQ(mColorFormat, OMX_TI_COLOR_FormatYUV420PackedSemiPlanar);
 
@@ -230,24 +273,10 @@ void SoftwareRenderer::render(
         uint8_t *dst_v = dst_y + dst_y_size;
         uint8_t *dst_u = dst_v + dst_c_size;
 
-        for (int y = 0; y < mCropHeight; ++y) {
-            memcpy(dst_y, src_y, mCropWidth);
-
-            src_y += mWidth;
-            dst_y += buf->stride;
-        }
-
-        for (int y = 0; y < (mCropHeight + 1) / 2; ++y) {
-            size_t tmp = (mCropWidth + 1) / 2;
-            for (size_t x = 0; x < tmp; ++x) {
-                dst_u[x] = src_uv[2 * x];
-                dst_v[x] = src_uv[2 * x + 1];
-            }
+        copyPlane(dst_y, buf->stride, src_y, mWidth, mCropWidth, mCropHeight);
 
-            src_uv += mWidth;
-            dst_u += dst_c_stride;
-            dst_v += dst_c_stride;
-        }
+        deinterleavePlane(dst_u, dst_v, dst_c_stride, src_uv, mWidth,
+                (mCropWidth + 1) / 2, (mCropHeight + 1) / 2);
     }
 
     CHECK_EQ(0, mapper.unlock(buf->handle));
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BRCM_FORMAT_CACHE_H_
+
+#define BRCM_FORMAT_CACHE_H_
+
+#include <string.h>
+
+#include <media/IOMX.h>
+#include <utils/KeyedVector.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+
+#include <OMX_Component.h>
+#include <OMX_Video.h>
+
+namespace android {
+
+// Process wide cache of the output port format OMX.brcm decoders end up
+// with once the OMX_COLOR_FormatYCbYCr -> OMX_COLOR_FormatYUV420Planar remap
+// has been applied. The first instance of a component enumerates
+// OMX_IndexParamVideoPortFormat as usual and stores the result; later
+// instances with the same key issue the final setParameter and read the
+// port definition back once to check the component really took it.
+//
+// Shared by OMXCodec and ACodec, hence header only.
+struct BrcmFormatCache {
+    struct Entry {
+        Entry() : mHalFormat(-1) {
+            memset(&mPortFormat, 0, sizeof(mPortFormat));
+        }
+
+        // The port format as it was finally set on the port.
+        OMX_VIDEO_PARAM_PORTFORMATTYPE mPortFormat;
+
+        // HAL pixel format the native window was configured with, -1 until
+        // the first buffer allocation.
+        int32_t mHalFormat;
+    };
+
+    static bool isCacheable(const char *componentName) {
+        return !strncmp(componentName, "OMX.brcm.", 9);
+    }
+
+    // |coding| is the mime type (or the OMX coding type it maps to),
+    // |width| x |height| is only used to pick a resolution class, pass 0 if
+    // it is not known.
+    static String8 makeKey(
+            const char *componentName, const char *coding,
+            int32_t width, int32_t height, OMX_U32 portIndex) {
+        int32_t pixels = width * height;
+        const char *resolutionClass =
+            (pixels <= 0) ? "any"
+            : (pixels <= 640 * 480) ? "sd"
+            : (pixels <= 1280 * 720) ? "hd" : "fhd";
+
+        return String8::format("%s/%s/%s/%lu",
+                componentName, coding, resolutionClass,
+                (unsigned long)portIndex);
+    }
+
+    static bool lookup(const String8 &key, Entry *entry) {
+        State *state = getState();
+        Mutex::Autolock autoLock(state->mLock);
+
+        ssize_t index = state->mEntries.indexOfKey(key);
+        if (index < 0) {
+            ++state->mMisses;
+            return false;
+        }
+
+        ++state->mHits;
+        *entry = state->mEntries.valueAt(index);
+        return true;
+    }
+
+    static void storePortFormat(
+            const String8 &key, const OMX_VIDEO_PARAM_PORTFORMATTYPE &format) {
+        State *state = getState();
+        Mutex::Autolock autoLock(state->mLock);
+
+        ssize_t index = state->mEntries.indexOfKey(key);
+        if (index < 0) {
+            index = state->mEntries.add(key, Entry());
+        }
+        state->mEntries.editValueAt(index).mPortFormat = format;
+    }
+
+    static void storeHalFormat(const String8 &key, int32_t halFormat) {
+        State *state = getState();
+        Mutex::Autolock autoLock(state->mLock);
+
+        ssize_t index = state->mEntries.indexOfKey(key);
+        if (index >= 0) {
+            state->mEntries.editValueAt(index).mHalFormat = halFormat;
+        }
+    }
+
+    // True if the port now runs with the cached |format|, read back from
+    // the port definition.
+    static bool verify(const sp<IOMX> &omx, IOMX::node_id node,
+            const OMX_VIDEO_PARAM_PORTFORMATTYPE &format) {
+        OMX_PARAM_PORTDEFINITIONTYPE def;
+        memset(&def, 0, sizeof(def));
+        def.nSize = sizeof(def);
+        def.nVersion.s.nVersionMajor = 1;
+        def.nPortIndex = format.nPortIndex;
+
+        if (omx->getParameter(node, OMX_IndexParamPortDefinition,
+                    &def, sizeof(def)) != OK) {
+            return false;
+        }
+        return def.format.video.eColorFormat == format.eColorFormat
+            && def.format.video.eCompressionFormat == format.eCompressionFormat;
+    }
+
+    // Called if the component rejects a cached format, the next instance
+    // negotiates from scratch.
+    static void invalidate(const String8 &key) {
+        State *state = getState();
+        Mutex::Autolock autoLock(state->mLock);
+
+        state->mEntries.removeItem(key);
+    }
+
+    static void getStats(size_t *hits, size_t *misses) {
+        State *state = getState();
+        Mutex::Autolock autoLock(state->mLock);
+
+        *hits = state->mHits;
+        *misses = state->mMisses;
+    }
+
+private:
+    struct State {
+        State() : mHits(0), mMisses(0) {}
+
+        Mutex mLock;
+        KeyedVector<String8, Entry> mEntries;
+        size_t mHits;
+        size_t mMisses;
+    };
+
+    static State *getState() {
+        static State *sState = new State;
+        return sState;
+    }
+};
+
+}  // namespace android
+
+#endif  // BRCM_FORMAT_CACHE_H_
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BRCM_PATCH_TRACE_H_
+
+#define BRCM_PATCH_TRACE_H_
+
+// Diagnostics for the OMX.brcm color format workarounds in OMXCodec, ACodec
+// and ColorConverter. All of it compiles to nothing unless the build defines
+// BRCM_PATCH_TRACE (see BoardConfig.mk).
+//
+// PATCH_TRACE(fmt, ...)
+//     Logs "PATCH:<fmt>" at most once per second per call site, together
+//     with the number of calls dropped since the last message.
+//
+// PATCH_TRACE_FORMAT(where, component, omxFormat, halFormat)
+//     Structured color format negotiation event, also published as the
+//     systrace counters brcm.eColorFormat / brcm.halFormat. Pass -1 as
+//     halFormat if there is none yet.
+//
+// PATCH_TRACE_SCOPE(name)
+//     Traces the enclosing scope and reports its latency, both as the
+//     systrace counter <name>_us and as a rate limited log message.
+
+#ifdef BRCM_PATCH_TRACE
+
+#ifndef ATRACE_TAG
+#define ATRACE_TAG ATRACE_TAG_VIDEO
+#endif
+
+#include <utils/Log.h>
+#include <utils/Timers.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+struct PatchTraceSite {
+    nsecs_t mLastLogTimeNs;
+    int32_t mDropped;
+};
+
+// Call sites are only rate limited approximately: the counters are not
+// synchronized, losing an update merely changes when the next message is
+// allowed through.
+static inline bool patchTraceAllow(PatchTraceSite *site, int32_t *dropped) {
+    static const nsecs_t kMinIntervalNs = 1000000000ll;
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (site->mLastLogTimeNs != 0
+            && now - site->mLastLogTimeNs < kMinIntervalNs) {
+        ++site->mDropped;
+        return false;
+    }
+
+    site->mLastLogTimeNs = now;
+    *dropped = site->mDropped;
+    site->mDropped = 0;
+
+    return true;
+}
+
+struct PatchTraceScope {
+    PatchTraceScope(const char *name, const char *counter,
+            PatchTraceSite *site)
+        : mName(name),
+          mCounter(counter),
+          mSite(site),
+          mStartTimeNs(systemTime(SYSTEM_TIME_MONOTONIC)) {
+        ATRACE_BEGIN(name);
+    }
+
+    ~PatchTraceScope() {
+        int64_t latencyUs =
+            ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - mStartTimeNs);
+
+        ATRACE_END();
+        ATRACE_INT(mCounter, (int32_t)latencyUs);
+
+        int32_t dropped;
+        if (patchTraceAllow(mSite, &dropped)) {
+            ALOGI("PATCH:%s latencyUs=%lld dropped=%d",
+                    mName, (long long)latencyUs, dropped);
+        }
+    }
+
+private:
+    const char *mName;
+    const char *mCounter;
+    PatchTraceSite *mSite;
+    nsecs_t mStartTimeNs;
+
+    PatchTraceScope(const PatchTraceScope &);
+    PatchTraceScope &operator=(const PatchTraceScope &);
+};
+
+}  // namespace android
+
+#define PATCH_TRACE(fmt, ...)                                               \
+    do {                                                                    \
+        static android::PatchTraceSite __patchSite;                         \
+        int32_t __patchDropped;                                             \
+        if (android::patchTraceAllow(&__patchSite, &__patchDropped)) {      \
+            ALOGI("PATCH:" fmt " dropped=%d", ##__VA_ARGS__,                \
+                    __patchDropped);                                        \
+        }                                                                   \
+    } while (0)
+
+#define PATCH_TRACE_FORMAT(where, component, omxFormat, halFormat)          \
+    do {                                                                    \
+        ATRACE_INT("brcm.eColorFormat", (int32_t)(omxFormat));              \
+        ATRACE_INT("brcm.halFormat", (int32_t)(halFormat));                 \
+        PATCH_TRACE("%s component=%s eColorFormat=%d halFormat=%d",         \
+                where, component, (int)(omxFormat), (int)(halFormat));      \
+    } while (0)
+
+#define PATCH_TRACE_SCOPE(name)                                             \
+    static android::PatchTraceSite __patchScopeSite;                        \
+    android::PatchTraceScope __patchScope(                                  \
+            name, name "_us", &__patchScopeSite)
+
+#else  // BRCM_PATCH_TRACE
+
+#define PATCH_TRACE(fmt, ...) do {} while (0)
+#define PATCH_TRACE_FORMAT(where, component, omxFormat, halFormat) \
+    do {} while (0)
+#define PATCH_TRACE_SCOPE(name) do {} while (0)
+
+#endif  // BRCM_PATCH_TRACE
+
+#endif  // BRCM_PATCH_TRACE_H_
@@ -1138,6 +1138,10 @@ public abstract class FmReceiver {
          * If the full scan is aborted with stopScan, this will be indicated
          * with the aborted argument.
          * <p>
+         * Depending on the hardware, this may also be called while the scan
+         * is still running, each time with all channels found so far. The
+         * last call has the complete list.
+         * <p>
          * If an error occurs during a full scan, it will be reported via
          * {@link OnErrorListener#onError()} and this method callback will not
          * be invoked.
@@ -27,10 +27,14 @@ import android.content.pm.PackageManager;
 import android.os.Bundle;
 import android.os.IBinder;
 import android.os.RemoteException;
+import android.os.SystemProperties;
 import android.provider.Settings;
 import android.util.Log;
 import android.util.Slog;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.Charset;
 import java.util.Collection;
 import java.util.HashMap;
 import java.util.Iterator;
@@ -44,8 +48,47 @@ public class FmReceiverService extends IFmReceiver.Stub {
 
     private static final String TAG = "FmReceiverService";
 
+    /*
+     * Layout of the RDS records filled in by _fm_receiver_drainRDS, native
+     * byte order. Must match android_fmradio_Receiver.cpp.
+     */
+    private static final int RDS_RECORD_SIZE = 228;
+    private static final int RDS_BATCH = 8;
+    private static final int RDS_FREQUENCY = 0;
+    private static final int RDS_PI = 4;
+    private static final int RDS_TP = 6;
+    private static final int RDS_PTY = 8;
+    private static final int RDS_TA = 10;
+    private static final int RDS_MS = 12;
+    private static final int RDS_NUM_AFS = 14;
+    private static final int RDS_AF = 16;
+    private static final int RDS_MAX_AFS = 25;
+    private static final int RDS_TMC = 116;
+    private static final int RDS_NUMBER_OF_TMC = 3;
+    private static final int RDS_TAF = 124;
+    private static final int RDS_PSN = 128;
+    private static final int RDS_PSN_SIZE = 9;
+    private static final int RDS_RT = 137;
+    private static final int RDS_RT_SIZE = 65;
+    private static final int RDS_CT = 202;
+    private static final int RDS_CT_SIZE = 15;
+    private static final int RDS_PTYN = 217;
+    private static final int RDS_PTYN_SIZE = 9;
+
+    private static final Charset RDS_CHARSET = Charset.forName("ISO-8859-1");
+
     private Context mContext;
 
+    /* drained RDS records, allocated once; also guards the drain */
+    private final ByteBuffer mRdsBuffer =
+        ByteBuffer.allocateDirect(RDS_RECORD_SIZE * RDS_BATCH).order(ByteOrder.nativeOrder());
+
+    private final byte[] mRdsString = new byte[RDS_RT_SIZE];
+
+    /* skip RDS bundles that are identical to the previous one */
+    private final boolean mRdsDeduplication =
+        SystemProperties.getBoolean("persist.fmradio.rds_dedup", true);
+
     private final HashMap<Object, OnStateChangedReceiver> mOnStateChangedReceivers =
         new HashMap<Object, OnStateChangedReceiver>();
 
@@ -1235,6 +1278,66 @@ public class FmReceiverService extends IFmReceiver.Stub {
         }
     }
 
+    /*
+     * Called from native code when RDS bundles are queued; drains all of them
+     * in batches and hands them to the listeners.
+     */
+    private void notifyOnRDSDataAvailable() {
+        synchronized (mRdsBuffer) {
+            int count;
+            while ((count = _fm_receiver_drainRDS(mRdsBuffer, mRdsDeduplication)) > 0) {
+                for (int i = 0; i < count; i++) {
+                    int base = i * RDS_RECORD_SIZE;
+                    notifyOnRDSDataFound(rdsRecordToBundle(base),
+                            mRdsBuffer.getInt(base + RDS_FREQUENCY));
+                }
+            }
+        }
+    }
+
+    private String rdsString(int offset, int size) {
+        int length = 0;
+        while (length < size && mRdsBuffer.get(offset + length) != 0) {
+            mRdsString[length] = mRdsBuffer.get(offset + length);
+            length++;
+        }
+        return new String(mRdsString, 0, length, RDS_CHARSET);
+    }
+
+    private Bundle rdsRecordToBundle(int base) {
+        ByteBuffer b = mRdsBuffer;
+        Bundle bundle = new Bundle();
+
+        bundle.putShort("PI", b.getShort(base + RDS_PI));
+        bundle.putShort("TP", b.getShort(base + RDS_TP));
+        bundle.putShort("PTY", b.getShort(base + RDS_PTY));
+        bundle.putShort("TA", b.getShort(base + RDS_TA));
+        bundle.putShort("M/S", b.getShort(base + RDS_MS));
+
+        int numAfs = b.getShort(base + RDS_NUM_AFS);
+        if (numAfs > 0 && numAfs < RDS_MAX_AFS) {
+            int[] af = new int[numAfs];
+            for (int i = 0; i < numAfs; i++) {
+                af[i] = b.getInt(base + RDS_AF + i * 4);
+            }
+            bundle.putIntArray("AF", af);
+        }
+
+        bundle.putString("PSN", rdsString(base + RDS_PSN, RDS_PSN_SIZE));
+        bundle.putString("RT", rdsString(base + RDS_RT, RDS_RT_SIZE));
+        bundle.putString("CT", rdsString(base + RDS_CT, RDS_CT_SIZE));
+        bundle.putString("PTYN", rdsString(base + RDS_PTYN, RDS_PTYN_SIZE));
+
+        short[] tmc = new short[RDS_NUMBER_OF_TMC];
+        for (int i = 0; i < RDS_NUMBER_OF_TMC; i++) {
+            tmc[i] = b.getShort(base + RDS_TMC + i * 2);
+        }
+        bundle.putShortArray("TMC", tmc);
+
+        bundle.putInt("TAF", b.getInt(base + RDS_TAF));
+        return bundle;
+    }
+
     private void notifyOnRDSDataFound(Bundle bundle, int frequency) {
         synchronized (mOnRDSDataReceivers) {
             Collection c = mOnRDSDataReceivers.values();
@@ -1340,5 +1443,7 @@ public class FmReceiverService extends IFmReceiver.Stub {
 
     private native void _fm_receiver_setRDS(boolean receiveRDS);
 
+    private native int _fm_receiver_drainRDS(ByteBuffer buffer, boolean dedup);
+
     private native boolean _fm_receiver_sendExtraCommand(String command, String[] extras);
 }
@@ -37,12 +37,14 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <math.h>
 
 
 #include "jni.h"
 #include "JNIHelp.h"
 #include "android_fmradio.h"
+#include <cutils/atomic.h>
 #include <utils/Log.h>
 
 
@@ -98,6 +100,10 @@ static void androidFmRadioRxCallbackOnVendorForcedReset(enum fmradio_reset_reaso
 
 static void androidFmRadioRxCallbackOnSignalStrengthChanged(int newLevel);
 
+static void androidFmRadioRxCallbackOnFullScanProgress(int noItems,
+                                                       int *frequencies,
+                                                       int *sigStrengths);
+
 static void androidFmRadioRxCallbackOnRDSDataFound(struct
                                                    fmradio_rds_bundle_t
                                                    *t, int frequency);
@@ -130,7 +136,8 @@ static const fmradio_vendor_callbacks_t FmRadioRxVendorCallbacks = {
     androidFmRadioRxCallbackOnRDSDataFound,
     androidFmRadioRxCallbackOnSignalStrengthChanged,
     androidFmRadioRxCallbackOnAutomaticSwitch,
-    androidFmRadioRxCallbackOnVendorForcedReset
+    androidFmRadioRxCallbackOnVendorForcedReset,
+    androidFmRadioRxCallbackOnFullScanProgress
 };
 
 extern struct FmSession_t fmTransmitterSession;
@@ -159,6 +166,377 @@ struct FmSession_t fmReceiverSession = {
 // make sure we don't refer the TransmitterSession anymore from here
 #define fmTransmitterSession ERRORDONOTUSERECEIVERSESSIONINTRANSMITTER
 
+/* java callbacks, looked up once in registerAndroidFmRadioReceiver */
+struct rx_method_offsets_t {
+    jmethodID mNotifyOnStateChanged;
+    jmethodID mNotifyOnError;
+    jmethodID mNotifyOnStarted;
+    jmethodID mNotifyOnScan;
+    jmethodID mNotifyOnFullScan;
+    jmethodID mNotifyOnForcedReset;
+    jmethodID mNotifyOnExtraCommand;
+    jmethodID mNotifyOnRDSDataAvailable;
+    jmethodID mNotifyOnSignalStrengthChanged;
+    jmethodID mNotifyOnPlayingInStereo;
+    jmethodID mNotifyOnAutomaticSwitching;
+};
+
+static struct rx_method_offsets_t rxMethods;
+
+/*
+ * Callback dispatcher. Events from the vendor layer, and the scan results
+ * of the scan worker threads, are posted to a bounded lock free queue and
+ * delivered to java by a single thread which stays attached to the VM.
+ * Signal strength and stereo changes are not queued, only their latest
+ * value is kept and delivered. Stale full scan progress is skipped.
+ */
+
+enum RxEventType_t {
+    RX_EVENT_AUTOMATIC_SWITCH,
+    RX_EVENT_SCAN,
+    RX_EVENT_FULL_SCAN
+};
+
+struct RxEvent_t {
+    enum RxEventType_t type;
+    int arg1;
+    int arg2;
+    int arg3;
+    bool flag;
+    /* full scan */
+    bool progress;
+    int32_t sequence;
+    int noItems;
+    int *frequencies_p;
+    int *sigStrengths_p;
+};
+
+#define RX_EVENT_QUEUE_SIZE 32 /* power of two */
+#define RX_EVENT_POST_RETRIES 100
+#define RX_EVENT_POST_RETRY_US 10000
+
+struct RxEventSlot_t {
+    volatile int32_t sequence;
+    struct RxEvent_t event;
+};
+
+struct RxDispatcher_t {
+    struct RxEventSlot_t slots[RX_EVENT_QUEUE_SIZE];
+    volatile int32_t head;      /* next slot to post to, shared by producers */
+    int32_t tail;               /* next slot to deliver, dispatcher only */
+    volatile int32_t signalStrength;
+    volatile int32_t signalStrengthPending;
+    volatile int32_t stereo;
+    volatile int32_t stereoPending;
+    volatile int32_t rdsPending;
+    volatile int32_t fullScanSequence;
+    volatile int32_t dropped;
+    sem_t wakeup;
+    bool running;
+};
+
+static struct RxDispatcher_t rxDispatcher;
+static pthread_once_t rxDispatcherOnce = PTHREAD_ONCE_INIT;
+
+static void androidFmRadioRxDeliverEvent(JNIEnv * env,
+                                         struct RxEvent_t *event_p);
+
+static void androidFmRadioRxCallJava(JNIEnv * env, jmethodID method, ...)
+{
+    jobject jobj = NULL;
+    va_list args;
+
+    /* jobj goes away on reset, hold a reference of our own */
+    pthread_mutex_lock(fmReceiverSession.dataMutex_p);
+    if (fmReceiverSession.jobj != NULL) {
+        jobj = env->NewLocalRef(fmReceiverSession.jobj);
+    }
+    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+
+    if (jobj == NULL || method == NULL) {
+        return;
+    }
+
+    va_start(args, method);
+    env->CallVoidMethodV(jobj, method, args);
+    va_end(args);
+
+    if (env->ExceptionCheck()) {
+        ALOGE("Exception in java callback");
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+    }
+    env->DeleteLocalRef(jobj);
+}
+
+static void *androidFmRadioRxDispatcherThread(void *args)
+{
+    JNIEnv *env;
+    struct RxEvent_t event;
+
+    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
+        ALOGE("Error, can't attach dispatcher thread");
+        rxDispatcher.running = false;
+        return NULL;
+    }
+
+    for (;;) {
+        while (sem_wait(&rxDispatcher.wakeup) != 0 && errno == EINTR);
+
+        if (android_atomic_and(0, &rxDispatcher.stereoPending)) {
+            androidFmRadioRxCallJava(env, rxMethods.mNotifyOnPlayingInStereo,
+                                     (jboolean) (android_atomic_acquire_load
+                                                 (&rxDispatcher.stereo) != 0));
+        }
+
+        if (android_atomic_and(0, &rxDispatcher.rdsPending)) {
+            androidFmRadioRxCallJava(env, rxMethods.mNotifyOnRDSDataAvailable);
+        }
+
+        if (android_atomic_and(0, &rxDispatcher.signalStrengthPending)) {
+            androidFmRadioRxCallJava(env,
+                                     rxMethods.mNotifyOnSignalStrengthChanged,
+                                     (jint) android_atomic_acquire_load
+                                     (&rxDispatcher.signalStrength));
+        }
+
+        for (;;) {
+            int32_t pos = rxDispatcher.tail;
+            struct RxEventSlot_t *slot_p =
+                &rxDispatcher.slots[pos & (RX_EVENT_QUEUE_SIZE - 1)];
+
+            if (android_atomic_acquire_load(&slot_p->sequence) != pos + 1) {
+                break;
+            }
+            event = slot_p->event;
+            android_atomic_release_store(pos + RX_EVENT_QUEUE_SIZE,
+                                         &slot_p->sequence);
+            rxDispatcher.tail = pos + 1;
+
+            androidFmRadioRxDeliverEvent(env, &event);
+        }
+    }
+
+    return NULL;
+}
+
+static void androidFmRadioRxStartDispatcher(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < RX_EVENT_QUEUE_SIZE; i++) {
+        rxDispatcher.slots[i].sequence = i;
+    }
+    if (sem_init(&rxDispatcher.wakeup, 0, 0) != 0) {
+        ALOGE("Error, can't init dispatcher semaphore");
+        return;
+    }
+
+    rxDispatcher.running = true;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, androidFmRadioRxDispatcherThread,
+                       NULL) != 0) {
+        ALOGE("Error, can't create dispatcher thread");
+        rxDispatcher.running = false;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Copies the event into the queue. If the queue is full it is dropped, or
+ * with mayWait retried for a while, results of a scan must not get lost.
+ */
+static bool androidFmRadioRxPostEvent(const struct RxEvent_t *event_p,
+                                      bool mayWait)
+{
+    int retries = mayWait ? RX_EVENT_POST_RETRIES : 0;
+    struct RxEventSlot_t *slot_p;
+    int32_t pos;
+
+    pthread_once(&rxDispatcherOnce, androidFmRadioRxStartDispatcher);
+    if (!rxDispatcher.running) {
+        return false;
+    }
+
+    for (;;) {
+        pos = android_atomic_acquire_load(&rxDispatcher.head);
+        slot_p = &rxDispatcher.slots[pos & (RX_EVENT_QUEUE_SIZE - 1)];
+        int32_t diff = android_atomic_acquire_load(&slot_p->sequence) - pos;
+
+        if (diff == 0) {
+            if (android_atomic_cmpxchg(pos, pos + 1, &rxDispatcher.head) == 0) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* full */
+            if (retries-- <= 0) {
+                int32_t dropped = android_atomic_inc(&rxDispatcher.dropped) + 1;
+                if (dropped % 64 == 1) {
+                    ALOGW("Callback queue full, %d events dropped", dropped);
+                }
+                return false;
+            }
+            usleep(RX_EVENT_POST_RETRY_US);
+        }
+    }
+
+    slot_p->event = *event_p;
+    android_atomic_release_store(pos + 1, &slot_p->sequence);
+    sem_post(&rxDispatcher.wakeup);
+    return true;
+}
+
+/* Flags a coalesced event and wakes the dispatcher if it wasn't already */
+static void androidFmRadioRxPostPending(volatile int32_t * pending_p)
+{
+    pthread_once(&rxDispatcherOnce, androidFmRadioRxStartDispatcher);
+    if (!rxDispatcher.running) {
+        return;
+    }
+
+    if (android_atomic_or(1, pending_p) == 0) {
+        sem_post(&rxDispatcher.wakeup);
+    }
+}
+
+/* Keeps only the latest value of a coalesced event */
+static void androidFmRadioRxPostLatest(volatile int32_t * value_p,
+                                       volatile int32_t * pending_p,
+                                       int32_t value)
+{
+    android_atomic_release_store(value, value_p);
+    androidFmRadioRxPostPending(pending_p);
+}
+
+static bool androidFmRadioRxPostFullScan(int noItems, int *frequencies,
+                                         int *sigStrengths, bool aborted,
+                                         bool progress)
+{
+    struct RxEvent_t event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = RX_EVENT_FULL_SCAN;
+    event.flag = aborted;
+    event.progress = progress;
+    event.noItems = noItems;
+    if (noItems > 0) {
+        event.frequencies_p = (int *) malloc(noItems * sizeof(int));
+        event.sigStrengths_p = (int *) malloc(noItems * sizeof(int));
+        if (event.frequencies_p == NULL || event.sigStrengths_p == NULL) {
+            free(event.frequencies_p);
+            free(event.sigStrengths_p);
+            return false;
+        }
+        memcpy(event.frequencies_p, frequencies, noItems * sizeof(int));
+        memcpy(event.sigStrengths_p, sigStrengths, noItems * sizeof(int));
+    }
+    /* anything posted before this is stale now */
+    event.sequence = android_atomic_inc(&rxDispatcher.fullScanSequence) + 1;
+
+    if (!androidFmRadioRxPostEvent(&event, !progress)) {
+        ALOGE("Failed to post full scan result");
+        free(event.frequencies_p);
+        free(event.sigStrengths_p);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * RDS ring. The vendor thread stores the raw bundles, java is told that
+ * data is available (coalesced) and drains them in batches with
+ * _fm_receiver_drainRDS into a direct buffer it allocated once. Single
+ * producer (the vendor RDS thread), the drain side is serialized by a lock.
+ *
+ * Records in the drain buffer, native byte order, must match
+ * FmReceiverService.RDS_*:
+ *   0 int frequency, 4 short pi, tp, pty, ta, ms, num_afs,
+ *   16 int af[RDS_MAX_AFS], 116 short tmc[RDS_NUMBER_OF_TMC], 124 int taf,
+ *   128 psn, 137 rt, 202 ct, 217 ptyn (NUL terminated)
+ */
+
+#define RDS_RING_SIZE 16 /* power of two */
+#define RDS_RECORD_SIZE 228
+
+struct RdsRecord_t {
+    int frequency;
+    struct fmradio_rds_bundle_t bundle;
+};
+
+struct RdsRing_t {
+    struct RdsRecord_t records[RDS_RING_SIZE];
+    volatile int32_t head;      /* vendor thread only */
+    volatile int32_t tail;      /* drain only */
+    volatile int32_t dropped;
+    struct RdsRecord_t last;    /* last one drained, rdsDrainLock */
+    bool hasLast;
+};
+
+static struct RdsRing_t rdsRing;
+static pthread_mutex_t rdsDrainLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool androidFmRadioRxRdsEquals(const struct RdsRecord_t *a,
+                                      const struct RdsRecord_t *b)
+{
+    const struct fmradio_rds_bundle_t *x = &a->bundle;
+    const struct fmradio_rds_bundle_t *y = &b->bundle;
+
+    return a->frequency == b->frequency && x->pi == y->pi &&
+        x->tp == y->tp && x->pty == y->pty && x->ta == y->ta &&
+        x->ms == y->ms && x->num_afs == y->num_afs && x->taf == y->taf &&
+        (x->num_afs <= 0 || x->num_afs >= RDS_MAX_AFS ||
+         !memcmp(x->af, y->af, x->num_afs * sizeof(x->af[0]))) &&
+        !memcmp(x->tmc, y->tmc, sizeof(x->tmc)) &&
+        !strncmp(x->psn, y->psn, sizeof(x->psn)) &&
+        !strncmp(x->rt, y->rt, sizeof(x->rt)) &&
+        !strncmp(x->ct, y->ct, sizeof(x->ct)) &&
+        !strncmp(x->ptyn, y->ptyn, sizeof(x->ptyn));
+}
+
+/*
+ * Drops what a previous session left undrained and forgets the last record
+ * dedup compares against. Called when the vendor isn't producing, before rx
+ * start and after reset, so moving tail up to head is safe.
+ */
+static void androidFmRadioRxRdsReset(void)
+{
+    pthread_mutex_lock(&rdsDrainLock);
+    android_atomic_release_store(android_atomic_acquire_load(&rdsRing.head),
+                                 &rdsRing.tail);
+    memset(&rdsRing.last, 0, sizeof(rdsRing.last));
+    rdsRing.hasLast = false;
+    pthread_mutex_unlock(&rdsDrainLock);
+}
+
+static void androidFmRadioRxRdsCopyString(char *dst_p, const char *src_p,
+                                          size_t size)
+{
+    strncpy(dst_p, src_p, size - 1);
+    dst_p[size - 1] = '\0';
+}
+
+static void androidFmRadioRxRdsWriteRecord(uint8_t *dst_p,
+                                           const struct RdsRecord_t *r)
+{
+    const struct fmradio_rds_bundle_t *t = &r->bundle;
+    int16_t shorts[6] = { (int16_t) t->pi, t->tp, t->pty, t->ta, t->ms,
+        t->num_afs };
+
+    memset(dst_p, 0, RDS_RECORD_SIZE);
+    memcpy(dst_p + 0, &r->frequency, sizeof(int32_t));
+    memcpy(dst_p + 4, shorts, sizeof(shorts));
+    memcpy(dst_p + 16, t->af, sizeof(t->af));
+    memcpy(dst_p + 116, t->tmc, sizeof(t->tmc));
+    memcpy(dst_p + 124, &t->taf, sizeof(int32_t));
+    androidFmRadioRxRdsCopyString((char *) dst_p + 128, t->psn, RDS_PSN_MAX_LENGTH + 1);
+    androidFmRadioRxRdsCopyString((char *) dst_p + 137, t->rt, RDS_RT_MAX_LENGTH + 1);
+    androidFmRadioRxRdsCopyString((char *) dst_p + 202, t->ct, RDS_CT_MAX_LENGTH + 1);
+    androidFmRadioRxRdsCopyString((char *) dst_p + 217, t->ptyn, RDS_PTYN_MAX_LENGTH + 1);
+}
+
 /*
 * Implementation of callbacks from within service layer. For these the
 *  mutex lock is always held on entry and need to be released before doing
@@ -171,7 +549,6 @@ static void androidFmRadioRxCallbackOnStateChanged(int oldState,
 {
     jmethodID notifyOnStateChangedMethod;
     JNIEnv *env;
-    jclass clazz;
     bool reAttached = false;
 
     ALOGI("androidFmRadioRxCallbackOnStateChanged: Old state %d, new state %d", oldState, newState);
@@ -187,11 +564,8 @@ static void androidFmRadioRxCallbackOnStateChanged(int oldState,
         }
     }
 
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-
-    notifyOnStateChangedMethod =
-        env->GetMethodID(clazz, "notifyOnStateChanged", "(II)V");
-    if (notifyOnStateChangedMethod != NULL) {
+    notifyOnStateChangedMethod = rxMethods.mNotifyOnStateChanged;
+    if (notifyOnStateChangedMethod != NULL && fmReceiverSession.jobj != NULL) {
         jobject jobj = fmReceiverSession.jobj;
         pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
         env->CallVoidMethod(jobj,
@@ -211,7 +585,6 @@ static void androidFmRadioRxCallbackOnError(void)
 {
     jmethodID notifyMethod;
     JNIEnv *env;
-    jclass clazz;
 
     ALOGI("androidFmRadioRxCallbackOnError");
 
@@ -220,10 +593,9 @@ static void androidFmRadioRxCallbackOnError(void)
         return;
     }
 
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-    notifyMethod = env->GetMethodID(clazz, "notifyOnError", "()V");
+    notifyMethod = rxMethods.mNotifyOnError;
 
-    if (notifyMethod != NULL) {
+    if (notifyMethod != NULL && fmReceiverSession.jobj != NULL) {
         jobject jobj = fmReceiverSession.jobj;
         pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
         env->CallVoidMethod(jobj, notifyMethod);
@@ -239,7 +611,6 @@ static void androidFmRadioRxCallbackOnStarted(void)
 {
     jmethodID notifyMethod;
     JNIEnv *env;
-    jclass clazz;
 
     ALOGI("androidFmRadioRxCallbackOnStarted");
 
@@ -248,10 +619,9 @@ static void androidFmRadioRxCallbackOnStarted(void)
         return;
     }
 
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-    notifyMethod = env->GetMethodID(clazz, "notifyOnStarted", "()V");
+    notifyMethod = rxMethods.mNotifyOnStarted;
 
-    if (notifyMethod != NULL) {
+    if (notifyMethod != NULL && fmReceiverSession.jobj != NULL) {
         jobject jobj = fmReceiverSession.jobj;
         pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
         env->CallVoidMethod(jobj, notifyMethod);
@@ -269,34 +639,22 @@ static void androidFmRadioRxCallbackOnScan(int foundFreq,
                                            int scanDirection,
                                            bool aborted)
 {
-    jmethodID notifyMethod;
-    JNIEnv *env;
-    jclass clazz;
+    struct RxEvent_t event;
 
     ALOGI("androidFmRadioRxCallbackOnScan: Callback foundFreq %d, signalStrength %d,"
          " scanDirection %d, aborted %u", foundFreq, signalStrength, scanDirection,
          aborted);
 
-    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
-        ALOGE("Error, can't attch current thread");
-        return;
-    }
-
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
+    memset(&event, 0, sizeof(event));
+    event.type = RX_EVENT_SCAN;
+    event.arg1 = foundFreq;
+    event.arg2 = signalStrength;
+    event.arg3 = scanDirection;
+    event.flag = aborted;
 
-    notifyMethod = env->GetMethodID(clazz, "notifyOnScan", "(IIIZ)V");
-
-    if (notifyMethod != NULL) {
-        jobject jobj = fmReceiverSession.jobj;
-        pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
-        env->CallVoidMethod(jobj, notifyMethod, foundFreq, signalStrength,
-                            scanDirection, aborted);
-        pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    } else {
-        ALOGE("ERROR - JNI can't find java notifyOnScan method");
+    if (!androidFmRadioRxPostEvent(&event, true)) {
+        ALOGE("ERROR - failed to post scan result");
     }
-
-    fmReceiverSession.jvm_p->DetachCurrentThread();
 }
 
 static void androidFmRadioRxCallbackOnFullScan(int noItems,
@@ -304,12 +662,6 @@ static void androidFmRadioRxCallbackOnFullScan(int noItems,
                                                int *sigStrengths,
                                                bool aborted)
 {
-    jmethodID notifyMethod;
-    JNIEnv *env;
-    jclass clazz;
-    jintArray jFreqs;
-    jintArray jSigStrengths;
-
     int d;
 
     ALOGI("androidFmRadioRxCallbackOnFullScan: No items %d, aborted %d",
@@ -319,40 +671,14 @@ static void androidFmRadioRxCallbackOnFullScan(int noItems,
         ALOGI("%d -> %d", frequencies[d], sigStrengths[d]);
     }
 
-    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
-        ALOGE("Error, can't attch current thread");
-        return;
-    }
-
-    jFreqs = env->NewIntArray(noItems);
-    jSigStrengths = env->NewIntArray(noItems);
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-
-    env->SetIntArrayRegion(jFreqs, 0, noItems, frequencies);
-    env->SetIntArrayRegion(jSigStrengths, 0, noItems, sigStrengths);
-
-
-    notifyMethod = env->GetMethodID(clazz, "notifyOnFullScan", "([I[IZ)V");
-
-    if (notifyMethod != NULL) {
-        jobject jobj = fmReceiverSession.jobj;
-        pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
-
-        env->CallVoidMethod(jobj, notifyMethod,
-                            jFreqs, jSigStrengths, aborted);
-        pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    } else {
-        ALOGE("ERROR - JNI can't find java notifyOnFullScan method");
-    }
-
-    fmReceiverSession.jvm_p->DetachCurrentThread();
+    (void) androidFmRadioRxPostFullScan(noItems, frequencies, sigStrengths,
+                                        aborted, false);
 }
 
 static void androidFmRadioRxCallbackOnForcedReset(enum fmradio_reset_reason_t reason)
 {
     jmethodID notifyMethod;
     JNIEnv *env;
-    jclass clazz;
     bool reAttached = false;
 
     ALOGI("androidFmRadioRxCallbackOnForcedReset");
@@ -366,10 +692,8 @@ static void androidFmRadioRxCallbackOnForcedReset(enum fmradio_reset_reason_t re
         }
     }
 
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-
-    notifyMethod = env->GetMethodID(clazz, "notifyOnForcedReset", "(I)V");
-    if (notifyMethod != NULL) {
+    notifyMethod = rxMethods.mNotifyOnForcedReset;
+    if (notifyMethod != NULL && fmReceiverSession.jobj != NULL) {
         jobject jobj = fmReceiverSession.jobj;
         pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
         env->CallVoidMethod(jobj, notifyMethod,
@@ -404,7 +728,6 @@ static void androidFmRadioRxCallbackOnExtraCommand(char* command,
 {
     jmethodID notifyMethod;
     JNIEnv *env;
-    jclass clazz;
 
     struct bundle_descriptor_offsets_t *bundle_p =
         fmReceiverSession.bundleOffsets_p;
@@ -416,14 +739,11 @@ static void androidFmRadioRxCallbackOnExtraCommand(char* command,
         return;
     }
 
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
     jobject retBundle = extraCommandRetList2Bundle(env, bundle_p, retList);
     jstring jcommand = env->NewStringUTF(command);
 
-    notifyMethod =
-        env->GetMethodID(clazz, "notifyOnExtraCommand",
-                         "(Ljava/lang/String;Landroid/os/Bundle;)V");
-    if (notifyMethod != NULL) {
+    notifyMethod = rxMethods.mNotifyOnExtraCommand;
+    if (notifyMethod != NULL && fmReceiverSession.jobj != NULL) {
         jobject jobj = fmReceiverSession.jobj;
         pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
 
@@ -436,145 +756,72 @@ static void androidFmRadioRxCallbackOnExtraCommand(char* command,
 
 /*
 * Implementation of callbacks from vendor layer. For these the  mutex lock
-* is NOT held on entry and need to be taken and released before doing
-*  calls to java layer (env->Call*Method)  becasue these might trigger new
-*  calls from java and a deadlock would occure
+* is NOT held on entry. They only post the event to the dispatcher, which
+* does the calls to java layer (env->Call*Method) without holding the lock
+* since these might trigger new calls from java and a deadlock would occure
 */
 
 static void
 androidFmRadioRxCallbackOnRDSDataFound(struct fmradio_rds_bundle_t *t,
                                        int frequency)
 {
-    jmethodID notifyMethod;
-    JNIEnv *env;
-    jclass clazz;
-    jobject bundle;
-    jshortArray jsArr;
-
-    pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    struct bundle_descriptor_offsets_t *bundle_p =
-        fmReceiverSession.bundleOffsets_p;
-
-    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
-        ALOGE("Error, can't attch current thread");
-        goto drop_lock;
-    }
-    bundle = env->NewObject(bundle_p->mClass,
-                                    bundle_p->mConstructor);
-    /* note, these calls are to predefined methods, no need to release lock */
-    env->CallVoidMethod(bundle, bundle_p->mPutShort,
-                        env->NewStringUTF("PI"), t->pi);
-    env->CallVoidMethod(bundle, bundle_p->mPutShort,
-                        env->NewStringUTF("TP"), t->tp);
-    env->CallVoidMethod(bundle, bundle_p->mPutShort,
-                        env->NewStringUTF("PTY"), t->pty);
-    env->CallVoidMethod(bundle, bundle_p->mPutShort,
-                        env->NewStringUTF("TA"), t->ta);
-    env->CallVoidMethod(bundle, bundle_p->mPutShort,
-                        env->NewStringUTF("M/S"), t->ms);
-
-    if (t->num_afs > 0 && t->num_afs < RDS_MAX_AFS) {
-        jintArray jArr = env->NewIntArray(t->num_afs);
-        env->SetIntArrayRegion(jArr, 0, t->num_afs, t->af);
-        env->CallVoidMethod(bundle, bundle_p->mPutIntArray,
-                            env->NewStringUTF("AF"), jArr);
-    }
-    env->CallVoidMethod(bundle, bundle_p->mPutString,
-                        env->NewStringUTF("PSN"),
-                        env->NewStringUTF(t->psn));
-    env->CallVoidMethod(bundle, bundle_p->mPutString,
-                        env->NewStringUTF("RT"),
-                        env->NewStringUTF(t->rt));
-    env->CallVoidMethod(bundle, bundle_p->mPutString,
-                        env->NewStringUTF("CT"),
-                        env->NewStringUTF(t->ct));
-    env->CallVoidMethod(bundle, bundle_p->mPutString,
-                        env->NewStringUTF("PTYN"),
-                        env->NewStringUTF(t->ptyn));
-
-    jsArr = env->NewShortArray(3);
-
-    env->SetShortArrayRegion(jsArr, 0, 3, t->tmc);
-    env->CallVoidMethod(bundle, bundle_p->mPutShortArray,
-                        env->NewStringUTF("TMC"), jsArr);
-
-    env->CallVoidMethod(bundle, bundle_p->mPutInt,
-                        env->NewStringUTF("TAF"), t->taf);
-
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-
-    notifyMethod =
-        env->GetMethodID(clazz, "notifyOnRDSDataFound",
-                         "(Landroid/os/Bundle;I)V");
-    if (notifyMethod != NULL) {
-        jobject jobj = fmReceiverSession.jobj;
-        pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
-        env->CallVoidMethod(jobj, notifyMethod,
-                            bundle, frequency);
-        pthread_mutex_lock(fmReceiverSession.dataMutex_p);
+    int32_t head = rdsRing.head;
+    struct RdsRecord_t *r;
+
+    if (head - android_atomic_acquire_load(&rdsRing.tail) >= RDS_RING_SIZE) {
+        /* java is behind, bundles are snapshots so the next one catches up */
+        int32_t dropped = android_atomic_inc(&rdsRing.dropped) + 1;
+        if (dropped % 64 == 1) {
+            ALOGW("RDS ring full, %d bundles dropped", dropped);
+        }
+    } else {
+        r = &rdsRing.records[head & (RDS_RING_SIZE - 1)];
+        r->frequency = frequency;
+        r->bundle = *t;
+        android_atomic_release_store(head + 1, &rdsRing.head);
     }
-    fmReceiverSession.jvm_p->DetachCurrentThread();
 
- drop_lock:
-    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+    androidFmRadioRxPostPending(&rxDispatcher.rdsPending);
 }
 
-static void androidFmRadioRxCallbackOnSignalStrengthChanged(int newLevel)
+/*
+ * Called by the vendor from within full_scan with everything found so far.
+ * Passed on as a not aborted onFullScan; the one sent when full_scan
+ * returns carries the complete list.
+ */
+static void androidFmRadioRxCallbackOnFullScanProgress(int noItems,
+                                                       int *frequencies,
+                                                       int *sigStrengths)
 {
-    jmethodID notifyMethod;
-    JNIEnv *env;
-    jclass clazz;
+    bool scanning;
 
     pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
-        ALOGE("Error, can't attch current thread");
-        goto drop_lock;
-    }
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-    notifyMethod =
-        env->GetMethodID(clazz, "notifyOnSignalStrengthChanged", "(I)V");
-    if (notifyMethod != NULL) {
-        jobject jobj = fmReceiverSession.jobj;
-        pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
-        env->CallVoidMethod(jobj, notifyMethod,
-                            newLevel);
-        pthread_mutex_lock(fmReceiverSession.dataMutex_p);
+    /* don't report anything once the scan has been stopped or reset */
+    scanning = fmReceiverSession.state == FMRADIO_STATE_SCANNING &&
+        !fmReceiverSession.lastScanAborted;
+    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+
+    if (scanning) {
+        (void) androidFmRadioRxPostFullScan(noItems, frequencies,
+                                            sigStrengths, false, true);
     }
+}
 
-    fmReceiverSession.jvm_p->DetachCurrentThread();
- drop_lock:
-    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+static void androidFmRadioRxCallbackOnSignalStrengthChanged(int newLevel)
+{
+    androidFmRadioRxPostLatest(&rxDispatcher.signalStrength,
+                               &rxDispatcher.signalStrengthPending, newLevel);
 }
 
 static void androidFmRadioRxCallbackOnPlayingInStereo(int
                                                       isPlayingInStereo)
 {
-    jmethodID notifyMethod;
-    JNIEnv *env;
-    jclass clazz;
-
     ALOGI("androidFmRadioRxCallbackOnPlayingInStereo (%d)",
          isPlayingInStereo);
 
-    pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
-        ALOGE("Error, can't attch current thread");
-        goto drop_lock;
-    }
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-    notifyMethod =
-        env->GetMethodID(clazz, "notifyOnPlayingInStereo", "(Z)V");
-    if (notifyMethod != NULL) {
-        jobject jobj = fmReceiverSession.jobj;
-        pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
-        env->CallVoidMethod(jobj, notifyMethod,
-                            (bool) isPlayingInStereo);
-        pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    }
-
-    fmReceiverSession.jvm_p->DetachCurrentThread();
- drop_lock:
-    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+    androidFmRadioRxPostLatest(&rxDispatcher.stereo,
+                               &rxDispatcher.stereoPending,
+                               isPlayingInStereo != 0);
 }
 
 /*
@@ -584,33 +831,84 @@ static void androidFmRadioRxCallbackOnPlayingInStereo(int
 
 static void androidFmRadioRxCallbackOnAutomaticSwitch(int newFrequency, enum fmradio_switch_reason_t reason)
 {
-    jmethodID notifyMethod;
-    JNIEnv *env;
-    jclass clazz;
+    struct RxEvent_t event;
 
     ALOGI("androidFmRadioRxCallbackOnAutomaticSwitch: new frequency %d, reason %d",
          newFrequency, (int) reason);
 
-    pthread_mutex_lock(fmReceiverSession.dataMutex_p);
-    if (fmReceiverSession.jvm_p->AttachCurrentThread(&env, NULL) != JNI_OK) {
-        ALOGE("Error, can't attch current thread");
-        goto drop_lock;
+    memset(&event, 0, sizeof(event));
+    event.type = RX_EVENT_AUTOMATIC_SWITCH;
+    event.arg1 = newFrequency;
+    event.arg2 = (int) reason;
+
+    (void) androidFmRadioRxPostEvent(&event, false);
+}
+
+/*
+ * Delivery of the queued events, on the dispatcher thread. Every event gets
+ * its own local reference frame, the thread never detaches.
+ */
+
+static void androidFmRadioRxDeliverFullScan(JNIEnv * env,
+                                            struct RxEvent_t *event_p)
+{
+    jintArray jFreqs;
+    jintArray jSigStrengths;
+
+    /*
+     * the arrays end up with the listeners, so they can't be recycled;
+     * a newer progress report or the final result replaces this one
+     */
+    if (event_p->progress &&
+        event_p->sequence !=
+        android_atomic_acquire_load(&rxDispatcher.fullScanSequence)) {
+        return;
     }
-    clazz = env->GetObjectClass(fmReceiverSession.jobj);
-    notifyMethod =
-        env->GetMethodID(clazz, "notifyOnAutomaticSwitching", "(II)V");
-    if (notifyMethod != NULL) {
-        jobject jobj = fmReceiverSession.jobj;
-        pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
-        env->CallVoidMethod(jobj, notifyMethod, (jint)newFrequency,
-                            (jint)reason);
-        pthread_mutex_lock(fmReceiverSession.dataMutex_p);
+
+    jFreqs = env->NewIntArray(event_p->noItems);
+    jSigStrengths = env->NewIntArray(event_p->noItems);
+    if (jFreqs == NULL || jSigStrengths == NULL) {
+        ALOGE("ERROR - can't allocate full scan result");
+        env->ExceptionClear();
+        return;
     }
 
+    env->SetIntArrayRegion(jFreqs, 0, event_p->noItems,
+                           event_p->frequencies_p);
+    env->SetIntArrayRegion(jSigStrengths, 0, event_p->noItems,
+                           event_p->sigStrengths_p);
 
-    fmReceiverSession.jvm_p->DetachCurrentThread();
- drop_lock:
-    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+    androidFmRadioRxCallJava(env, rxMethods.mNotifyOnFullScan, jFreqs,
+                             jSigStrengths, (jboolean) event_p->flag);
+}
+
+static void androidFmRadioRxDeliverEvent(JNIEnv * env,
+                                         struct RxEvent_t *event_p)
+{
+    if (env->PushLocalFrame(32) != JNI_OK) {
+        ALOGE("ERROR - can't allocate local frame");
+        env->ExceptionClear();
+    } else {
+        switch (event_p->type) {
+        case RX_EVENT_AUTOMATIC_SWITCH:
+            androidFmRadioRxCallJava(env, rxMethods.mNotifyOnAutomaticSwitching,
+                                     (jint) event_p->arg1, (jint) event_p->arg2);
+            break;
+        case RX_EVENT_SCAN:
+            androidFmRadioRxCallJava(env, rxMethods.mNotifyOnScan,
+                                     (jint) event_p->arg1, (jint) event_p->arg2,
+                                     (jint) event_p->arg3,
+                                     (jboolean) event_p->flag);
+            break;
+        case RX_EVENT_FULL_SCAN:
+            androidFmRadioRxDeliverFullScan(env, event_p);
+            break;
+        }
+        env->PopLocalFrame(NULL);
+    }
+
+    free(event_p->frequencies_p);
+    free(event_p->sigStrengths_p);
 }
 
 /*
@@ -639,6 +937,7 @@ androidFmRadioRxStart(JNIEnv * env, jobject obj, int lowFreq,
 
     if (fmReceiverSession.jobj == NULL)
         fmReceiverSession.jobj = env->NewGlobalRef(obj);
+    androidFmRadioRxRdsReset();
     (void) androidFmRadioStart(&fmReceiverSession, FMRADIO_RX,
                                &FmRadioRxVendorCallbacks, false, lowFreq,
                                highFreq, defaultFreq, grid);
@@ -653,6 +952,7 @@ androidFmRadioRxStartAsync(JNIEnv * env, jobject obj, int lowFreq,
 
     if (fmReceiverSession.jobj == NULL)
         fmReceiverSession.jobj = env->NewGlobalRef(obj);
+    androidFmRadioRxRdsReset();
     (void) androidFmRadioStart(&fmReceiverSession, FMRADIO_RX,
                                &FmRadioRxVendorCallbacks, true, lowFreq,
                                highFreq, defaultFreq, grid);
@@ -677,12 +977,18 @@ static jint androidFmRadioRxReset(JNIEnv * env, jobject obj)
 
     ALOGI("androidFmRadioRxReset");
     retval = androidFmRadioReset(&fmReceiverSession);
+    if (retval >= 0) {
+        androidFmRadioRxRdsReset();
+    }
 
+    /* the dispatcher picks up jobj under the lock */
+    pthread_mutex_lock(fmReceiverSession.dataMutex_p);
     if (retval >= 0 && fmReceiverSession.state == FMRADIO_STATE_IDLE &&
         fmReceiverSession.jobj != NULL) {
         env->DeleteGlobalRef(fmReceiverSession.jobj);
         fmReceiverSession.jobj = NULL;
     }
+    pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
 
     return retval;
 }
@@ -1405,6 +1711,48 @@ static jboolean androidFmRadioRxSendExtraCommand(JNIEnv * env, jobject obj,
 }
 
 
+/*
+ * Copies queued RDS bundles into the direct buffer, as many as fit, and
+ * returns the number of records. With dedup, bundles equal to the
+ * previously returned one are skipped.
+ */
+static jint androidFmRadioRxDrainRDS(JNIEnv * env, jobject obj,
+                                     jobject buffer, jboolean dedup)
+{
+    uint8_t *dst_p = (uint8_t *) env->GetDirectBufferAddress(buffer);
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    int max = capacity > 0 ? capacity / RDS_RECORD_SIZE : 0;
+    int count = 0;
+
+    if (dst_p == NULL || max == 0) {
+        jniThrowException(env, "java/lang/IllegalArgumentException",
+                          "not a direct buffer or too small");
+        return 0;
+    }
+
+    pthread_mutex_lock(&rdsDrainLock);
+    int32_t tail = rdsRing.tail;
+    int32_t head = android_atomic_acquire_load(&rdsRing.head);
+
+    while (tail != head && count < max) {
+        const struct RdsRecord_t *r =
+            &rdsRing.records[tail & (RDS_RING_SIZE - 1)];
+
+        if (!dedup || !rdsRing.hasLast ||
+            !androidFmRadioRxRdsEquals(r, &rdsRing.last)) {
+            androidFmRadioRxRdsWriteRecord(dst_p + count * RDS_RECORD_SIZE, r);
+            count++;
+        }
+        rdsRing.last = *r;
+        rdsRing.hasLast = true;
+        tail++;
+    }
+    android_atomic_release_store(tail, &rdsRing.tail);
+    pthread_mutex_unlock(&rdsDrainLock);
+
+    return count;
+}
+
 static JNINativeMethod gMethods[] = {
     {(char *)"_fm_receiver_getState", (char *)"()I",
      (void *) androidFmRadioRxGetState},
@@ -1453,15 +1801,36 @@ static JNINativeMethod gMethods[] = {
      (void *) androidFmRadioRxSetThreshold},
     {(char *)"_fm_receiver_setRDS", (char *)"(Z)V",
      (void *) androidFmRadioRxSetRDS},
+    {(char *)"_fm_receiver_drainRDS", (char *)"(Ljava/nio/ByteBuffer;Z)I",
+     (void *) androidFmRadioRxDrainRDS},
 };
 
 
 
 
+/*
+ * Looks up one java method, a missing one leaves the pending exception
+ * cleared and the id NULL.
+ */
+static bool androidFmRadioRxGetMethod(JNIEnv * env, jclass clazz,
+                                      const char *name, const char *sig,
+                                      jmethodID * id_p)
+{
+    *id_p = env->GetMethodID(clazz, name, sig);
+    if (*id_p == NULL || env->ExceptionCheck()) {
+        ALOGE("ERROR - JNI can't find java method %s%s", name, sig);
+        env->ExceptionClear();
+        *id_p = NULL;
+        return false;
+    }
+    return true;
+}
+
 int registerAndroidFmRadioReceiver(JavaVM * vm, JNIEnv * env)
 {
     ALOGI("registerAndroidFmRadioReceiver\n");
     jclass clazz;
+    int retval = -1;
 
     pthread_mutex_lock(fmReceiverSession.dataMutex_p);
     fmReceiverSession.jvm_p = vm;
@@ -1469,25 +1838,88 @@ int registerAndroidFmRadioReceiver(JavaVM * vm, JNIEnv * env)
     struct bundle_descriptor_offsets_t *bundle_p =
         (struct bundle_descriptor_offsets_t *)
         malloc(sizeof(struct bundle_descriptor_offsets_t));
+    if (bundle_p == NULL) {
+        ALOGE("ERROR - can't allocate bundle descriptor");
+        goto drop_lock;
+    }
 
     clazz = env->FindClass("android/os/Bundle");
+    if (clazz == NULL) {
+        ALOGE("ERROR - JNI can't find android.os.Bundle");
+        env->ExceptionClear();
+        free(bundle_p);
+        goto drop_lock;
+    }
+    if (!androidFmRadioRxGetMethod(env, clazz, "<init>", "()V",
+                                   &bundle_p->mConstructor) ||
+        !androidFmRadioRxGetMethod(env, clazz, "putInt",
+                                   "(Ljava/lang/String;I)V",
+                                   &bundle_p->mPutInt) ||
+        !androidFmRadioRxGetMethod(env, clazz, "putShort",
+                                   "(Ljava/lang/String;S)V",
+                                   &bundle_p->mPutShort) ||
+        !androidFmRadioRxGetMethod(env, clazz, "putIntArray",
+                                   "(Ljava/lang/String;[I)V",
+                                   &bundle_p->mPutIntArray) ||
+        !androidFmRadioRxGetMethod(env, clazz, "putShortArray",
+                                   "(Ljava/lang/String;[S)V",
+                                   &bundle_p->mPutShortArray) ||
+        !androidFmRadioRxGetMethod(env, clazz, "putString",
+                                   "(Ljava/lang/String;Ljava/lang/String;)V",
+                                   &bundle_p->mPutString)) {
+        free(bundle_p);
+        goto drop_lock;
+    }
     bundle_p->mClass = (jclass) env->NewGlobalRef(clazz);
-    bundle_p->mConstructor = env->GetMethodID(clazz, "<init>", "()V");
-    bundle_p->mPutInt =
-        env->GetMethodID(clazz, "putInt", "(Ljava/lang/String;I)V");
-    bundle_p->mPutShort =
-        env->GetMethodID(clazz, "putShort", "(Ljava/lang/String;S)V");
-    bundle_p->mPutIntArray =
-        env->GetMethodID(clazz, "putIntArray", "(Ljava/lang/String;[I)V");
-    bundle_p->mPutShortArray =
-        env->GetMethodID(clazz, "putShortArray",
-                         "(Ljava/lang/String;[S)V");
-    bundle_p->mPutString =
-        env->GetMethodID(clazz, "putString",
-                         "(Ljava/lang/String;Ljava/lang/String;)V");
 
     fmReceiverSession.bundleOffsets_p = bundle_p;
+
+    clazz = env->FindClass("com/stericsson/hardware/fm/FmReceiverService");
+    if (clazz == NULL) {
+        ALOGE("ERROR - JNI can't find FmReceiverService");
+        env->ExceptionClear();
+        goto drop_lock;
+    }
+    if (!androidFmRadioRxGetMethod(env, clazz, "notifyOnStateChanged",
+                                   "(II)V",
+                                   &rxMethods.mNotifyOnStateChanged) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnError", "()V",
+                                   &rxMethods.mNotifyOnError) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnStarted", "()V",
+                                   &rxMethods.mNotifyOnStarted) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnScan", "(IIIZ)V",
+                                   &rxMethods.mNotifyOnScan) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnFullScan",
+                                   "([I[IZ)V",
+                                   &rxMethods.mNotifyOnFullScan) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnForcedReset",
+                                   "(I)V",
+                                   &rxMethods.mNotifyOnForcedReset) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnExtraCommand",
+                                   "(Ljava/lang/String;Landroid/os/Bundle;)V",
+                                   &rxMethods.mNotifyOnExtraCommand) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnRDSDataAvailable",
+                                   "()V",
+                                   &rxMethods.mNotifyOnRDSDataAvailable) ||
+        !androidFmRadioRxGetMethod(env, clazz,
+                                   "notifyOnSignalStrengthChanged", "(I)V",
+                                   &rxMethods.mNotifyOnSignalStrengthChanged) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnPlayingInStereo",
+                                   "(Z)V",
+                                   &rxMethods.mNotifyOnPlayingInStereo) ||
+        !androidFmRadioRxGetMethod(env, clazz, "notifyOnAutomaticSwitching",
+                                   "(II)V",
+                                   &rxMethods.mNotifyOnAutomaticSwitching)) {
+        /* without the natives java can't start a session calling into them */
+        goto drop_lock;
+    }
+    retval = 0;
+
+  drop_lock:
     pthread_mutex_unlock(fmReceiverSession.dataMutex_p);
+    if (retval < 0) {
+        return retval;
+    }
     return jniRegisterNativeMethods(env,
                                     "com/stericsson/hardware/fm/FmReceiverService",
                                     gMethods, NELEM(gMethods));
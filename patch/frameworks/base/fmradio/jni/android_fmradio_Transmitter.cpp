@@ -132,7 +132,8 @@ static const fmradio_vendor_callbacks_t FmRadioTxVendorCallbacks = {
     NULL,
     NULL,
     NULL,
-    androidFmRadioTxCallbackOnVendorForcedReset
+    androidFmRadioTxCallbackOnVendorForcedReset,
+    NULL
 };
 
 extern struct FmSession_t fmReceiverSession;
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_PARCEL_STATS_H
+#define ANDROID_PARCEL_STATS_H
+
+#include <stdint.h>
+
+#include <utils/String8.h>
+
+// ---------------------------------------------------------------------------
+namespace android {
+
+// Process wide counts of the buffers backing Parcel data and object
+// offsets. Small buffers are recycled through a per-thread pool, the
+// pooled counts are the heap allocations and frees that saved.
+struct ParcelAllocStats {
+    uint32_t heapAllocs;    // malloc/realloc of a data or objects buffer
+    uint32_t heapFrees;
+    uint32_t pooledAllocs;  // buffers taken from a thread's pool
+    uint32_t pooledFrees;   // buffers given back to a thread's pool
+};
+
+void getParcelAllocStats(ParcelAllocStats* outStats);
+
+// Appends the counts to a dumpsys report.
+void dumpParcelAllocStats(String8& result);
+
+}; // namespace android
+
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_PARCEL_STATS_H
@@ -22,6 +22,7 @@
 #include <binder/IPCThreadState.h>
 #include <binder/Binder.h>
 #include <binder/BpBinder.h>
+#include <binder/ParcelStats.h>
 #include <binder/ProcessState.h>
 #include <binder/TextOutput.h>
 
@@ -32,10 +33,12 @@
 #include <utils/misc.h>
 #include <utils/Flattenable.h>
 #include <cutils/ashmem.h>
+#include <cutils/atomic.h>
 
 #include <private/binder/binder_module.h>
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -61,6 +64,12 @@
 // Maximum size of a blob to transfer in-place.
 static const size_t IN_PLACE_BLOB_LIMIT = 40 * 1024;
 
+// Buffers of exactly this size are recycled through a per-thread pool,
+// smaller requests are rounded up to them. Most transactions fit.
+static const size_t POOLED_DATA_SIZE = 256;
+static const size_t POOLED_OBJECTS_COUNT = 8;
+static const size_t POOL_DEPTH = 4;
+
 // XXX This can be made public if we want to provide
 // support for typed data.
 struct small_flat_data
@@ -285,6 +294,171 @@ status_t unflatten_binder(const sp<ProcessState>& proc,
 
 // ---------------------------------------------------------------------------
 
+/*
+ * Nearly every transaction allocates and frees the same small data and
+ * object offset buffers. Keep a few of them per thread instead of going
+ * back to the heap each time. Only buffers known to hold at least the
+ * pooled size (by their recorded capacity) are kept.
+ */
+struct parcel_buffer_pool {
+    void* data[POOL_DEPTH];
+    size_t dataCount;
+    void* objects[POOL_DEPTH];
+    size_t objectsCount;
+};
+
+static pthread_key_t gParcelPoolKey;
+static pthread_once_t gParcelPoolOnce = PTHREAD_ONCE_INIT;
+
+static volatile int32_t gParcelHeapAllocs = 0;
+static volatile int32_t gParcelHeapFrees = 0;
+static volatile int32_t gParcelPooledAllocs = 0;
+static volatile int32_t gParcelPooledFrees = 0;
+
+static void free_parcel_pool(void* p)
+{
+    parcel_buffer_pool* pool = static_cast<parcel_buffer_pool*>(p);
+    for (size_t i = 0; i < pool->dataCount; i++) {
+        free(pool->data[i]);
+    }
+    for (size_t i = 0; i < pool->objectsCount; i++) {
+        free(pool->objects[i]);
+    }
+    free(pool);
+}
+
+static void init_parcel_pool_key()
+{
+    pthread_key_create(&gParcelPoolKey, free_parcel_pool);
+}
+
+static parcel_buffer_pool* get_parcel_pool()
+{
+    pthread_once(&gParcelPoolOnce, init_parcel_pool_key);
+    parcel_buffer_pool* pool =
+            static_cast<parcel_buffer_pool*>(pthread_getspecific(gParcelPoolKey));
+    if (pool == NULL) {
+        pool = static_cast<parcel_buffer_pool*>(calloc(1, sizeof(parcel_buffer_pool)));
+        if (pool != NULL) {
+            pthread_setspecific(gParcelPoolKey, pool);
+        }
+    }
+    return pool;
+}
+
+static void* pool_alloc(void** slots, size_t* count, size_t size)
+{
+    if (*count > 0) {
+        android_atomic_inc(&gParcelPooledAllocs);
+        return slots[--*count];
+    }
+    android_atomic_inc(&gParcelHeapAllocs);
+    return malloc(size);
+}
+
+static void pool_free(void** slots, size_t* count, void* p)
+{
+    if (*count < POOL_DEPTH) {
+        android_atomic_inc(&gParcelPooledFrees);
+        slots[(*count)++] = p;
+        return;
+    }
+    android_atomic_inc(&gParcelHeapFrees);
+    free(p);
+}
+
+static uint8_t* alloc_data(size_t desired, size_t* outCapacity)
+{
+    parcel_buffer_pool* pool;
+    if (desired <= POOLED_DATA_SIZE && (pool = get_parcel_pool()) != NULL) {
+        *outCapacity = POOLED_DATA_SIZE;
+        return static_cast<uint8_t*>(pool_alloc(pool->data, &pool->dataCount,
+                POOLED_DATA_SIZE));
+    }
+    *outCapacity = desired;
+    android_atomic_inc(&gParcelHeapAllocs);
+    return static_cast<uint8_t*>(malloc(desired));
+}
+
+static void free_data(uint8_t* data, size_t capacity)
+{
+    parcel_buffer_pool* pool;
+    if (data == NULL) {
+        return;
+    }
+    if (capacity == POOLED_DATA_SIZE && (pool = get_parcel_pool()) != NULL) {
+        pool_free(pool->data, &pool->dataCount, data);
+        return;
+    }
+    android_atomic_inc(&gParcelHeapFrees);
+    free(data);
+}
+
+static size_t* alloc_objects(size_t count, size_t* outCapacity)
+{
+    parcel_buffer_pool* pool;
+    if (count <= POOLED_OBJECTS_COUNT && (pool = get_parcel_pool()) != NULL) {
+        *outCapacity = POOLED_OBJECTS_COUNT;
+        return static_cast<size_t*>(pool_alloc(pool->objects, &pool->objectsCount,
+                POOLED_OBJECTS_COUNT*sizeof(size_t)));
+    }
+    *outCapacity = count;
+    android_atomic_inc(&gParcelHeapAllocs);
+    return static_cast<size_t*>(malloc(count*sizeof(size_t)));
+}
+
+static void free_objects(size_t* objects, size_t capacity)
+{
+    parcel_buffer_pool* pool;
+    if (objects == NULL) {
+        return;
+    }
+    if (capacity == POOLED_OBJECTS_COUNT && (pool = get_parcel_pool()) != NULL) {
+        pool_free(pool->objects, &pool->objectsCount, objects);
+        return;
+    }
+    android_atomic_inc(&gParcelHeapFrees);
+    free(objects);
+}
+
+static void* realloc_counted(void* p, size_t size)
+{
+    android_atomic_inc(&gParcelHeapAllocs);
+    return realloc(p, size);
+}
+
+// grows |objects| to at least |count| offsets
+static size_t* grow_objects(size_t* objects, size_t count, size_t* outCapacity)
+{
+    if (objects == NULL) {
+        return alloc_objects(count, outCapacity);
+    }
+    size_t* grown = static_cast<size_t*>(realloc_counted(objects, count*sizeof(size_t)));
+    if (grown != NULL) {
+        *outCapacity = count;
+    }
+    return grown;
+}
+
+void getParcelAllocStats(ParcelAllocStats* outStats)
+{
+    outStats->heapAllocs = android_atomic_acquire_load(&gParcelHeapAllocs);
+    outStats->heapFrees = android_atomic_acquire_load(&gParcelHeapFrees);
+    outStats->pooledAllocs = android_atomic_acquire_load(&gParcelPooledAllocs);
+    outStats->pooledFrees = android_atomic_acquire_load(&gParcelPooledFrees);
+}
+
+void dumpParcelAllocStats(String8& result)
+{
+    ParcelAllocStats stats;
+    getParcelAllocStats(&stats);
+    result.appendFormat("  Parcel buffers: %u heap allocs, %u heap frees, "
+            "%u pooled allocs, %u pooled frees\n",
+            stats.heapAllocs, stats.heapFrees, stats.pooledAllocs, stats.pooledFrees);
+}
+
+// ---------------------------------------------------------------------------
+
 Parcel::Parcel()
 {
     initState();
@@ -411,14 +585,14 @@ status_t Parcel::appendFrom(const Parcel *parcel, size_t offset, size_t len)
     if (numObjects > 0) {
         // grow objects
         if (mObjectsCapacity < mObjectsSize + numObjects) {
-            int newSize = ((mObjectsSize + numObjects)*3)/2;
-            size_t *objects =
-                (size_t*)realloc(mObjects, newSize*sizeof(size_t));
+            size_t newSize = ((mObjectsSize + numObjects)*3)/2;
+            size_t capacity;
+            size_t *objects = grow_objects(mObjects, newSize, &capacity);
             if (objects == (size_t*)0) {
                 return NO_MEMORY;
             }
             mObjects = objects;
-            mObjectsCapacity = newSize;
+            mObjectsCapacity = capacity;
         }
         
         // append and acquire objects
@@ -787,6 +961,9 @@ status_t Parcel::writeBlob(size_t len, WritableBlob* outBlob)
         return NO_ERROR;
     }
 
+    // Large payloads go into an ashmem region passed by fd: the transaction
+    // only carries the descriptor, so the payload is written once and
+    // never copied by the driver or counted against the 1MB binder buffer.
     ALOGV("writeBlob: write to ashmem");
     int fd = ashmem_create_region("Parcel Blob", len);
     if (fd < 0) return NO_MEMORY;
@@ -893,10 +1070,11 @@ restart_write:
     }
     if (!enoughObjects) {
         size_t newSize = ((mObjectsSize+2)*3)/2;
-        size_t* objects = (size_t*)realloc(mObjects, newSize*sizeof(size_t));
+        size_t capacity;
+        size_t* objects = grow_objects(mObjects, newSize, &capacity);
         if (objects == NULL) return NO_MEMORY;
         mObjects = objects;
-        mObjectsCapacity = newSize;
+        mObjectsCapacity = capacity;
     }
     
     goto restart_write;
@@ -1200,8 +1378,9 @@ status_t Parcel::readBlob(size_t len, ReadableBlob* outBlob) const
     int fd = readFileDescriptor();
     if (fd == int(BAD_TYPE)) return BAD_VALUE;
 
+    // the writer sealed the region read-only, it can't be mapped otherwise
     void* ptr = ::mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
-    if (!ptr) return NO_MEMORY;
+    if (ptr == MAP_FAILED) return NO_MEMORY;
 
     outBlob->init(true /*mapped*/, ptr, len);
     return NO_ERROR;
@@ -1439,8 +1618,8 @@ void Parcel::freeDataNoInit()
         mOwner(this, mData, mDataSize, mObjects, mObjectsSize, mOwnerCookie);
     } else {
         releaseObjects();
-        if (mData) free(mData);
-        if (mObjects) free(mObjects);
+        free_data(mData, mDataCapacity);
+        free_objects(mObjects, mObjectsCapacity);
     }
 }
 
@@ -1459,7 +1638,17 @@ status_t Parcel::restartWrite(size_t desired)
         return continueWrite(desired);
     }
     
-    uint8_t* data = (uint8_t*)realloc(mData, desired);
+    uint8_t* data;
+    size_t capacity = desired;
+    if (!mData) {
+        data = alloc_data(desired, &capacity);
+    } else if (desired <= POOLED_DATA_SIZE && mDataCapacity == POOLED_DATA_SIZE) {
+        // keep the pooled buffer rather than shrinking it
+        data = mData;
+        capacity = mDataCapacity;
+    } else {
+        data = (uint8_t*)realloc_counted(mData, desired);
+    }
     if (!data && desired > mDataCapacity) {
         mError = NO_MEMORY;
         return NO_MEMORY;
@@ -1469,14 +1658,14 @@ status_t Parcel::restartWrite(size_t desired)
     
     if (data) {
         mData = data;
-        mDataCapacity = desired;
+        mDataCapacity = capacity;
     }
     
     mDataSize = mDataPos = 0;
     ALOGV("restartWrite Setting data size of %p to %d\n", this, mDataSize);
     ALOGV("restartWrite Setting data pos of %p to %d\n", this, mDataPos);
         
-    free(mObjects);
+    free_objects(mObjects, mObjectsCapacity);
     mObjects = NULL;
     mObjectsSize = mObjectsCapacity = 0;
     mNextObjectHint = 0;
@@ -1513,17 +1702,19 @@ status_t Parcel::continueWrite(size_t desired)
 
         // If there is a different owner, we need to take
         // posession.
-        uint8_t* data = (uint8_t*)malloc(desired);
+        size_t dataCapacity;
+        uint8_t* data = alloc_data(desired, &dataCapacity);
         if (!data) {
             mError = NO_MEMORY;
             return NO_MEMORY;
         }
         size_t* objects = NULL;
+        size_t objectsCapacity = 0;
         
         if (objectsSize) {
-            objects = (size_t*)malloc(objectsSize*sizeof(size_t));
+            objects = alloc_objects(objectsSize, &objectsCapacity);
             if (!objects) {
-                free(data);
+                free_data(data, dataCapacity);
 
                 mError = NO_MEMORY;
                 return NO_MEMORY;
@@ -1551,8 +1742,9 @@ status_t Parcel::continueWrite(size_t desired)
         mObjects = objects;
         mDataSize = (mDataSize < desired) ? mDataSize : desired;
         ALOGV("continueWrite Setting data size of %p to %d\n", this, mDataSize);
-        mDataCapacity = desired;
-        mObjectsSize = mObjectsCapacity = objectsSize;
+        mDataCapacity = dataCapacity;
+        mObjectsSize = objectsSize;
+        mObjectsCapacity = objectsCapacity;
         mNextObjectHint = 0;
 
     } else if (mData) {
@@ -1568,10 +1760,17 @@ status_t Parcel::continueWrite(size_t desired)
                 }
                 release_object(proc, *flat, this);
             }
-            size_t* objects =
-                (size_t*)realloc(mObjects, objectsSize*sizeof(size_t));
-            if (objects) {
-                mObjects = objects;
+            if (objectsSize == 0) {
+                free_objects(mObjects, mObjectsCapacity);
+                mObjects = NULL;
+                mObjectsCapacity = 0;
+            } else if (mObjectsCapacity != POOLED_OBJECTS_COUNT) {
+                size_t* objects =
+                    (size_t*)realloc_counted(mObjects, objectsSize*sizeof(size_t));
+                if (objects) {
+                    mObjects = objects;
+                    mObjectsCapacity = objectsSize;
+                }
             }
             mObjectsSize = objectsSize;
             mNextObjectHint = 0;
@@ -1579,7 +1778,7 @@ status_t Parcel::continueWrite(size_t desired)
 
         // We own the data, so we can just do a realloc().
         if (desired > mDataCapacity) {
-            uint8_t* data = (uint8_t*)realloc(mData, desired);
+            uint8_t* data = (uint8_t*)realloc_counted(mData, desired);
             if (data) {
                 mData = data;
                 mDataCapacity = desired;
@@ -1600,7 +1799,8 @@ status_t Parcel::continueWrite(size_t desired)
         
     } else {
         // This is the first data.  Easy!
-        uint8_t* data = (uint8_t*)malloc(desired);
+        size_t capacity;
+        uint8_t* data = alloc_data(desired, &capacity);
         if (!data) {
             mError = NO_MEMORY;
             return NO_MEMORY;
@@ -1615,7 +1815,7 @@ status_t Parcel::continueWrite(size_t desired)
         mDataSize = mDataPos = 0;
         ALOGV("continueWrite Setting data size of %p to %d\n", this, mDataSize);
         ALOGV("continueWrite Setting data pos of %p to %d\n", this, mDataPos);
-        mDataCapacity = desired;
+        mDataCapacity = capacity;
     }
 
     return NO_ERROR;
@@ -17,11 +17,18 @@
 #define LOG_TAG "Sensors"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/types.h>
+#define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <sys/_system_properties.h>
+
+#include <cutils/properties.h>
 
 #include <utils/Errors.h>
-#include <utils/RefBase.h>
+#include <utils/KeyedVector.h>
 #include <utils/Looper.h>
+#include <utils/Mutex.h>
+#include <utils/RefBase.h>
 
 #include <gui/Sensor.h>
 #include <gui/BitTube.h>
@@ -34,12 +41,140 @@
 namespace android {
 // ----------------------------------------------------------------------------
 
+/*
+ * Events received versus the wakeups (socket reads) they took, per queue.
+ * Logged when the queue goes away, and for every live queue of a process
+ * on its next wakeup after debug.sensors.queue_stats is set:
+ *
+ *   adb shell setprop debug.sensors.queue_stats 1; adb logcat -s Sensors
+ *
+ * Kept out of line so the class layout the NDK and the framework were
+ * built against doesn't change.
+ */
+namespace {
+struct QueueStats {
+    QueueStats() : events(0), wakeups(0), clamped(0) { }
+    uint32_t events;
+    uint32_t wakeups;
+    uint32_t clamped;   // rate requests slowed to the minimum period
+};
+
+Mutex sStatsLock;
+KeyedVector<const void*, QueueStats> sStats;
+
+const char* const kStatsProperty = "debug.sensors.queue_stats";
+
+void logStatsLocked(const void* queue, const QueueStats& st) {
+    ALOGD("SensorEventQueue %p: %u events in %u wakeups (%u.%02u per wakeup), "
+            "%u rate requests clamped", queue, st.events, st.wakeups,
+            st.wakeups ? st.events / st.wakeups : 0,
+            st.wakeups ? (st.events % st.wakeups) * 100 / st.wakeups : 0,
+            st.clamped);
+}
+
+// Logs all queues of this process if kStatsProperty was set since the
+// last look. Every set bumps the property's serial, a read is cheap.
+void checkStatsRequestLocked() {
+    static const prop_info* sInfo = NULL;
+    static uint32_t sSerial = 0;
+    static uint32_t sLookups = 0;
+
+    if (sInfo == NULL) {
+        // not set yet, look for it again every so many wakeups
+        if (sLookups++ % 256) {
+            return;
+        }
+        sInfo = __system_property_find(kStatsProperty);
+        if (sInfo == NULL) {
+            return;
+        }
+        sSerial = __system_property_serial(sInfo);
+        if (sLookups == 1) {
+            // set before this process started, not a request to it
+            return;
+        }
+    } else {
+        uint32_t serial = __system_property_serial(sInfo);
+        if (serial == sSerial) {
+            return;
+        }
+        sSerial = serial;
+    }
+
+    for (size_t i = 0; i < sStats.size(); i++) {
+        logStatsLocked(sStats.keyAt(i), sStats.valueAt(i));
+    }
+}
+
+void countWakeup(const void* queue, ssize_t events) {
+    Mutex::Autolock _l(sStatsLock);
+    ssize_t idx = sStats.indexOfKey(queue);
+    if (idx < 0) {
+        idx = sStats.add(queue, QueueStats());
+    }
+    QueueStats& st(sStats.editValueAt(idx));
+    st.wakeups++;
+    if (events > 0) {
+        st.events += events;
+    }
+    checkStatsRequestLocked();
+}
+
+void countClamped(const void* queue) {
+    Mutex::Autolock _l(sStatsLock);
+    ssize_t idx = sStats.indexOfKey(queue);
+    if (idx < 0) {
+        idx = sStats.add(queue, QueueStats());
+    }
+    sStats.editValueAt(idx).clamped++;
+}
+
+void dumpAndForget(const void* queue) {
+    Mutex::Autolock _l(sStatsLock);
+    ssize_t idx = sStats.indexOfKey(queue);
+    if (idx < 0) {
+        return;
+    }
+    logStatsLocked(queue, sStats.valueAt(idx));
+    sStats.removeItemsAt(idx);
+}
+
+// Fastest sampling period handed to the service (ro.sensors.min_period_us,
+// 0 leaves the requests alone). Without a hardware FIFO every event wakes
+// the CPU, SENSOR_DELAY_FASTEST from a few apps keeps it from sleeping.
+int32_t minSamplingPeriodUs() {
+    static int32_t sMinPeriodUs = -1;
+    if (sMinPeriodUs < 0) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("ro.sensors.min_period_us", value, "0");
+        int32_t period = atoi(value);
+        sMinPeriodUs = period > 0 ? period : 0;
+    }
+    return sMinPeriodUs;
+}
+
+// Every rate |queue| asks the service for goes through here. 0 asks for
+// the sensor's fastest rate, it is raised too but not counted: the
+// enable of the NDK and the legacy API always passes it.
+nsecs_t clampSamplingPeriod(const void* queue, nsecs_t ns) {
+    const nsecs_t minPeriodNs = us2ns(minSamplingPeriodUs());
+    if (ns < minPeriodNs) {
+        if (ns > 0) {
+            countClamped(queue);
+        }
+        return minPeriodNs;
+    }
+    return ns;
+}
+}; // namespace
+
 SensorEventQueue::SensorEventQueue(const sp<ISensorEventConnection>& connection)
     : mSensorEventConnection(connection), mRecBuffer(NULL), mAvailable(0), mConsumed(0) {
     mRecBuffer = new ASensorEvent[MAX_RECEIVE_BUFFER_EVENT_COUNT];
 }
 
 SensorEventQueue::~SensorEventQueue() {
+    dumpAndForget(this);
     delete [] mRecBuffer;
 }
 
@@ -63,6 +198,7 @@ ssize_t SensorEventQueue::read(ASensorEvent* events, size_t numEvents) {
     if (mAvailable == 0) {
         ssize_t err = BitTube::recvObjects(mSensorChannel,
                 mRecBuffer, MAX_RECEIVE_BUFFER_EVENT_COUNT);
+        countWakeup(this, err);
         if (err < 0) {
             return err;
         }
@@ -119,7 +255,9 @@ status_t SensorEventQueue::wake() const
 }
 
 status_t SensorEventQueue::enableSensor(Sensor const* sensor) const {
-    return mSensorEventConnection->enableDisable(sensor->getHandle(), true, 0, 0, false);
+    // 0 is the sensor's fastest rate to the service
+    return mSensorEventConnection->enableDisable(sensor->getHandle(), true,
+            clampSamplingPeriod(this, 0), 0, false);
 }
 
 status_t SensorEventQueue::disableSensor(Sensor const* sensor) const {
@@ -128,10 +266,11 @@ status_t SensorEventQueue::disableSensor(Sensor const* sensor) const {
 
 status_t SensorEventQueue::enableSensor(int32_t handle, int32_t samplingPeriodUs,
                                         int maxBatchReportLatencyUs, int reservedFlags) const {
-    status_t err = mSensorEventConnection->enableDisable(handle, true, us2ns(samplingPeriodUs),
+    const nsecs_t samplingPeriodNs = clampSamplingPeriod(this, us2ns(samplingPeriodUs));
+    status_t err = mSensorEventConnection->enableDisable(handle, true, samplingPeriodNs,
                                                  us2ns(maxBatchReportLatencyUs), reservedFlags);
     if (err == NO_ERROR) {
-        mSensorEventConnection->setEventRate(handle, us2ns(samplingPeriodUs));
+        mSensorEventConnection->setEventRate(handle, samplingPeriodNs);
     }
     return err;
 }
@@ -145,7 +284,8 @@ status_t SensorEventQueue::disableSensor(int32_t handle) const {
 }
 
 status_t SensorEventQueue::setEventRate(Sensor const* sensor, nsecs_t ns) const {
-    return mSensorEventConnection->setEventRate(sensor->getHandle(), ns);
+    return mSensorEventConnection->setEventRate(sensor->getHandle(),
+            clampSamplingPeriod(this, ns));
 }
 
 // ----------------------------------------------------------------------------
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SF_COMPOSITION_STATS_H
+#define ANDROID_SF_COMPOSITION_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <utils/KeyedVector.h>
+#include <utils/Mutex.h>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+#include <utils/Trace.h>
+
+#include <ui/Fence.h>
+
+namespace android {
+
+// ---------------------------------------------------------------------------
+
+/*
+ * Per-frame accounting of the layers that ended up in GLES composition and
+ * why. Layer::setGeometry() records the reason it flagged a layer to be
+ * skipped by the HWC, SurfaceFlinger counts the HWC_FRAMEBUFFER layers after
+ * prepare(). Layers without a recorded reason were handed to GLES by the HWC
+ * itself. The counts of the last frame are published as systrace counters,
+ * the totals show up in dumpsys SurfaceFlinger, on their own with
+ * --composition-stats.
+ *
+ * GLES composition time runs from the start of doComposeSurfaces() to the
+ * signal of a native fence queued behind it, so it covers the GPU work and
+ * not only the calls issuing it. A vsync is counted as missed when a refresh
+ * starts before the present fence of the previous frame has signaled.
+ */
+class CompositionStats {
+public:
+    enum Reason {
+        REASON_HWC = 0,             // the HWC chose GLES for it
+        REASON_SECURE,              // secure layer on a non-secure display
+        REASON_TRANSFORM,           // transform the HWC API can't express
+        REASON_BROKEN_TRANSFORM,    // transform the HWC displays wrong
+        REASON_PLANE_ALPHA,         // plane alpha the HWC can't apply
+        REASON_DEBUG,               // HWC disabled by debug options
+        REASON_COUNT
+    };
+
+    enum { MAX_DISPLAYS = 4, MAX_PENDING_GLES = 4 };
+
+    // What Fence::getSignalTime() returns while the fence hasn't signaled.
+    static const nsecs_t SIGNAL_TIME_PENDING = 0x7fffffffffffffffLL;
+
+    // Records why |layer| is skipped on HWC display |dpy|, REASON_HWC
+    // clears it.
+    static void setSkipReason(const void* layer, int32_t dpy, Reason reason) {
+        if (dpy < 0 || dpy >= MAX_DISPLAYS) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        ssize_t idx = st.reasons.indexOfKey(layer);
+        const uint32_t shift = dpy * 4;
+        if (idx < 0) {
+            if (reason == REASON_HWC) {
+                return;
+            }
+            idx = st.reasons.add(layer, 0);
+        }
+        uint32_t& packed(st.reasons.editValueAt(idx));
+        packed = (packed & ~(0xfu << shift)) | (uint32_t(reason) << shift);
+    }
+
+    static void forgetLayer(const void* layer) {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.reasons.removeItem(layer);
+    }
+
+    static void beginFrame() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        memset(st.frame, 0, sizeof(st.frame));
+        st.frameBaked = 0;
+        st.frameOverlay = 0;
+    }
+
+    static void countOverlayLayer() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.frameOverlay++;
+    }
+
+    static void countGlesLayer(const void* layer, int32_t dpy) {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        uint32_t reason = REASON_HWC;
+        ssize_t idx = st.reasons.indexOfKey(layer);
+        if (idx >= 0 && dpy >= 0 && dpy < MAX_DISPLAYS) {
+            reason = (st.reasons.valueAt(idx) >> (dpy * 4)) & 0xf;
+        }
+        if (reason < REASON_COUNT) {
+            st.frame[reason]++;
+        }
+    }
+
+    // Counts a layer buffer re-rendered by SurfaceFlinger to keep it on
+    // an overlay (e.g. with plane alpha baked in).
+    static void countBakedLayer() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.frameBaked++;
+    }
+
+    static void endFrame() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        uint32_t gles = 0;
+        for (size_t i = 0; i < REASON_COUNT; i++) {
+            gles += st.frame[i];
+            st.total[i] += st.frame[i];
+            ATRACE_INT(traceName(i), st.frame[i]);
+        }
+        ATRACE_INT("GLES layers", gles);
+        ATRACE_INT("HWC layers", st.frameOverlay);
+        ATRACE_INT("baked layers", st.frameBaked);
+        st.totalBaked += st.frameBaked;
+        st.totalOverlay += st.frameOverlay;
+        st.totalGles += gles;
+        if (gles) {
+            st.glesFrames++;
+        }
+        st.frames++;
+    }
+
+    // GLES composition of a display starts.
+    static void beginGles() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.glesStart = systemTime();
+    }
+
+    // |done| signals when the GLES composition started by beginGles() has
+    // been rendered. Without a valid fence the sample is dropped.
+    static void endGles(const sp<Fence>& done) {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        if (!st.glesStart || !done->isValid()) {
+            st.glesStart = 0;
+            return;
+        }
+        if (st.pendingCount == MAX_PENDING_GLES) {
+            // the GPU is that far behind, forget the oldest
+            st.pendingFirst = (st.pendingFirst + 1) % MAX_PENDING_GLES;
+            st.pendingCount--;
+        }
+        Pending& p(st.pending[(st.pendingFirst + st.pendingCount) % MAX_PENDING_GLES]);
+        p.start = st.glesStart;
+        p.fence = done;
+        st.pendingCount++;
+        st.glesStart = 0;
+    }
+
+    // Collects the GLES compositions that finished since the last call.
+    static void pollGles() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        while (st.pendingCount) {
+            Pending& p(st.pending[st.pendingFirst]);
+            const nsecs_t signaled = p.fence->getSignalTime();
+            if (signaled == SIGNAL_TIME_PENDING) {
+                break;
+            }
+            if (signaled > p.start) {
+                const nsecs_t t = signaled - p.start;
+                st.glesTimeLast = t;
+                st.glesTimeTotal += t;
+                st.glesTimeMax = t > st.glesTimeMax ? t : st.glesTimeMax;
+                st.glesTimed++;
+                ATRACE_INT("GLES us", int32_t(ns2us(t)));
+            }
+            p.fence.clear();
+            st.pendingFirst = (st.pendingFirst + 1) % MAX_PENDING_GLES;
+            st.pendingCount--;
+        }
+    }
+
+    // A refresh starts; counts a missed vsync if the previous frame hasn't
+    // reached the display yet.
+    static void beginRefresh() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        if (st.lastPresent != NULL &&
+                st.lastPresent->getSignalTime() == SIGNAL_TIME_PENDING) {
+            st.missedVsyncs++;
+            ATRACE_INT("missed vsyncs", int32_t(st.missedVsyncs));
+        }
+    }
+
+    static void setPresentFence(const sp<Fence>& present) {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        if (present->isValid()) {
+            st.lastPresent = present;
+            st.presentFences = true;
+        } else {
+            st.lastPresent.clear();
+        }
+    }
+
+    // Counts a screenshot taken with glReadPixels instead of rendering
+    // straight into the buffer.
+    static void countReadPixelsCapture() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.readPixelsCaptures++;
+    }
+
+    static void dump(String8& result) {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        result.appendFormat("  GLES composition: %llu of %llu frames, baked layers: %llu\n",
+                (unsigned long long)st.glesFrames, (unsigned long long)st.frames,
+                (unsigned long long)st.totalBaked);
+        result.appendFormat("   layers: overlay=%llu framebuffer=%llu\n",
+                (unsigned long long)st.totalOverlay, (unsigned long long)st.totalGles);
+        result.append("   layers by reason:");
+        for (size_t i = 0; i < REASON_COUNT; i++) {
+            result.appendFormat(" %s=%llu", reasonName(i), (unsigned long long)st.total[i]);
+        }
+        result.appendFormat("\n   last frame: overlay=%u", st.frameOverlay);
+        for (size_t i = 0; i < REASON_COUNT; i++) {
+            result.appendFormat(" %s=%u", reasonName(i), st.frame[i]);
+        }
+        result.append("\n");
+        if (st.glesTimed) {
+            result.appendFormat("   GLES time: avg %.2f ms, max %.2f ms, last %.2f ms "
+                    "(%llu frames)\n",
+                    ns2us(st.glesTimeTotal / st.glesTimed) / 1000.0,
+                    ns2us(st.glesTimeMax) / 1000.0, ns2us(st.glesTimeLast) / 1000.0,
+                    (unsigned long long)st.glesTimed);
+        } else {
+            result.append("   GLES time: no samples\n");
+        }
+        if (st.presentFences) {
+            result.appendFormat("   missed vsyncs: %llu\n",
+                    (unsigned long long)st.missedVsyncs);
+        } else {
+            result.append("   missed vsyncs: n/a (no present fences)\n");
+        }
+        result.appendFormat("   readPixels screenshots: %llu\n",
+                (unsigned long long)st.readPixelsCaptures);
+    }
+
+    // Clears the totals, the per-layer reasons are kept.
+    static void reset() {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.resetTotals();
+    }
+
+    static const char* reasonName(size_t reason) {
+        static const char* const names[REASON_COUNT] = {
+            "hwc", "secure", "transform", "broken-transform", "plane-alpha", "debug"
+        };
+        return reason < REASON_COUNT ? names[reason] : "?";
+    }
+
+private:
+    struct Pending {
+        nsecs_t start;
+        sp<Fence> fence;
+    };
+
+    struct State {
+        State() : frameBaked(0), frameOverlay(0), glesStart(0),
+                pendingFirst(0), pendingCount(0), presentFences(false) {
+            memset(frame, 0, sizeof(frame));
+            resetTotals();
+        }
+        void resetTotals() {
+            memset(total, 0, sizeof(total));
+            totalBaked = totalOverlay = totalGles = 0;
+            frames = glesFrames = 0;
+            glesTimeTotal = glesTimeMax = glesTimeLast = 0;
+            glesTimed = 0;
+            missedVsyncs = 0;
+            readPixelsCaptures = 0;
+        }
+        Mutex lock;
+        KeyedVector<const void*, uint32_t> reasons;  // 4 bits per display
+        uint32_t frame[REASON_COUNT];
+        uint64_t total[REASON_COUNT];
+        uint32_t frameBaked;
+        uint32_t frameOverlay;
+        uint64_t totalBaked;
+        uint64_t totalOverlay;
+        uint64_t totalGles;
+        uint64_t frames;
+        uint64_t glesFrames;
+
+        nsecs_t glesStart;
+        Pending pending[MAX_PENDING_GLES];          // oldest first
+        size_t pendingFirst;
+        size_t pendingCount;
+        nsecs_t glesTimeTotal;
+        nsecs_t glesTimeMax;
+        nsecs_t glesTimeLast;
+        uint64_t glesTimed;
+
+        sp<Fence> lastPresent;
+        bool presentFences;                         // the HWC provides them
+        uint64_t missedVsyncs;
+        uint64_t readPixelsCaptures;
+    };
+
+    static State& state() {
+        static State sState;
+        return sState;
+    }
+
+    static const char* traceName(size_t reason) {
+        static const char* const names[REASON_COUNT] = {
+            "GLES.hwc", "GLES.secure", "GLES.transform", "GLES.broken-transform",
+            "GLES.plane-alpha", "GLES.debug"
+        };
+        return names[reason];
+    }
+};
+
+// ---------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_SF_COMPOSITION_STATS_H
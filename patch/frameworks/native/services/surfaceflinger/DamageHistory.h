@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SF_DAMAGE_HISTORY_H
+#define ANDROID_SF_DAMAGE_HISTORY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <ui/Rect.h>
+#include <ui/Region.h>
+
+#include <utils/Vector.h>
+
+#ifndef EGL_BUFFER_AGE_EXT
+#define EGL_BUFFER_AGE_EXT 0x313D
+#endif
+
+namespace android {
+
+// ---------------------------------------------------------------------------
+
+/*
+ * Partial GLES composition of the primary display. The framebuffer target
+ * used to be redrawn full-screen whenever a layer was left to GLES, even if
+ * only a clock or a cursor had changed. With EGL_EXT_buffer_age the driver
+ * tells us how many swaps old the back buffer is, so only the damage of the
+ * frames since then has to be recomposed, the rest of the buffer is still
+ * correct. DamageHistory keeps the damage of the last few swaps.
+ *
+ * A frame's damage is SurfaceFlinger's dirty region for the display, plus
+ * the dirty regions of frames that were not swapped in between. It becomes
+ * the whole screen when the HWC composition types change, since a layer
+ * moving between an overlay and GLES doesn't dirty anything by itself.
+ *
+ * Used when the EGL exposes EGL_EXT_buffer_age, unless
+ * debug.sf.partial_update is 0 (both read once).
+ */
+class DamageHistory {
+public:
+    enum { MAX_AGE = 4 };
+
+    static bool isEnabled(EGLDisplay dpy) {
+        static int sEnabled = -1;
+        if (sEnabled < 0) {
+            char value[PROPERTY_VALUE_MAX];
+            property_get("debug.sf.partial_update", value, "1");
+            const char* exts = eglQueryString(dpy, EGL_EXTENSIONS);
+            sEnabled = atoi(value) && exts && strstr(exts, "EGL_EXT_buffer_age") ? 1 : 0;
+            ALOGI("DamageHistory: partial updates %s", sEnabled ? "enabled" : "disabled");
+        }
+        return sEnabled;
+    }
+
+    // Returns the region to recompose into the current back buffer, which
+    // is then expected to be swapped. |types| are the HWC composition types
+    // of the display's layers this frame.
+    static Region repaintRegion(EGLDisplay dpy, const Rect& bounds, const Region& dirty,
+            const Vector<int32_t>& types) {
+        State& st(state());
+
+        Region damage(st.pending.merge(dirty));
+        st.pending.clear();
+        if (!sameTypes(st.types, types)) {
+            damage.set(bounds);
+            st.types = types;
+        }
+
+        EGLint age = 0;
+        if (!eglQuerySurface(dpy, eglGetCurrentSurface(EGL_DRAW),
+                EGL_BUFFER_AGE_EXT, &age)) {
+            age = 0;
+        }
+
+        Region repaint(damage);
+        if (age <= 0 || size_t(age - 1) > st.count) {
+            // undefined contents, or older than what we remember
+            repaint.set(bounds);
+        } else {
+            for (EGLint i = 0; i < age - 1; i++) {
+                repaint.orSelf(st.history[i]);
+            }
+        }
+
+        push(st, damage);
+
+        // GLES is scissored to one rectangle and layers draw their whole
+        // mesh inside it, so every layer under that rectangle is redrawn
+        return Region(repaint.intersect(bounds).bounds());
+    }
+
+    // The back buffer was recomposed completely and will be swapped.
+    static void fullFrame(const Rect& bounds) {
+        State& st(state());
+        st.pending.clear();
+        st.count = 0;
+        st.types.clear();
+        push(st, Region(bounds));
+    }
+
+    // The display was refreshed without a swap, |dirty| carries over.
+    static void skipFrame(const Region& dirty) {
+        State& st(state());
+        st.pending.orSelf(dirty);
+    }
+
+private:
+    struct State {
+        State() : count(0) { }
+        Region history[MAX_AGE];    // damage of the last swaps, newest first
+        size_t count;
+        Region pending;
+        Vector<int32_t> types;
+    };
+
+    // Only touched from the composition loop on SurfaceFlinger's main thread.
+    static State& state() {
+        static State sState;
+        return sState;
+    }
+
+    static void push(State& st, const Region& damage) {
+        for (size_t i = MAX_AGE - 1; i > 0; i--) {
+            st.history[i] = st.history[i - 1];
+        }
+        st.history[0] = damage;
+        if (st.count < MAX_AGE) {
+            st.count++;
+        }
+    }
+
+    static bool sameTypes(const Vector<int32_t>& a, const Vector<int32_t>& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i] != b[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_SF_DAMAGE_HISTORY_H
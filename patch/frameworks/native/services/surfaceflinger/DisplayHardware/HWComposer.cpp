@@ -42,6 +42,7 @@
 #include <cutils/properties.h>
 
 #include "HWComposer.h"
+#include "HwcPrepareCache.h"
 
 #include "../Layer.h"           // needed only for debugging
 #include "../SurfaceFlinger.h"
@@ -734,6 +735,7 @@ status_t HWComposer::setFramebufferTarget(int32_t id,
     disp.fbTargetHandle = buf->handle;
     disp.framebufferTarget->handle = disp.fbTargetHandle;
     disp.framebufferTarget->acquireFenceFd = acquireFenceFd;
+    HwcPrepareCache::onFramebufferTarget(id);
     return NO_ERROR;
 }
 
@@ -768,8 +770,53 @@ status_t HWComposer::prepare() {
             }
         }
     }
-    int err = hwcPrepare(mHwc, mNumDisplays, mLists);
-    ALOGE_IF(err, "HWComposer: prepare failed (%s)", strerror(-err));
+
+    // skip the HAL if every list is the one it prepared last time
+    const bool useCache = HwcPrepareCache::isEnabled() &&
+            hwcHasApiVersion(mHwc, HWC_DEVICE_API_VERSION_1_0);
+    bool cached = useCache;
+    bool hasList = false;
+    for (size_t i=0 ; i<mNumDisplays && cached ; i++) {
+        if (mLists[i]) {
+            hasList = true;
+            const DisplayData& disp(mDisplayData[i]);
+            const size_t count = mLists[i]->numHwLayers - (disp.framebufferTarget ? 1 : 0);
+            // virtual displays need a prepare() per frame to produce output
+            cached = i < VIRTUAL_DISPLAY_ID_BASE &&
+                    HwcPrepareCache::matches(i, mLists[i], count);
+        }
+    }
+    cached = cached && hasList;
+
+    int err = NO_ERROR;
+    if (cached) {
+        ATRACE_NAME("HWComposer:prepare cached");
+        for (size_t i=0 ; i<mNumDisplays ; i++) {
+            if (mLists[i]) {
+                const DisplayData& disp(mDisplayData[i]);
+                HwcPrepareCache::restore(i, mLists[i],
+                        mLists[i]->numHwLayers - (disp.framebufferTarget ? 1 : 0));
+            }
+        }
+    } else {
+        err = hwcPrepare(mHwc, mNumDisplays, mLists);
+        ALOGE_IF(err, "HWComposer: prepare failed (%s)", strerror(-err));
+    }
+
+    if (useCache) {
+        for (size_t i=0 ; i<mNumDisplays ; i++) {
+            if (!mLists[i] || err != NO_ERROR) {
+                HwcPrepareCache::invalidate(i);
+                continue;
+            }
+            const DisplayData& disp(mDisplayData[i]);
+            const size_t count = mLists[i]->numHwLayers - (disp.framebufferTarget ? 1 : 0);
+            if (!cached) {
+                HwcPrepareCache::store(i, mLists[i], count);
+            }
+            HwcPrepareCache::endPrepare(i, mLists[i], count, cached);
+        }
+    }
 
     if (err == NO_ERROR) {
         if (hwcHasApiVersion(mHwc, HWC_DEVICE_API_VERSION_1_0)) {
@@ -942,6 +989,7 @@ status_t HWComposer::commit() {
 
 status_t HWComposer::release(int disp) {
     LOG_FATAL_IF(disp >= VIRTUAL_DISPLAY_ID_BASE);
+    HwcPrepareCache::invalidate(disp);
     if (mHwc) {
         if (hwcHasVsyncEvent(mHwc)) {
             eventControl(disp, HWC_EVENT_VSYNC, 0);
@@ -953,6 +1001,7 @@ status_t HWComposer::release(int disp) {
 
 status_t HWComposer::acquire(int disp) {
     LOG_FATAL_IF(disp >= VIRTUAL_DISPLAY_ID_BASE);
+    HwcPrepareCache::invalidate(disp);
     if (mHwc) {
         return (status_t)hwcBlank(mHwc, disp, 0);
     }
@@ -970,6 +1019,7 @@ void HWComposer::disconnectDisplay(int disp) {
     dd.lastRetireFence = Fence::NO_FENCE;
     dd.lastDisplayFence = Fence::NO_FENCE;
     dd.outbufAcquireFence = Fence::NO_FENCE;
+    HwcPrepareCache::invalidate(disp);
 }
 
 int HWComposer::getVisualID() const {
@@ -1212,9 +1262,10 @@ public:
  */
 class HWCLayerVersion1 : public Iterable<HWCLayerVersion1, hwc_layer_1_t> {
     struct hwc_composer_device_1* mHwc;
+    int32_t mId;
 public:
-    HWCLayerVersion1(struct hwc_composer_device_1* hwc, hwc_layer_1_t* layer)
-        : Iterable<HWCLayerVersion1, hwc_layer_1_t>(layer), mHwc(hwc) { }
+    HWCLayerVersion1(struct hwc_composer_device_1* hwc, int32_t id, hwc_layer_1_t* layer)
+        : Iterable<HWCLayerVersion1, hwc_layer_1_t>(layer), mHwc(hwc), mId(id) { }
 
     virtual int32_t getCompositionType() const {
         return getLayer()->compositionType;
@@ -1334,6 +1385,7 @@ public:
         } else {
             getLayer()->handle = buffer->handle;
         }
+        HwcPrepareCache::setBuffer(mId, getLayer() - mLayerList, buffer);
     }
     virtual void onDisplayed() {
         hwc_region_t& visibleRegion = getLayer()->visibleRegionScreen;
@@ -1361,7 +1413,7 @@ HWComposer::LayerListIterator HWComposer::getLayerIterator(int32_t id, size_t in
         return LayerListIterator();
     }
     if (hwcHasApiVersion(mHwc, HWC_DEVICE_API_VERSION_1_0)) {
-       return LayerListIterator(new HWCLayerVersion1(mHwc, disp.list->hwLayers), index);
+       return LayerListIterator(new HWCLayerVersion1(mHwc, id, disp.list->hwLayers), index);
     } else {
        hwc_layer_list_t* list0 = reinterpret_cast<hwc_layer_list_t*>(disp.list);
        return LayerListIterator(new HWCLayerVersion0(list0->hwLayers), index);
@@ -1402,6 +1454,7 @@ void HWComposer::dump(String8& result) const {
     if (mHwc) {
         result.appendFormat("Hardware Composer state (version %8x):\n", hwcApiVersion(mHwc));
         result.appendFormat("  mDebugForceFakeVSync=%d\n", mDebugForceFakeVSync);
+        HwcPrepareCache::dump(result);
         for (size_t i=0 ; i<mNumDisplays ; i++) {
             const DisplayData& disp(mDisplayData[i]);
             if (!disp.connected)
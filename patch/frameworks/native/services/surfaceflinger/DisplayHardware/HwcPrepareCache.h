@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SF_HWC_PREPARE_CACHE_H
+#define ANDROID_SF_HWC_PREPARE_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/properties.h>
+
+#include <hardware/hwcomposer.h>
+
+#include <ui/GraphicBuffer.h>
+
+#include <utils/Mutex.h>
+#include <utils/String8.h>
+#include <utils/Vector.h>
+
+namespace android {
+
+// ---------------------------------------------------------------------------
+
+/*
+ * Remembers what the HWC decided for the last layer list of each display.
+ * SurfaceFlinger already flags HWC_GEOMETRY_CHANGED after every transaction,
+ * so a static stack (home screen, a reader app) ends up sending the same
+ * list every refresh, with only the buffer handles and fences changing.
+ * When a list matches the last prepared one in everything but those (the
+ * buffers must still have the same size and format),
+ * HWComposer::prepare() hands back the previous composition types and hints
+ * instead of calling into the HAL. If in addition none of the layers left to
+ * GLES got a new buffer, the framebuffer target still holds their
+ * composition and SurfaceFlinger just presents it again.
+ *
+ * Enabled with debug.sf.hwc_prepare_cache=1 (read once). The HWC HAL API
+ * expects a prepare() before every set(), so only turn it on for HALs that
+ * don't depend on that.
+ */
+class HwcPrepareCache {
+public:
+    enum { MAX_DISPLAYS = 4 };
+
+    static bool isEnabled() {
+        static int sEnabled = -1;
+        if (sEnabled < 0) {
+            char value[PROPERTY_VALUE_MAX];
+            property_get("debug.sf.hwc_prepare_cache", value, "0");
+            sEnabled = atoi(value) ? 1 : 0;
+        }
+        return sEnabled;
+    }
+
+    // True if |list|, with |count| layers before the framebuffer target,
+    // matches the last list prepared on display |id|.
+    static bool matches(int32_t id, const hwc_display_contents_1_t* list, size_t count) {
+        if (!isValidId(id)) {
+            return false;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        const Display& d(st.displays[id]);
+        if (!d.valid || (list->flags & HWC_GEOMETRY_CHANGED) || d.keys.size() != count) {
+            return false;
+        }
+        size_t rect = 0;
+        for (size_t i = 0; i < count; i++) {
+            const hwc_layer_1_t& l(list->hwLayers[i]);
+            if (!sameKey(d.keys[i], l, bufferAt(d, i))) {
+                return false;
+            }
+            for (size_t r = 0; r < l.visibleRegionScreen.numRects; r++, rect++) {
+                if (memcmp(&d.rects[rect], &l.visibleRegionScreen.rects[r],
+                        sizeof(hwc_rect_t))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Records the HAL's decisions for a list it just prepared.
+    static void store(int32_t id, const hwc_display_contents_1_t* list, size_t count) {
+        if (!isValidId(id)) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        Display& d(st.displays[id]);
+        d.keys.clear();
+        d.decisions.clear();
+        d.rects.clear();
+        for (size_t i = 0; i < count; i++) {
+            const hwc_layer_1_t& l(list->hwLayers[i]);
+            d.keys.add(makeKey(l, bufferAt(d, i)));
+            Decision decision;
+            decision.compositionType = l.compositionType;
+            decision.hints = l.hints;
+            d.decisions.add(decision);
+            for (size_t r = 0; r < l.visibleRegionScreen.numRects; r++) {
+                d.rects.add(l.visibleRegionScreen.rects[r]);
+            }
+        }
+        d.valid = true;
+    }
+
+    // Applies the decisions recorded by store() to a list matches() accepted.
+    static void restore(int32_t id, hwc_display_contents_1_t* list, size_t count) {
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        const Display& d(st.displays[id]);
+        for (size_t i = 0; i < count; i++) {
+            list->hwLayers[i].compositionType = d.decisions[i].compositionType;
+            list->hwLayers[i].hints = d.decisions[i].hints;
+        }
+    }
+
+    // End of prepare() for display |id|, |reused| if the decisions came from
+    // the cache. Decides whether the framebuffer target can be shown again.
+    static void endPrepare(int32_t id, const hwc_display_contents_1_t* list, size_t count,
+            bool reused) {
+        if (!isValidId(id)) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        Display& d(st.displays[id]);
+
+        bool sameGlesBuffers = d.handles.size() == count;
+        for (size_t i = 0; i < count && sameGlesBuffers; i++) {
+            const hwc_layer_1_t& l(list->hwLayers[i]);
+            if ((l.compositionType == HWC_FRAMEBUFFER || (l.flags & HWC_SKIP_LAYER)) &&
+                    l.handle != d.handles[i]) {
+                sameGlesBuffers = false;
+            }
+        }
+        d.reuseFramebuffer = reused && d.fbComposed && sameGlesBuffers;
+        if (!d.reuseFramebuffer) {
+            // valid again once SurfaceFlinger posts this frame's composition
+            d.fbComposed = false;
+        }
+
+        d.handles.clear();
+        for (size_t i = 0; i < count; i++) {
+            d.handles.add(list->hwLayers[i].handle);
+        }
+        // refilled by setBuffer() for the next frame
+        d.buffers.clear();
+
+        if (reused) {
+            st.hits++;
+        } else {
+            st.misses++;
+        }
+        if (d.reuseFramebuffer) {
+            st.framebufferReuses++;
+        }
+    }
+
+    // Layer |index| of display |id| is about to show |buffer|, the handle
+    // alone doesn't say what kind of buffer it is.
+    static void setBuffer(int32_t id, size_t index, const sp<GraphicBuffer>& buffer) {
+        if (!isEnabled() || !isValidId(id)) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        Vector<BufferInfo>& buffers(st.displays[id].buffers);
+        if (index >= buffers.size()) {
+            buffers.insertAt(BufferInfo(), buffers.size(), index + 1 - buffers.size());
+        }
+        BufferInfo& info(buffers.editItemAt(index));
+        if (buffer != 0) {
+            info.width = buffer->getWidth();
+            info.height = buffer->getHeight();
+            info.format = buffer->getPixelFormat();
+        } else {
+            info = BufferInfo();
+        }
+    }
+
+    // SurfaceFlinger posted a GLES composition for display |id|.
+    static void onFramebufferTarget(int32_t id) {
+        if (!isValidId(id)) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        st.displays[id].fbComposed = true;
+    }
+
+    // True if the framebuffer target of display |id| already holds this
+    // frame's GLES composition.
+    static bool canReuseFramebuffer(int32_t id) {
+        if (!isEnabled() || !isValidId(id)) {
+            return false;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        return st.displays[id].reuseFramebuffer;
+    }
+
+    // Forgets display |id|, e.g. when it is blanked or disconnected.
+    static void invalidate(int32_t id) {
+        if (!isValidId(id)) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        Display& d(st.displays[id]);
+        d.valid = false;
+        d.fbComposed = false;
+        d.reuseFramebuffer = false;
+        d.handles.clear();
+        d.buffers.clear();
+    }
+
+    static void dump(String8& result) {
+        if (!isEnabled()) {
+            return;
+        }
+        State& st(state());
+        Mutex::Autolock _l(st.lock);
+        result.appendFormat("  prepare cache: %llu reused, %llu prepared, "
+                "framebuffer reused %llu times\n",
+                (unsigned long long)st.hits, (unsigned long long)st.misses,
+                (unsigned long long)st.framebufferReuses);
+    }
+
+private:
+    struct BufferInfo {
+        BufferInfo() : width(0), height(0), format(0) { }
+        uint32_t width;
+        uint32_t height;
+        int32_t format;
+    };
+
+    struct Key {
+        uint32_t flags;
+        uint32_t transform;
+        int32_t blending;
+        hwc_frect_t crop;           // sourceCropf, or sourceCrop's bits
+        hwc_rect_t frame;
+        size_t numRects;
+        uint8_t planeAlpha;
+        bool hasBuffer;
+        BufferInfo buffer;
+    };
+
+    struct Decision {
+        int32_t compositionType;
+        uint32_t hints;
+    };
+
+    struct Display {
+        Display() : valid(false), fbComposed(false), reuseFramebuffer(false) { }
+        Vector<Key> keys;
+        Vector<Decision> decisions;
+        Vector<hwc_rect_t> rects;   // visible regions of all layers
+        Vector<buffer_handle_t> handles;
+        Vector<BufferInfo> buffers; // of the frame being prepared
+        bool valid;
+        bool fbComposed;
+        bool reuseFramebuffer;
+    };
+
+    struct State {
+        State() : hits(0), misses(0), framebufferReuses(0) { }
+        Mutex lock;
+        Display displays[MAX_DISPLAYS];
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t framebufferReuses;
+    };
+
+    static State& state() {
+        static State sState;
+        return sState;
+    }
+
+    static bool isValidId(int32_t id) {
+        return id >= 0 && id < MAX_DISPLAYS;
+    }
+
+    static BufferInfo bufferAt(const Display& d, size_t index) {
+        return index < d.buffers.size() ? d.buffers[index] : BufferInfo();
+    }
+
+    static Key makeKey(const hwc_layer_1_t& l, const BufferInfo& buffer) {
+        Key k;
+        memset(&k, 0, sizeof(k));
+        k.flags = l.flags;
+        k.transform = l.transform;
+        k.blending = l.blending;
+        memcpy(&k.crop, &l.sourceCropf, sizeof(k.crop));
+        k.frame = l.displayFrame;
+        k.numRects = l.visibleRegionScreen.numRects;
+        k.planeAlpha = l.planeAlpha;
+        k.hasBuffer = l.handle != NULL;
+        k.buffer = buffer;
+        return k;
+    }
+
+    static bool sameKey(const Key& k, const hwc_layer_1_t& l, const BufferInfo& buffer) {
+        return k.flags == l.flags && k.transform == l.transform &&
+                k.blending == l.blending &&
+                !memcmp(&k.crop, &l.sourceCropf, sizeof(k.crop)) &&
+                !memcmp(&k.frame, &l.displayFrame, sizeof(k.frame)) &&
+                k.numRects == l.visibleRegionScreen.numRects &&
+                k.planeAlpha == l.planeAlpha &&
+                k.hasBuffer == (l.handle != NULL) &&
+                k.buffer.width == buffer.width && k.buffer.height == buffer.height &&
+                k.buffer.format == buffer.format;
+    }
+};
+
+// ---------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_SF_HWC_PREPARE_CACHE_H
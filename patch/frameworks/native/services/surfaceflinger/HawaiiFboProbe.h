@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SF_HAWAII_FBO_PROBE_H
+#define ANDROID_SF_HAWAII_FBO_PROBE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <ui/GraphicBuffer.h>
+#include <ui/Rect.h>
+#include <ui/Region.h>
+
+#include "RenderEngine/RenderEngine.h"
+
+namespace android {
+
+// ---------------------------------------------------------------------------
+
+/*
+ * Renders into EGLImage-backed FBOs used to come out mis-oriented on HAWAII,
+ * which is why screenshots were forced through glReadPixels. Probe the driver
+ * once instead: paint the top-left quadrant of a small image-backed FBO with
+ * the y-swapped projection used for buffer targets and check where it lands
+ * in memory. Anything rendering into a gralloc buffer through an FBO
+ * (screenshots, the plane-alpha cache) picks its projection from this.
+ *
+ * Must be called on the thread owning the RenderEngine context. It leaves
+ * the viewport and projection changed, callers restore their own.
+ */
+class HawaiiFboProbe {
+public:
+    enum {
+        MODE_UNKNOWN = 0,
+        MODE_DIRECT,        // FBO layout is top-down, render with yswap
+        MODE_FLIPPED,       // FBO layout is bottom-up, render without yswap
+        MODE_UNUSABLE       // FBO output can't be fixed by the projection
+    };
+
+    static int getMode(RenderEngine& engine, EGLDisplay dpy) {
+        int& mode(state());
+        if (mode == MODE_UNKNOWN) {
+            mode = probe(engine, dpy);
+            ALOGI("HawaiiFboProbe: %s FBO rendering",
+                    mode == MODE_DIRECT ? "using direct" :
+                    mode == MODE_FLIPPED ? "using flipped" : "not using");
+        }
+        return mode;
+    }
+
+    // False until getMode() has run the probe, i.e. while calling it may
+    // still change the viewport and projection.
+    static bool isProbed() {
+        return state() != MODE_UNKNOWN;
+    }
+
+private:
+    static int& state() {
+        static int sMode = MODE_UNKNOWN;
+        return sMode;
+    }
+
+    static bool isRed(uint32_t p) {
+        // RGBA_8888 in memory order: R in the low byte, B in the third
+        return (p & 0xff) > 0x80 && ((p >> 16) & 0xff) < 0x80;
+    }
+
+    static int probe(RenderEngine& engine, EGLDisplay dpy) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("debug.sf.hawaii_readpixels", value, "0");
+        if (atoi(value)) {
+            return MODE_UNUSABLE;
+        }
+
+        const uint32_t size = 64;
+        sp<GraphicBuffer> buf = new GraphicBuffer(size, size, HAL_PIXEL_FORMAT_RGBA_8888,
+                GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE);
+        if (buf->initCheck() != NO_ERROR) {
+            return MODE_UNUSABLE;
+        }
+
+        EGLImageKHR image = eglCreateImageKHR(dpy, EGL_NO_CONTEXT,
+                EGL_NATIVE_BUFFER_ANDROID, buf->getNativeBuffer(), NULL);
+        if (image == EGL_NO_IMAGE_KHR) {
+            return MODE_UNUSABLE;
+        }
+
+        int mode = MODE_UNUSABLE;
+        {
+            RenderEngine::BindImageAsFramebuffer imageBond(engine, image, false, size, size);
+            if (imageBond.getStatus() == NO_ERROR) {
+                engine.setViewportAndProjection(size, size, size, size, true);
+                engine.clearWithColor(0, 0, 1, 1);
+                engine.fillRegionWithColor(Region(Rect(size / 2, size / 2)), size, 1, 0, 0, 1);
+
+                EGLSyncKHR sync = eglCreateSyncKHR(dpy, EGL_SYNC_FENCE_KHR, NULL);
+                if (sync != EGL_NO_SYNC_KHR) {
+                    EGLint result = eglClientWaitSyncKHR(dpy, sync,
+                            EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 2000000000 /*2 sec*/);
+                    eglDestroySyncKHR(dpy, sync);
+
+                    void* vaddr;
+                    if (result == EGL_CONDITION_SATISFIED_KHR &&
+                            buf->lock(GRALLOC_USAGE_SW_READ_OFTEN, &vaddr) == NO_ERROR) {
+                        const uint32_t* p = (const uint32_t*)vaddr;
+                        const uint32_t s = buf->getStride();
+                        const uint32_t lo = size / 4, hi = (size * 3) / 4;
+                        const bool tl = isRed(p[lo * s + lo]);
+                        const bool tr = isRed(p[lo * s + hi]);
+                        const bool bl = isRed(p[hi * s + lo]);
+                        const bool br = isRed(p[hi * s + hi]);
+                        buf->unlock();
+
+                        // anything that isn't a plain vertical flip (mirroring,
+                        // transposition, garbage) can't be fixed by the projection
+                        if (tl && !tr && !bl && !br) {
+                            mode = MODE_DIRECT;
+                        } else if (bl && !tl && !tr && !br) {
+                            mode = MODE_FLIPPED;
+                        }
+                    }
+                }
+            }
+        }
+        eglDestroyImageKHR(dpy, image);
+        return mode;
+    }
+};
+
+// ---------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_SF_HAWAII_FBO_PROBE_H
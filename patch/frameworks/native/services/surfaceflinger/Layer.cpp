@@ -18,6 +18,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <math.h>
 
@@ -26,7 +27,10 @@
 #include <cutils/properties.h>
 
 #include <utils/Errors.h>
+#include <utils/KeyedVector.h>
 #include <utils/Log.h>
+#include <utils/Mutex.h>
+#include <utils/SortedVector.h>
 #include <utils/StopWatch.h>
 #include <utils/Trace.h>
 
@@ -35,9 +39,13 @@
 
 #include <gui/Surface.h>
 
+#include <private/gui/SyncFeatures.h>
+
 #include "clz.h"
 #include "Colorizer.h"
+#include "CompositionStats.h"
 #include "DisplayDevice.h"
+#include "HawaiiFboProbe.h"
 #include "Layer.h"
 #include "SurfaceFlinger.h"
 #include "SurfaceTextureLayer.h"
@@ -57,6 +65,374 @@ namespace android {
 
 int32_t Layer::sSequence = 1;
 
+#ifdef HAWAII_HWC
+// ---------------------------------------------------------------------------
+
+/*
+ * HAWAII_HWC has display problems with some transforms, which used to mean
+ * no transform hint at all. Instead keep a per-display blacklist of the
+ * broken combinations so pre-rotated buffers can still reach the overlays
+ * everywhere else.
+ *
+ * ro.sf.hawaii.hint_blacklist:  hints that must not be sent to producers
+ * ro.sf.hawaii.hwc_xform_blacklist: final layer transforms the HWC can't
+ *                               display, these are composited with GLES
+ *
+ * Both are comma-separated "<hwc display id>:<transform>" lists, where the
+ * transform is a NATIVE_WINDOW_TRANSFORM_* value (4=rot90, 3=rot180,
+ * 7=rot270) and either side may be '*'.
+ */
+class HawaiiTransformPolicy {
+public:
+    static const HawaiiTransformPolicy& getInstance() {
+        static HawaiiTransformPolicy sPolicy;
+        return sPolicy;
+    }
+
+    bool isHintBroken(int32_t dpy, uint32_t orientation) const {
+        return isBroken(mBrokenHints, dpy, orientation);
+    }
+
+    bool isHwcTransformBroken(int32_t dpy, uint32_t orientation) const {
+        return isBroken(mBrokenHwc, dpy, orientation);
+    }
+
+private:
+    HawaiiTransformPolicy() {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("ro.sf.hawaii.hint_blacklist", value, "");
+        parse(value, mBrokenHints);
+        property_get("ro.sf.hawaii.hwc_xform_blacklist", value, "");
+        parse(value, mBrokenHwc);
+    }
+
+    static bool isBroken(const uint8_t* table, int32_t dpy, uint32_t orientation) {
+        // the identity transform always works, and displays without a
+        // HWC id are composited with GLES anyway
+        if (!orientation || orientation > 7 ||
+                dpy < 0 || dpy >= HWComposer::MAX_HWC_DISPLAYS) {
+            return false;
+        }
+        return table[dpy] & (1 << orientation);
+    }
+
+    static void parse(const char* spec, uint8_t* table) {
+        memset(table, 0, HWComposer::MAX_HWC_DISPLAYS);
+        while (*spec) {
+            while (*spec == ',' || *spec == ' ') spec++;
+            if (!*spec) break;
+
+            int dpy = -1;
+            if (*spec == '*') {
+                spec++;
+            } else {
+                dpy = strtol(spec, const_cast<char**>(&spec), 10);
+            }
+            uint8_t mask = 0xFE;
+            if (*spec == ':') {
+                spec++;
+                if (*spec == '*') {
+                    spec++;
+                } else {
+                    long t = strtol(spec, const_cast<char**>(&spec), 10);
+                    mask = (t > 0 && t <= 7) ? (1 << t) : 0;
+                }
+            }
+            for (int i = 0; i < HWComposer::MAX_HWC_DISPLAYS; i++) {
+                if (dpy < 0 || dpy == i) {
+                    table[i] |= mask;
+                }
+            }
+            while (*spec && *spec != ',') spec++;
+        }
+    }
+
+    uint8_t mBrokenHints[HWComposer::MAX_HWC_DISPLAYS];
+    uint8_t mBrokenHwc[HWComposer::MAX_HWC_DISPLAYS];
+};
+
+// ---------------------------------------------------------------------------
+
+/*
+ * HAWAII_HWC does not respect planeAlpha, so any translucent layer is
+ * skipped to GLES and drags the whole stack with it during fades and window
+ * animations. With debug.sf.hawaii_alpha_cache=1 the plane alpha is baked
+ * into a premultiplied copy of the layer's buffer instead, re-rendered only
+ * when the alpha or the buffer changes, and that copy goes to the overlay.
+ * Two buffers are cycled so we never render into the one being scanned out.
+ * Each display gets its own copies, they are released and refilled on their
+ * own schedule.
+ */
+struct AlphaCache {
+    enum { NUM_BUFFERS = 2 };
+
+    AlphaCache() : current(-1), alpha(0xFF), frameNumber(0), source(NULL),
+            inUse(false), idleFrames(0) {
+        for (int i = 0; i < NUM_BUFFERS; i++) {
+            images[i] = EGL_NO_IMAGE_KHR;
+        }
+    }
+
+    sp<GraphicBuffer> buffers[NUM_BUFFERS];
+    EGLImageKHR images[NUM_BUFFERS];
+    sp<Fence> releaseFences[NUM_BUFFERS];
+    sp<Fence> acquireFence;
+    int current;                    // slot holding the last render, or -1
+    uint8_t alpha;
+    uint64_t frameNumber;
+    const GraphicBuffer* source;
+    bool inUse;                     // handed to the HWC this frame
+    uint32_t idleFrames;
+};
+
+static Mutex sAlphaCacheLock;
+static KeyedVector<const Layer*, AlphaCache*> sAlphaCaches[HWComposer::MAX_HWC_DISPLAYS];
+
+// Buffers of destroyed caches, kept until the HWC is done scanning them out.
+struct RetiredAlphaBuffer {
+    sp<GraphicBuffer> buffer;
+    sp<Fence> releaseFence;
+};
+static Vector<RetiredAlphaBuffer> sRetiredAlphaBuffers;
+
+// Layers setGeometry() already gave to GLES for another reason, per display.
+// GLES applies their plane alpha along with the rest, there is nothing to bake.
+static SortedVector<const Layer*> sGeometrySkipped[HWComposer::MAX_HWC_DISPLAYS];
+
+static bool isAlphaCacheEnabled() {
+    static int sEnabled = -1;
+    if (sEnabled < 0) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("debug.sf.hawaii_alpha_cache", value, "0");
+        sEnabled = atoi(value) ? 1 : 0;
+    }
+    return sEnabled;
+}
+
+// Rendering into an FBO leaves the viewport and projection set up for it,
+// and DisplayDevice::makeCurrent() only sets them when it switches surfaces.
+// Make |hw| current with its own state, whichever display composes next
+// then either finds it or switches to its surface.
+static void restoreDisplayState(const sp<const DisplayDevice>& hw) {
+    hw->makeCurrent(eglGetCurrentDisplay(), eglGetCurrentContext());
+    hw->setViewportAndProjection();
+}
+
+static bool useAlphaCache(const sp<const DisplayDevice>& hw, RenderEngine& engine,
+        uint8_t alpha, bool premultiplied, bool isProtected, bool hasBuffer) {
+    // can't read protected buffers, and the baked copy is premultiplied
+    if (alpha == 0xFF || !premultiplied || isProtected || !hasBuffer ||
+            !isAlphaCacheEnabled()) {
+        return false;
+    }
+    const bool probing = !HawaiiFboProbe::isProbed();
+    const int mode = HawaiiFboProbe::getMode(engine, eglGetCurrentDisplay());
+    if (probing) {
+        restoreDisplayState(hw);
+    }
+    return mode != HawaiiFboProbe::MODE_UNUSABLE;
+}
+
+static AlphaCache* getAlphaCache(const Layer* layer, int32_t hwcId, bool create) {
+    if (hwcId < 0 || hwcId >= HWComposer::MAX_HWC_DISPLAYS) {
+        return NULL;
+    }
+    Mutex::Autolock _l(sAlphaCacheLock);
+    KeyedVector<const Layer*, AlphaCache*>& caches(sAlphaCaches[hwcId]);
+    ssize_t idx = caches.indexOfKey(layer);
+    if (idx >= 0) {
+        return caches.valueAt(idx);
+    }
+    if (!create) {
+        return NULL;
+    }
+    AlphaCache* cache = new AlphaCache();
+    caches.add(layer, cache);
+    return cache;
+}
+
+static void setGeometrySkipped(const Layer* layer, int32_t hwcId, bool skipped) {
+    if (hwcId < 0 || hwcId >= HWComposer::MAX_HWC_DISPLAYS) {
+        return;
+    }
+    Mutex::Autolock _l(sAlphaCacheLock);
+    if (skipped) {
+        sGeometrySkipped[hwcId].add(layer);
+    } else {
+        sGeometrySkipped[hwcId].remove(layer);
+    }
+}
+
+static bool isGeometrySkipped(const Layer* layer, int32_t hwcId) {
+    if (hwcId < 0 || hwcId >= HWComposer::MAX_HWC_DISPLAYS) {
+        return false;
+    }
+    Mutex::Autolock _l(sAlphaCacheLock);
+    return sGeometrySkipped[hwcId].indexOf(layer) >= 0;
+}
+
+// Drops the retired buffers the HWC has released.
+static void reapAlphaBuffers() {
+    Mutex::Autolock _l(sAlphaCacheLock);
+    for (size_t i = sRetiredAlphaBuffers.size(); i > 0; i--) {
+        const sp<Fence>& fence(sRetiredAlphaBuffers[i - 1].releaseFence);
+        if (fence == 0 ||
+                fence->getSignalTime() != CompositionStats::SIGNAL_TIME_PENDING) {
+            sRetiredAlphaBuffers.removeAt(i - 1);
+        }
+    }
+}
+
+static void destroyAlphaCache(const Layer* layer, int32_t hwcId) {
+    if (hwcId < 0 || hwcId >= HWComposer::MAX_HWC_DISPLAYS) {
+        return;
+    }
+    AlphaCache* cache;
+    {
+        Mutex::Autolock _l(sAlphaCacheLock);
+        KeyedVector<const Layer*, AlphaCache*>& caches(sAlphaCaches[hwcId]);
+        ssize_t idx = caches.indexOfKey(layer);
+        if (idx < 0) {
+            return;
+        }
+        cache = caches.valueAt(idx);
+        caches.removeItemsAt(idx);
+
+        // the HWC may still be scanning a copy out, don't free it under it
+        for (int i = 0; i < AlphaCache::NUM_BUFFERS; i++) {
+            if (cache->buffers[i] != 0) {
+                RetiredAlphaBuffer retired;
+                retired.buffer = cache->buffers[i];
+                retired.releaseFence = cache->releaseFences[i];
+                sRetiredAlphaBuffers.add(retired);
+            }
+        }
+    }
+    EGLDisplay dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    for (int i = 0; i < AlphaCache::NUM_BUFFERS; i++) {
+        if (cache->images[i] != EGL_NO_IMAGE_KHR) {
+            eglDestroyImageKHR(dpy, cache->images[i]);
+        }
+    }
+    delete cache;
+}
+
+static void destroyAlphaCaches(const Layer* layer) {
+    for (int32_t id = 0; id < HWComposer::MAX_HWC_DISPLAYS; id++) {
+        destroyAlphaCache(layer, id);
+        setGeometrySkipped(layer, id, false);
+    }
+}
+
+static bool renderAlphaCache(AlphaCache* cache, const sp<const DisplayDevice>& hw,
+        RenderEngine& engine, const sp<GraphicBuffer>& src, const Texture& texture,
+        bool opaque, uint8_t alpha) {
+    ATRACE_CALL();
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    const uint32_t w = src->getWidth();
+    const uint32_t h = src->getHeight();
+    const int slot = (cache->current + 1) % AlphaCache::NUM_BUFFERS;
+
+    sp<GraphicBuffer>& buf(cache->buffers[slot]);
+    if (buf == 0 || buf->getWidth() != w || buf->getHeight() != h) {
+        if (cache->images[slot] != EGL_NO_IMAGE_KHR) {
+            eglDestroyImageKHR(dpy, cache->images[slot]);
+            cache->images[slot] = EGL_NO_IMAGE_KHR;
+        }
+        cache->releaseFences[slot].clear();
+        buf = new GraphicBuffer(w, h, HAL_PIXEL_FORMAT_RGBA_8888,
+                GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE |
+                GRALLOC_USAGE_HW_COMPOSER);
+        if (buf->initCheck() != NO_ERROR) {
+            buf.clear();
+            return false;
+        }
+        cache->images[slot] = eglCreateImageKHR(dpy, EGL_NO_CONTEXT,
+                EGL_NATIVE_BUFFER_ANDROID, buf->getNativeBuffer(), NULL);
+        if (cache->images[slot] == EGL_NO_IMAGE_KHR) {
+            buf.clear();
+            return false;
+        }
+    }
+
+    // the HWC may still be scanning this one out from two frames ago, don't
+    // stall the main thread on it: GLES composes the layer this frame and
+    // the next one tries again
+    if (cache->releaseFences[slot] != 0) {
+        if (cache->releaseFences[slot]->getSignalTime() ==
+                CompositionStats::SIGNAL_TIME_PENDING) {
+            return false;
+        }
+        cache->releaseFences[slot].clear();
+    }
+
+    // the copy keeps the buffer's own layout, so crop and transform given
+    // to the HWC stay valid
+    const bool yswap = HawaiiFboProbe::getMode(engine, dpy) ==
+            HawaiiFboProbe::MODE_FLIPPED;
+    {
+        RenderEngine::BindImageAsFramebuffer imageBond(engine,
+                cache->images[slot], false, w, h);
+        if (imageBond.getStatus() != NO_ERROR) {
+            restoreDisplayState(hw);
+            return false;
+        }
+        engine.setViewportAndProjection(w, h, w, h, yswap);
+        engine.clearWithColor(0, 0, 0, 0);
+
+        Texture tex(texture);
+        mat4 identity;
+        tex.setDimensions(w, h);
+        tex.setFiltering(false);
+        tex.setMatrix(identity.asArray());
+        engine.setupLayerTexturing(tex);
+        engine.setupLayerBlending(true, opaque, alpha);
+
+        Mesh mesh(Mesh::TRIANGLE_FAN, 4, 2, 2);
+        Mesh::VertexArray<vec2> position(mesh.getPositionArray<vec2>());
+        Mesh::VertexArray<vec2> texCoords(mesh.getTexCoordArray<vec2>());
+        position[0] = vec2(0, 0);
+        position[1] = vec2(0, h);
+        position[2] = vec2(w, h);
+        position[3] = vec2(w, 0);
+        texCoords[0] = vec2(0, 0);
+        texCoords[1] = vec2(0, 1);
+        texCoords[2] = vec2(1, 1);
+        texCoords[3] = vec2(1, 0);
+        engine.drawMesh(mesh);
+        engine.disableBlending();
+        engine.disableTexturing();
+    }
+    restoreDisplayState(hw);
+
+    // let the HWC wait for the render rather than stalling here
+    cache->acquireFence = Fence::NO_FENCE;
+    if (SyncFeatures::getInstance().useNativeFenceSync()) {
+        EGLSyncKHR sync = eglCreateSyncKHR(dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+        if (sync != EGL_NO_SYNC_KHR) {
+            eglClientWaitSyncKHR(dpy, sync, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 0);
+            int fenceFd = eglDupNativeFenceFDANDROID(dpy, sync);
+            eglDestroySyncKHR(dpy, sync);
+            if (fenceFd != EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+                cache->acquireFence = new Fence(fenceFd);
+            }
+        }
+    }
+    if (!cache->acquireFence->isValid()) {
+        EGLSyncKHR sync = eglCreateSyncKHR(dpy, EGL_SYNC_FENCE_KHR, NULL);
+        if (sync != EGL_NO_SYNC_KHR) {
+            eglClientWaitSyncKHR(dpy, sync, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR,
+                    1000000000 /*1 sec*/);
+            eglDestroySyncKHR(dpy, sync);
+        }
+    }
+
+    cache->current = slot;
+    CompositionStats::countBakedLayer();
+    return true;
+}
+#endif
+
 Layer::Layer(SurfaceFlinger* flinger, const sp<Client>& client,
         const String8& name, uint32_t w, uint32_t h, uint32_t flags)
     :   contentDirty(false),
@@ -143,6 +519,10 @@ Layer::~Layer() {
     }
     mFlinger->deleteTextureAsync(mTextureName);
     mFrameTracker.logAndResetStats(mName);
+#ifdef HAWAII_HWC
+    destroyAlphaCaches(this);
+#endif
+    CompositionStats::forgetLayer(this);
 }
 
 // ---------------------------------------------------------------------------
@@ -153,6 +533,17 @@ void Layer::onLayerDisplayed(const sp<const DisplayDevice>& hw,
         HWComposer::HWCLayerInterface* layer) {
     if (layer) {
         layer->onDisplayed();
+#ifdef HAWAII_HWC
+        AlphaCache* cache = getAlphaCache(this, hw->getHwcDisplayId(), false);
+        if (cache && cache->inUse && layer->getCompositionType() == HWC_OVERLAY) {
+            // the HWC was showing our baked copy, not the layer's buffer
+            sp<Fence>& release(cache->releaseFences[cache->current]);
+            sp<Fence> fence(layer->getAndResetReleaseFence());
+            release = (release != 0 && release->isValid()) ?
+                    Fence::merge(String8("AlphaCache"), release, fence) : fence;
+            return;
+        }
+#endif
         mSurfaceFlingerConsumer->setReleaseFence(layer->getAndResetReleaseFence());
     }
 }
@@ -389,9 +780,12 @@ void Layer::setGeometry(
 
     // enable this layer
     layer.setSkip(false);
+    const int32_t hwcId = hw->getHwcDisplayId();
+    CompositionStats::setSkipReason(this, hwcId, CompositionStats::REASON_HWC);
 
     if (isSecure() && !hw->isSecure()) {
         layer.setSkip(true);
+        CompositionStats::setSkipReason(this, hwcId, CompositionStats::REASON_SECURE);
     }
 
     // this gives us only the "orientation" component of the transform
@@ -434,7 +828,9 @@ void Layer::setGeometry(
     }
 #endif
     layer.setCrop(computeCrop(hw));
+#ifndef HAWAII_HWC
     layer.setPlaneAlpha(s.alpha);
+#endif
 
     Transform transform = computeBufferTransform(hw);
 
@@ -443,9 +839,39 @@ void Layer::setGeometry(
     if (orientation & Transform::ROT_INVALID) {
         // we can only handle simple transformation
         layer.setSkip(true);
+        CompositionStats::setSkipReason(this, hwcId, CompositionStats::REASON_TRANSFORM);
+#ifdef HAWAII_HWC
+    } else if (HawaiiTransformPolicy::getInstance().isHwcTransformBroken(
+            hwcId, orientation)) {
+        // known to be displayed wrong by the HWC, let GLES rotate it
+        layer.setSkip(true);
+        CompositionStats::setSkipReason(this, hwcId,
+                CompositionStats::REASON_BROKEN_TRANSFORM);
+#endif
     } else {
         layer.setTransform(orientation);
     }
+
+#ifdef HAWAII_HWC
+    // a layer skipped above keeps the reason recorded for it, GLES applies
+    // its plane alpha anyway
+    const bool skipped = (isSecure() && !hw->isSecure()) ||
+            (orientation & Transform::ROT_INVALID) ||
+            HawaiiTransformPolicy::getInstance().isHwcTransformBroken(
+                    hwcId, orientation);
+    setGeometrySkipped(this, hwcId, skipped);
+    if (!skipped && useAlphaCache(hw, mFlinger->getRenderEngine(), s.alpha,
+            mPremultipliedAlpha, isProtected(), mActiveBuffer != 0)) {
+        // baked into the buffer by setPerFrameData()
+        layer.setPlaneAlpha(0xFF);
+    } else {
+        layer.setPlaneAlpha(s.alpha);
+        if (!skipped && s.alpha < 0xFF) {
+            CompositionStats::setSkipReason(this, hwcId,
+                    CompositionStats::REASON_PLANE_ALPHA);
+        }
+    }
+#endif
 }
 
 
@@ -509,6 +935,54 @@ void Layer::setPerFrameData(const sp<const DisplayDevice>& hw,
     layer.setDirtyRect(dirtyRect);
 #endif
 
+#ifdef HAWAII_HWC
+    const State& s(getDrawingState());
+    RenderEngine& engine(mFlinger->getRenderEngine());
+    const int32_t hwcId = hw->getHwcDisplayId();
+    reapAlphaBuffers();
+    AlphaCache* cache = getAlphaCache(this, hwcId, false);
+    if (!isGeometrySkipped(this, hwcId) &&
+            useAlphaCache(hw, engine, s.alpha, mPremultipliedAlpha,
+                    isProtected(), mActiveBuffer != 0)) {
+        if (!cache) {
+            cache = getAlphaCache(this, hwcId, true);
+        }
+        const uint64_t frameNumber = mSurfaceFlingerConsumer->getFrameNumber();
+        bool ready = cache->current >= 0 && cache->alpha == s.alpha &&
+                cache->source == mActiveBuffer.get() &&
+                cache->frameNumber == frameNumber;
+        if (!ready) {
+            status_t err = mSurfaceFlingerConsumer->bindTextureImage();
+            ALOGW_IF(err != NO_ERROR,
+                    "setPerFrameData: bindTextureImage failed (err=%d)", err);
+            ready = renderAlphaCache(cache, hw, engine, mActiveBuffer, mTexture,
+                    isOpaque(), s.alpha);
+            if (ready) {
+                cache->alpha = s.alpha;
+                cache->source = mActiveBuffer.get();
+                cache->frameNumber = frameNumber;
+            }
+        }
+        cache->idleFrames = 0;
+        cache->inUse = ready;
+        if (ready) {
+            layer.setBuffer(cache->buffers[cache->current]);
+            return;
+        }
+        // couldn't bake it, let GLES apply the plane alpha
+        layer.setSkip(true);
+        CompositionStats::setSkipReason(this, hw->getHwcDisplayId(),
+                CompositionStats::REASON_PLANE_ALPHA);
+    } else if (cache) {
+        // keep the copies around for a couple of frames, the HWC may still
+        // be scanning one out
+        cache->inUse = false;
+        if (++cache->idleFrames > AlphaCache::NUM_BUFFERS) {
+            destroyAlphaCache(this, hwcId);
+        }
+    }
+#endif
+
     // NOTE: buffer can be NULL if the client never drew into this
     // layer yet, or if we ran out of memory
     layer.setBuffer(mActiveBuffer);
@@ -524,6 +998,12 @@ void Layer::setAcquireFence(const sp<const DisplayDevice>& hw,
     if (layer.getCompositionType() == HWC_OVERLAY ||
             layer.getCompositionType() == HWC_BLIT) {
         sp<Fence> fence = mSurfaceFlingerConsumer->getCurrentFence();
+#ifdef HAWAII_HWC
+        AlphaCache* cache = getAlphaCache(this, hw->getHwcDisplayId(), false);
+        if (cache && cache->inUse) {
+            fence = cache->acquireFence;
+        }
+#endif
         if (fence->isValid()) {
             fenceFd = fence->dup();
             if (fenceFd == -1) {
@@ -1260,8 +1740,6 @@ uint32_t Layer::getEffectiveUsage(uint32_t usage) const
 
 void Layer::updateTransformHint(const sp<const DisplayDevice>& hw) {
     uint32_t orientation = 0;
-	// HAWAII_HWC has display problem in landscape mode when transform is used
-	#ifndef HAWAII_HWC
     if (!mFlinger->mDebugDisableTransformHint) {
         // The transform hint is used to improve performance, but we can
         // only have a single transform hint, it cannot
@@ -1271,8 +1749,15 @@ void Layer::updateTransformHint(const sp<const DisplayDevice>& hw) {
         if (orientation & Transform::ROT_INVALID) {
             orientation = 0;
         }
+#ifdef HAWAII_HWC
+        // HAWAII_HWC has display problem in landscape mode when transform
+        // is used, keep the blacklisted combinations unhinted
+        if (HawaiiTransformPolicy::getInstance().isHintBroken(
+                hw->getHwcDisplayId(), orientation)) {
+            orientation = 0;
+        }
+#endif
     }
-	#endif
     mSurfaceFlingerConsumer->setTransformHint(orientation);
     mTransformHint = orientation;
 }
@@ -33,6 +33,7 @@
 #include <binder/IPCThreadState.h>
 #include <binder/IServiceManager.h>
 #include <binder/MemoryHeapBase.h>
+#include <binder/ParcelStats.h>
 #include <binder/PermissionCache.h>
 
 #include <ui/DisplayInfo.h>
@@ -60,17 +61,21 @@
 #include "Client.h"
 #include "clz.h"
 #include "Colorizer.h"
+#include "CompositionStats.h"
+#include "DamageHistory.h"
 #include "DdmConnection.h"
 #include "DisplayDevice.h"
 #include "DispSync.h"
 #include "EventControlThread.h"
 #include "EventThread.h"
+#include "HawaiiFboProbe.h"
 #include "Layer.h"
 #include "LayerDim.h"
 #include "SurfaceFlinger.h"
 
 #include "DisplayHardware/FramebufferSurface.h"
 #include "DisplayHardware/HWComposer.h"
+#include "DisplayHardware/HwcPrepareCache.h"
 #include "DisplayHardware/VirtualDisplaySurface.h"
 
 #include "Effects/Daltonizer.h"
@@ -954,6 +959,7 @@ void SurfaceFlinger::setUpTiledDr() {
 #endif
 void SurfaceFlinger::handleMessageRefresh() {
     ATRACE_CALL();
+    CompositionStats::beginRefresh();
     preComposition();
     rebuildLayerStacks();
     setUpHWComposer();
@@ -1054,6 +1060,8 @@ void SurfaceFlinger::postComposition()
 
     const HWComposer& hwc = getHwComposer();
     sp<Fence> presentFence = hwc.getDisplayFence(HWC_DISPLAY_PRIMARY);
+    CompositionStats::setPresentFence(presentFence);
+    CompositionStats::pollGles();
 
     if (presentFence->isValid()) {
         if (mPrimaryDispSync.addPresentFence(presentFence)) {
@@ -1132,6 +1140,8 @@ void SurfaceFlinger::setUpHWComposer() {
 
     HWComposer& hwc(getHwComposer());
     if (hwc.initCheck() == NO_ERROR) {
+        CompositionStats::beginFrame();
+
         // build the h/w work list
         if (CC_UNLIKELY(mHwWorkListDirty)) {
             mHwWorkListDirty = false;
@@ -1150,6 +1160,8 @@ void SurfaceFlinger::setUpHWComposer() {
                             layer->setGeometry(hw, *cur);
                             if (mDebugDisableHWC || mDebugRegion || mDaltonize) {
                                 cur->setSkip(true);
+                                CompositionStats::setSkipReason(layer.get(), id,
+                                        CompositionStats::REASON_DEBUG);
                             }
                         }
                     }
@@ -1233,6 +1245,28 @@ void SurfaceFlinger::setUpHWComposer() {
             sp<const DisplayDevice> hw(mDisplays[dpy]);
             hw->prepareFrame(hwc);
         }
+
+        // account for the layers that ended up in GLES composition
+        for (size_t dpy=0 ; dpy<mDisplays.size() ; dpy++) {
+            sp<const DisplayDevice> hw(mDisplays[dpy]);
+            const int32_t id = hw->getHwcDisplayId();
+            if (id >= 0) {
+                const Vector< sp<Layer> >& currentLayers(
+                    hw->getVisibleLayersSortedByZ());
+                const size_t count = currentLayers.size();
+                HWComposer::LayerListIterator cur = hwc.begin(id);
+                const HWComposer::LayerListIterator end = hwc.end(id);
+                for (size_t i=0 ; cur!=end && i<count ; ++i, ++cur) {
+                    const int32_t type = cur->getCompositionType();
+                    if (type == HWC_FRAMEBUFFER) {
+                        CompositionStats::countGlesLayer(currentLayers[i].get(), id);
+                    } else if (type == HWC_OVERLAY) {
+                        CompositionStats::countOverlayLayer();
+                    }
+                }
+            }
+        }
+        CompositionStats::endFrame();
     }
 }
 
@@ -1245,8 +1279,14 @@ void SurfaceFlinger::doComposition() {
             // transform the dirty region into this screen's coordinate space
             const Region dirtyRegion(hw->getDirtyRegion(repaintEverything));
 
-            // repaint the framebuffer (if needed)
-            doDisplayComposition(hw, dirtyRegion);
+            // repaint the framebuffer (if needed), unless the HWC's framebuffer
+            // target already holds this frame's GLES composition
+            if (repaintEverything ||
+                    !HwcPrepareCache::canReuseFramebuffer(hw->getHwcDisplayId())) {
+                doDisplayComposition(hw, dirtyRegion);
+            } else if (hw->getDisplayType() == DisplayDevice::DISPLAY_PRIMARY) {
+                DamageHistory::skipFrame(dirtyRegion);
+            }
 
             hw->dirtyRegion.clear();
             hw->flip(hw->swapRegion);
@@ -1967,12 +2007,46 @@ void SurfaceFlinger::doDisplayComposition(const sp<const DisplayDevice>& hw,
             // rectangle instead of a region (see DisplayDevice::flip())
             dirtyRegion.set(hw->swapRegion.bounds());
         } else {
-            // we need to redraw everything (the whole screen)
-            dirtyRegion.set(hw->bounds());
+            HWComposer& hwc(getHwComposer());
+            const int32_t id = hw->getHwcDisplayId();
+            const bool primary = hw->getDisplayType() == DisplayDevice::DISPLAY_PRIMARY;
+            // the daltonizer composes into a new FBO every frame, which has
+            // nothing from the previous ones to keep
+            const bool partial = primary && !mDebugRegion && !mDaltonize && id >= 0 &&
+                    hwc.initCheck() == NO_ERROR && hwc.supportsFramebufferTarget() &&
+                    DamageHistory::isEnabled(mEGLDisplay);
+            if (partial && !hwc.hasGlesComposition(id)) {
+                // nothing gets drawn nor swapped, remember the damage
+                DamageHistory::skipFrame(inDirtyRegion);
+                dirtyRegion.set(hw->bounds());
+            } else if (partial && hw->makeCurrent(mEGLDisplay, mEGLContext)) {
+                // only redraw what changed since the back buffer was shown
+                Vector<int32_t> types;
+                HWComposer::LayerListIterator cur = hwc.begin(id);
+                const HWComposer::LayerListIterator end = hwc.end(id);
+                for ( ; cur != end; ++cur) {
+                    types.add(cur->getCompositionType());
+                }
+                dirtyRegion = DamageHistory::repaintRegion(mEGLDisplay, hw->bounds(),
+                        inDirtyRegion, types);
+            } else {
+                // we need to redraw everything (the whole screen)
+                dirtyRegion.set(hw->bounds());
+                if (primary) {
+                    DamageHistory::fullFrame(hw->bounds());
+                }
+            }
             hw->swapRegion = dirtyRegion;
         }
     }
 
+    // time the GLES composition up to a fence queued behind it
+    const bool timeGles = SyncFeatures::getInstance().useNativeFenceSync() &&
+            getHwComposer().hasGlesComposition(hw->getHwcDisplayId());
+    if (timeGles) {
+        CompositionStats::beginGles();
+    }
+
     if (CC_LIKELY(!mDaltonize)) {
         doComposeSurfaces(hw, dirtyRegion);
     } else {
@@ -1982,11 +2056,29 @@ void SurfaceFlinger::doDisplayComposition(const sp<const DisplayDevice>& hw,
         engine.endGroup();
     }
 
+    EGLSyncKHR glesDone = EGL_NO_SYNC_KHR;
+    if (timeGles) {
+        glesDone = eglCreateSyncKHR(mEGLDisplay, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+    }
+
     // update the swap region and clear the dirty region
     hw->swapRegion.orSelf(dirtyRegion);
 
     // swap buffers (presentation)
     hw->swapBuffers(getHwComposer());
+
+    if (timeGles) {
+        // the swap flushed the fence, it has a file descriptor by now
+        sp<Fence> fence(Fence::NO_FENCE);
+        if (glesDone != EGL_NO_SYNC_KHR) {
+            int fd = eglDupNativeFenceFDANDROID(mEGLDisplay, glesDone);
+            eglDestroySyncKHR(mEGLDisplay, glesDone);
+            if (fd != EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+                fence = new Fence(fd);
+            }
+        }
+        CompositionStats::endGles(fence);
+    }
 }
 
 #ifdef QCOM_BSP
@@ -2025,6 +2117,15 @@ void SurfaceFlinger::doComposeSurfaces(const sp<const DisplayDevice>& hw, const
             return;
         }
 
+        // partial update, keep the rest of the back buffer as it is
+        if (hw->getDisplayType() == DisplayDevice::DISPLAY_PRIMARY) {
+            const Rect scissor(dirty.bounds());
+            if (scissor != hw->getBounds()) {
+                engine.setScissor(scissor.left, hw->getHeight() - scissor.bottom,
+                        scissor.getWidth(), scissor.getHeight());
+            }
+        }
+
         // Never touch the framebuffer if we don't have any framebuffer layers
         if (hasHwcComposition) {
             // when using overlays, we assume a fully transparent framebuffer
@@ -2731,6 +2832,20 @@ status_t SurfaceFlinger::dump(int fd, const Vector<String16>& args)
                 clearStatsLocked(args, index, result);
                 dumpAll = false;
             }
+
+            if ((index < numArgs) &&
+                    (args[index] == String16("--composition-stats"))) {
+                index++;
+                CompositionStats::dump(result);
+                dumpAll = false;
+            }
+
+            if ((index < numArgs) &&
+                    (args[index] == String16("--composition-stats-clear"))) {
+                index++;
+                CompositionStats::reset();
+                dumpAll = false;
+            }
         }
 
         if (dumpAll) {
@@ -2967,12 +3082,18 @@ void SurfaceFlinger::dumpAllLocked(const Vector<String16>& args, size_t& index,
             hwc.initCheck()==NO_ERROR ? "present" : "not present",
                     (mDebugDisableHWC || mDebugRegion || mDaltonize) ? "disabled" : "enabled");
     hwc.dump(result);
+    CompositionStats::dump(result);
 
     /*
      * Dump gralloc state
      */
     const GraphicBufferAllocator& alloc(GraphicBufferAllocator::get());
     alloc.dump(result);
+
+    /*
+     * Dump binder parcel buffer churn
+     */
+    dumpParcelAllocStats(result);
 }
 
 const Vector< sp<Layer> >&
@@ -3380,7 +3501,6 @@ void SurfaceFlinger::renderScreenImplLocked(
     hw->setViewportAndProjection();
 }
 
-
 status_t SurfaceFlinger::captureScreenImplLocked(
         const sp<const DisplayDevice>& hw,
         const sp<IGraphicBufferProducer>& producer,
@@ -3390,10 +3510,25 @@ status_t SurfaceFlinger::captureScreenImplLocked(
 {
     ATRACE_CALL();
 
-	// Rotation artifact problems when useReadPixels is false
-	#ifdef HAWAII_HWC
-    useReadPixels = true;
-	#endif
+    bool yswap = true;
+#ifdef HAWAII_HWC
+    // Rotation artifact problems when rendering straight into the buffer;
+    // pick the orientation the driver actually produces, or fall back to
+    // glReadPixels if it can't be corrected.
+    if (!useReadPixels) {
+        const int mode = HawaiiFboProbe::getMode(getRenderEngine(), mEGLDisplay);
+        hw->setViewportAndProjection();
+        if (mode == HawaiiFboProbe::MODE_UNUSABLE) {
+            useReadPixels = true;
+        } else {
+            yswap = (mode == HawaiiFboProbe::MODE_DIRECT);
+        }
+    }
+#endif
+
+    if (useReadPixels) {
+        CompositionStats::countReadPixelsCapture();
+    }
 
     // get screen geometry
     const uint32_t hw_w = hw->getWidth();
@@ -3426,6 +3561,7 @@ status_t SurfaceFlinger::captureScreenImplLocked(
 
         if (err == NO_ERROR) {
             ANativeWindowBuffer* buffer;
+            int fenceFd = -1;
             /* TODO: Once we have the sync framework everywhere this can use
              * server-side waits on the fence that dequeueBuffer returns.
              */
@@ -3445,27 +3581,48 @@ status_t SurfaceFlinger::captureScreenImplLocked(
                         // an EGLSurface and therefore we're not
                         // dependent on the context's EGLConfig.
                         renderScreenImplLocked(hw, reqWidth, reqHeight,
-                                minLayerZ, maxLayerZ, true);
-
-                        // Create a sync point and wait on it, so we know the buffer is
-                        // ready before we pass it along.  We can't trivially call glFlush(),
-                        // so we use a wait flag instead.
-                        // TODO: pass a sync fd to queueBuffer() and let the consumer wait.
-                        EGLSyncKHR sync = eglCreateSyncKHR(mEGLDisplay, EGL_SYNC_FENCE_KHR, NULL);
-                        if (sync != EGL_NO_SYNC_KHR) {
-                            EGLint result = eglClientWaitSyncKHR(mEGLDisplay, sync,
-                                    EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 2000000000 /*2 sec*/);
-                            EGLint eglErr = eglGetError();
-                            eglDestroySyncKHR(mEGLDisplay, sync);
-                            if (result == EGL_TIMEOUT_EXPIRED_KHR) {
-                                ALOGW("captureScreen: fence wait timed out");
+                                minLayerZ, maxLayerZ, yswap);
+
+                        // When rendering straight into the buffer, hand the consumer
+                        // a native fence instead of stalling the GPU pipeline here.
+                        // A zero-timeout wait with the flush bit flushes the
+                        // commands without blocking.
+                        if (!useReadPixels && SyncFeatures::getInstance().useNativeFenceSync()) {
+                            EGLSyncKHR sync = eglCreateSyncKHR(mEGLDisplay,
+                                    EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+                            if (sync != EGL_NO_SYNC_KHR) {
+                                eglClientWaitSyncKHR(mEGLDisplay, sync,
+                                        EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 0);
+                                fenceFd = eglDupNativeFenceFDANDROID(mEGLDisplay, sync);
+                                eglDestroySyncKHR(mEGLDisplay, sync);
+                            }
+                            if (fenceFd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+                                ALOGW("captureScreen: error creating native fence: %#x",
+                                        eglGetError());
+                                fenceFd = -1;
+                            }
+                        }
+
+                        // Otherwise create a sync point and wait on it, so we know the
+                        // buffer is ready before we pass it along.  We can't trivially
+                        // call glFlush(), so we use a wait flag instead.
+                        if (fenceFd < 0) {
+                            EGLSyncKHR sync = eglCreateSyncKHR(mEGLDisplay, EGL_SYNC_FENCE_KHR, NULL);
+                            if (sync != EGL_NO_SYNC_KHR) {
+                                EGLint result = eglClientWaitSyncKHR(mEGLDisplay, sync,
+                                        EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, 2000000000 /*2 sec*/);
+                                EGLint eglErr = eglGetError();
+                                eglDestroySyncKHR(mEGLDisplay, sync);
+                                if (result == EGL_TIMEOUT_EXPIRED_KHR) {
+                                    ALOGW("captureScreen: fence wait timed out");
+                                } else {
+                                    ALOGW_IF(eglErr != EGL_SUCCESS,
+                                            "captureScreen: error waiting on EGL fence: %#x", eglErr);
+                                }
                             } else {
-                                ALOGW_IF(eglErr != EGL_SUCCESS,
-                                        "captureScreen: error waiting on EGL fence: %#x", eglErr);
+                                ALOGW("captureScreen: error creating EGL fence: %#x", eglGetError());
+                                // not fatal
                             }
-                        } else {
-                            ALOGW("captureScreen: error creating EGL fence: %#x", eglGetError());
-                            // not fatal
                         }
 
                         if (useReadPixels) {
@@ -3494,7 +3651,7 @@ status_t SurfaceFlinger::captureScreenImplLocked(
                 } else {
                     result = BAD_VALUE;
                 }
-                window->queueBuffer(window, buffer, -1);
+                window->queueBuffer(window, buffer, fenceFd);
             }
         } else {
             result = BAD_VALUE;
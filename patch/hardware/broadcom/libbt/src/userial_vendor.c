@@ -27,11 +27,18 @@
 #define LOG_TAG "bt_userial_vendor"
 
 #include <utils/Log.h>
+#include <cutils/properties.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 #include "bt_vendor_brcm.h"
+#include "bt_hci_bdroid.h"
 #include "userial.h"
 #include "userial_vendor.h"
 
@@ -51,6 +58,38 @@
 
 #define VND_PORT_NAME_MAXLEN    256
 
+#ifndef USERIAL_LINK_SWITCH
+#define USERIAL_LINK_SWITCH FALSE
+#endif
+
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+/* Link ops the traffic monitor issues through userial_vendor_ioctl, next
+   to the stock userial_vendor_ioctl_op_t set */
+#define USERIAL_OP_LINK_BUSY    ((userial_vendor_ioctl_op_t)(USERIAL_OP_NOP + 1))
+#define USERIAL_OP_LINK_IDLE    ((userial_vendor_ioctl_op_t)(USERIAL_OP_NOP + 2))
+
+/* UART byte counters are sampled this often */
+#define USERIAL_LINK_POLL_MS        250
+/* bytes/s both ways from which the link is busy (A2DP, FM bursts) */
+#define USERIAL_LINK_BUSY_BPS       8000
+/* below this for USERIAL_LINK_IDLE_MS the link is idle again */
+#define USERIAL_LINK_IDLE_BPS       512
+#define USERIAL_LINK_IDLE_MS        3000
+/* idle baud, still enough for an A2DP stream until the switch back up */
+#define USERIAL_LINK_IDLE_BAUD      USERIAL_BAUD_921600
+/* baud switching is opt-in, BT_WAKE is always held while busy */
+#define USERIAL_LINK_SWITCH_PROP    "persist.bt.link_switch"
+
+#define HCI_VSC_UPDATE_BAUDRATE             0xFC18
+#define UPDATE_BAUDRATE_CMD_PARAM_SIZE      6
+#ifndef HCI_CMD_PREAMBLE_SIZE
+#define HCI_CMD_PREAMBLE_SIZE               3
+#endif
+#ifndef HCI_EVT_CMD_CMPL_STATUS_RET_BYTE
+#define HCI_EVT_CMD_CMPL_STATUS_RET_BYTE    5
+#endif
+#endif
+
 /******************************************************************************
 **  Local type definitions
 ******************************************************************************/
@@ -61,6 +100,21 @@ typedef struct
     int fd;                     /* fd to Bluetooth device */
     struct termios termios;     /* serial terminal of BT port */
     char port_name[VND_PORT_NAME_MAXLEN];
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+    pthread_mutex_t lock;       /* BT_WAKE and link state below */
+    pthread_cond_t cond;
+    int stack_wake;             /* BT_WAKE as the stack's LPM wants it */
+    int wake_asserted;          /* BT_WAKE as set on the line */
+    int armed;                  /* LPM is running, firmware config is done */
+    int busy;
+    uint8_t fast_baud;          /* baud hardware.c configured */
+    uint8_t cur_baud;
+    uint8_t pending_baud;       /* baud command in flight, 0 if none */
+    int baud_switch;            /* USERIAL_LINK_SWITCH_PROP */
+    pthread_t monitor;
+    int monitor_running;
+    int monitor_exit;
+#endif
 } vnd_userial_cb_t;
 
 /******************************************************************************
@@ -146,6 +200,287 @@ void userial_ioctl_init_bt_wake(int fd)
 }
 #endif // (BT_WAKE_VIA_USERIAL_IOCTL==TRUE)
 
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+/*******************************************************************************
+**
+** Function        userial_baud_to_bps
+**
+** Description     helper function converts USERIAL baud rates into bits per
+**                  second, as HCI_VSC_UPDATE_BAUDRATE takes them
+**
+** Returns         bits per second, 0 if unsupported
+**
+*******************************************************************************/
+static uint32_t userial_baud_to_bps(uint8_t cfg_baud)
+{
+    switch (cfg_baud)
+    {
+        case USERIAL_BAUD_115200:   return 115200;
+        case USERIAL_BAUD_230400:   return 230400;
+        case USERIAL_BAUD_460800:   return 460800;
+        case USERIAL_BAUD_921600:   return 921600;
+        case USERIAL_BAUD_1M:       return 1000000;
+        case USERIAL_BAUD_2M:       return 2000000;
+        case USERIAL_BAUD_3M:       return 3000000;
+        case USERIAL_BAUD_4M:       return 4000000;
+        default:                    return 0;
+    }
+}
+
+/*******************************************************************************
+**
+** Function        userial_link_set_wake_l
+**
+** Description     sets BT_WAKE on the line, vnd_userial.lock held. The line
+**                  is asserted while the stack or the traffic monitor wants
+**                  it, so holding it never starves an LPM assert.
+**
+** Returns         none
+**
+*******************************************************************************/
+static void userial_link_set_wake_l(void)
+{
+    int assert = vnd_userial.stack_wake || vnd_userial.busy;
+
+    if (vnd_userial.wake_asserted == assert)
+        return;
+
+    VNDUSERIALDBG("## userial_vendor_ioctl: %s BT_Wake ##", \
+                  assert ? "Asserting" : "De-asserting");
+    ioctl(vnd_userial.fd, assert ? USERIAL_IOCTL_BT_WAKE_ASSERT : \
+          USERIAL_IOCTL_BT_WAKE_DEASSERT, NULL);
+    vnd_userial.wake_asserted = assert;
+}
+
+/*******************************************************************************
+**
+** Function        userial_link_baud_cback
+**
+** Description     Callback function for the baud rate update command, moves
+**                  the host side of the UART to the rate the controller now
+**                  runs at
+**
+** Returns         None
+**
+*******************************************************************************/
+static void userial_link_baud_cback(void *p_mem)
+{
+    HC_BT_HDR *p_evt_buf = (HC_BT_HDR *) p_mem;
+    uint8_t status;
+    uint32_t tcio_baud;
+
+    status = *((uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_STATUS_RET_BYTE);
+    bt_vendor_cbacks->dealloc(p_evt_buf);
+
+    pthread_mutex_lock(&vnd_userial.lock);
+    if (status == 0 && vnd_userial.fd != -1 && vnd_userial.pending_baud)
+    {
+        userial_to_tcio_baud(vnd_userial.pending_baud, &tcio_baud);
+        cfsetospeed(&vnd_userial.termios, tcio_baud);
+        cfsetispeed(&vnd_userial.termios, tcio_baud);
+        tcsetattr(vnd_userial.fd, TCSANOW, &vnd_userial.termios);
+        vnd_userial.cur_baud = vnd_userial.pending_baud;
+        ALOGI("link %s, %d bps", vnd_userial.busy ? "busy" : "idle",
+              userial_baud_to_bps(vnd_userial.cur_baud));
+    }
+    else if (status != 0)
+    {
+        ALOGE("baud rate update failed, status 0x%02x", status);
+    }
+    vnd_userial.pending_baud = 0;
+    pthread_mutex_unlock(&vnd_userial.lock);
+}
+
+/*******************************************************************************
+**
+** Function        userial_link_switch_baud_l
+**
+** Description     Asks the controller for a new baud rate through the stack,
+**                  the same HCI_VSC_UPDATE_BAUDRATE hardware.c sends at the
+**                  end of firmware config. vnd_userial.lock held, dropped
+**                  around the transmit.
+**
+** Returns         None
+**
+*******************************************************************************/
+static void userial_link_switch_baud_l(uint8_t baud)
+{
+    HC_BT_HDR *p_buf;
+    uint8_t *p;
+    uint32_t bps = userial_baud_to_bps(baud);
+
+    if (!vnd_userial.baud_switch || vnd_userial.pending_baud || !bps || \
+        baud == vnd_userial.cur_baud || bt_vendor_cbacks == NULL)
+        return;
+
+    p_buf = (HC_BT_HDR *) bt_vendor_cbacks->alloc(BT_HC_HDR_SIZE + \
+                HCI_CMD_PREAMBLE_SIZE + UPDATE_BAUDRATE_CMD_PARAM_SIZE);
+    if (p_buf == NULL)
+        return;
+
+    p_buf->event = MSG_STACK_TO_HC_HCI_CMD;
+    p_buf->offset = 0;
+    p_buf->layer_specific = 0;
+    p_buf->len = HCI_CMD_PREAMBLE_SIZE + UPDATE_BAUDRATE_CMD_PARAM_SIZE;
+
+    p = (uint8_t *) (p_buf + 1);
+    *p++ = (uint8_t) HCI_VSC_UPDATE_BAUDRATE;
+    *p++ = (uint8_t) (HCI_VSC_UPDATE_BAUDRATE >> 8);
+    *p++ = UPDATE_BAUDRATE_CMD_PARAM_SIZE;
+    *p++ = 0; /* Encoded baud rate */
+    *p++ = 0; /* use Encoded form */
+    *p++ = (uint8_t) bps;
+    *p++ = (uint8_t) (bps >> 8);
+    *p++ = (uint8_t) (bps >> 16);
+    *p++ = (uint8_t) (bps >> 24);
+
+    vnd_userial.pending_baud = baud;
+    pthread_mutex_unlock(&vnd_userial.lock);
+
+    if (bt_vendor_cbacks->xmit_cb(HCI_VSC_UPDATE_BAUDRATE, p_buf, \
+                                  userial_link_baud_cback) == FALSE)
+    {
+        bt_vendor_cbacks->dealloc(p_buf);
+        pthread_mutex_lock(&vnd_userial.lock);
+        vnd_userial.pending_baud = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&vnd_userial.lock);
+}
+
+/*******************************************************************************
+**
+** Function        userial_link_monitor
+**
+** Description     Samples the UART byte counters and reports busy and idle
+**                  edges through userial_vendor_ioctl
+**
+** Returns         None
+**
+*******************************************************************************/
+static void *userial_link_monitor(void *arg)
+{
+    struct serial_icounter_struct icount;
+    struct timespec ts;
+    uint32_t bytes, last = 0;
+    uint32_t bps;
+    int have_last = 0;
+    int quiet_ms = 0;
+    int busy;
+
+    pthread_mutex_lock(&vnd_userial.lock);
+    while (!vnd_userial.monitor_exit)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += USERIAL_LINK_POLL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&vnd_userial.cond, &vnd_userial.lock, &ts);
+        if (vnd_userial.monitor_exit)
+            break;
+
+        if (ioctl(vnd_userial.fd, TIOCGICOUNT, &icount) < 0)
+        {
+            ALOGW("no UART counters (%s), link monitor stopped", \
+                  strerror(errno));
+            break;
+        }
+
+        bytes = (uint32_t) icount.rx + (uint32_t) icount.tx;
+        bps = have_last ? (bytes - last) * 1000 / USERIAL_LINK_POLL_MS : 0;
+        last = bytes;
+        have_last = 1;
+
+        if (!vnd_userial.armed)
+            continue;
+
+        busy = vnd_userial.busy;
+        pthread_mutex_unlock(&vnd_userial.lock);
+
+        if (!busy && bps >= USERIAL_LINK_BUSY_BPS)
+        {
+            quiet_ms = 0;
+            userial_vendor_ioctl(USERIAL_OP_LINK_BUSY, NULL);
+        }
+        else if (busy)
+        {
+            quiet_ms = bps < USERIAL_LINK_IDLE_BPS ? \
+                       quiet_ms + USERIAL_LINK_POLL_MS : 0;
+            if (quiet_ms >= USERIAL_LINK_IDLE_MS)
+                userial_vendor_ioctl(USERIAL_OP_LINK_IDLE, NULL);
+        }
+
+        pthread_mutex_lock(&vnd_userial.lock);
+    }
+    pthread_mutex_unlock(&vnd_userial.lock);
+
+    return NULL;
+}
+
+/*******************************************************************************
+**
+** Function        userial_link_start
+**
+** Description     resets the link state for a newly opened port and starts
+**                  the traffic monitor
+**
+** Returns         None
+**
+*******************************************************************************/
+static void userial_link_start(uint8_t baud)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_lock(&vnd_userial.lock);
+    vnd_userial.stack_wake = 1;     /* userial_ioctl_init_bt_wake */
+    vnd_userial.wake_asserted = 1;
+    vnd_userial.armed = 0;
+    vnd_userial.busy = 0;
+    vnd_userial.fast_baud = baud;
+    vnd_userial.cur_baud = baud;
+    vnd_userial.pending_baud = 0;
+    property_get(USERIAL_LINK_SWITCH_PROP, value, "0");
+    vnd_userial.baud_switch = (strcmp(value, "1") == 0);
+    vnd_userial.monitor_exit = 0;
+    pthread_mutex_unlock(&vnd_userial.lock);
+
+    if (pthread_create(&vnd_userial.monitor, NULL, userial_link_monitor, \
+                       NULL) != 0)
+    {
+        ALOGE("link monitor thread failed");
+        return;
+    }
+    vnd_userial.monitor_running = 1;
+}
+
+/*******************************************************************************
+**
+** Function        userial_link_stop
+**
+** Description     stops the traffic monitor before the port goes away
+**
+** Returns         None
+**
+*******************************************************************************/
+static void userial_link_stop(void)
+{
+    if (!vnd_userial.monitor_running)
+        return;
+
+    pthread_mutex_lock(&vnd_userial.lock);
+    vnd_userial.monitor_exit = 1;
+    pthread_cond_signal(&vnd_userial.cond);
+    pthread_mutex_unlock(&vnd_userial.lock);
+
+    pthread_join(vnd_userial.monitor, NULL);
+    vnd_userial.monitor_running = 0;
+}
+#endif // (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+
 
 /*****************************************************************************
 **   Userial Vendor API Functions
@@ -165,6 +500,11 @@ void userial_vendor_init(void)
     vnd_userial.fd = -1;
     snprintf(vnd_userial.port_name, VND_PORT_NAME_MAXLEN, "%s", \
             BLUETOOTH_UART_DEVICE_PORT);
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+    pthread_mutex_init(&vnd_userial.lock, NULL);
+    pthread_cond_init(&vnd_userial.cond, NULL);
+    vnd_userial.monitor_running = 0;
+#endif
 }
 
 /*******************************************************************************
@@ -266,6 +606,10 @@ int userial_vendor_open(tUSERIAL_CFG *p_cfg)
     userial_ioctl_init_bt_wake(vnd_userial.fd);
 #endif
 
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+    userial_link_start(p_cfg->baud);
+#endif
+
     ALOGI("device fd = %d open", vnd_userial.fd);
 
     return vnd_userial.fd;
@@ -287,6 +631,10 @@ void userial_vendor_close(void)
     if (vnd_userial.fd == -1)
         return;
 
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+    userial_link_stop();
+#endif
+
 #if (BT_WAKE_VIA_USERIAL_IOCTL==TRUE)
     /* de-assert bt_wake BEFORE closing port */
     ioctl(vnd_userial.fd, USERIAL_IOCTL_BT_WAKE_DEASSERT, NULL);
@@ -318,6 +666,14 @@ void userial_vendor_set_baud(uint8_t userial_baud)
     cfsetospeed(&vnd_userial.termios, tcio_baud);
     cfsetispeed(&vnd_userial.termios, tcio_baud);
     tcsetattr(vnd_userial.fd, TCSANOW, &vnd_userial.termios);
+
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+    /* the last rate hardware.c sets is the one to stream at */
+    pthread_mutex_lock(&vnd_userial.lock);
+    vnd_userial.fast_baud = userial_baud;
+    vnd_userial.cur_baud = userial_baud;
+    pthread_mutex_unlock(&vnd_userial.lock);
+#endif
 }
 
 /*******************************************************************************
@@ -331,9 +687,40 @@ void userial_vendor_set_baud(uint8_t userial_baud)
 *******************************************************************************/
 void userial_vendor_ioctl(userial_vendor_ioctl_op_t op, void *p_data)
 {
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+    if (op == USERIAL_OP_LINK_BUSY || op == USERIAL_OP_LINK_IDLE)
+    {
+        /* busy: stream rate, BT_WAKE held. idle: slow down and drop a
+           BT_WAKE the LPM already let go of right away */
+        pthread_mutex_lock(&vnd_userial.lock);
+        vnd_userial.busy = (op == USERIAL_OP_LINK_BUSY);
+        userial_link_set_wake_l();
+        userial_link_switch_baud_l(vnd_userial.busy ? vnd_userial.fast_baud : \
+                                   USERIAL_LINK_IDLE_BAUD);
+        pthread_mutex_unlock(&vnd_userial.lock);
+        return;
+    }
+#endif
+
     switch(op)
     {
-#if (BT_WAKE_VIA_USERIAL_IOCTL==TRUE)
+#if (USERIAL_LINK_SWITCH == TRUE) && (BT_WAKE_VIA_USERIAL_IOCTL == TRUE)
+        case USERIAL_OP_ASSERT_BT_WAKE:
+        case USERIAL_OP_DEASSERT_BT_WAKE:
+            /* the LPM only runs once firmware config is done */
+            pthread_mutex_lock(&vnd_userial.lock);
+            vnd_userial.stack_wake = (op == USERIAL_OP_ASSERT_BT_WAKE);
+            vnd_userial.armed = 1;
+            if (!vnd_userial.stack_wake && vnd_userial.busy)
+                VNDUSERIALDBG("## userial_vendor_ioctl: BT_Wake held, link busy ##");
+            userial_link_set_wake_l();
+            pthread_mutex_unlock(&vnd_userial.lock);
+            break;
+
+        case USERIAL_OP_GET_BT_WAKE_STATE:
+            ioctl(vnd_userial.fd, USERIAL_IOCTL_BT_WAKE_GET_ST, p_data);
+            break;
+#elif (BT_WAKE_VIA_USERIAL_IOCTL==TRUE)
         case USERIAL_OP_ASSERT_BT_WAKE:
             VNDUSERIALDBG("## userial_vendor_ioctl: Asserting BT_Wake ##");
             ioctl(vnd_userial.fd, USERIAL_IOCTL_BT_WAKE_ASSERT, NULL);
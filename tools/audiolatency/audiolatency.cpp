@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Round-trip audio latency: plays short tone bursts through the loudspeaker
+ * and times them until the built-in mic picks them up, once through a
+ * normal track and once through an AUDIO_OUTPUT_FLAG_FAST track (on the
+ * low_latency output if audio.hawaii.low_latency=1). The time covers the app write
+ * to the HAL, the acoustic path and the capture path back to the app.
+ *
+ *   adb shell audiolatency [pulses]
+ *
+ * Check "dumpsys media.audio_flinger" afterwards for underruns on the
+ * low_latency output.
+ */
+
+#define LOG_TAG "audiolatency"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <binder/ProcessState.h>
+#include <media/AudioRecord.h>
+#include <media/AudioTrack.h>
+#include <utils/Timers.h>
+
+using namespace android;
+
+static const uint32_t SAMPLE_RATE = 48000;      // low_latency output rate
+static const size_t CHUNK_FRAMES = 96;          // 2 ms
+static const size_t PULSE_FRAMES = 240;         // 5 ms tone burst
+static const int PULSE_INTERVAL_MS = 500;
+static const int16_t DETECT_LEVEL = 8000;
+
+struct Capture {
+    sp<AudioRecord> record;
+    volatile bool running;
+    volatile bool armed;                        // a pulse was sent
+    volatile nsecs_t detectedAt;                // 0 until it shows up
+};
+
+static void* captureLoop(void* arg) {
+    Capture* c = static_cast<Capture*>(arg);
+    int16_t buf[CHUNK_FRAMES];
+
+    while (c->running) {
+        ssize_t n = c->record->read(buf, sizeof(buf));
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (n <= 0) {
+            continue;
+        }
+        size_t frames = n / sizeof(int16_t);
+        if (!c->armed || c->detectedAt) {
+            continue;
+        }
+        for (size_t i = 0; i < frames; i++) {
+            if (abs(buf[i]) >= DETECT_LEVEL) {
+                // the sample was captured this long before read() returned
+                c->detectedAt = now - nsecs_t(frames - i) * 1000000000LL / SAMPLE_RATE;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Plays |pulses| bursts on a track with |flags| and prints the round trip
+// of each. Returns the number of pulses detected.
+static int measure(Capture* c, audio_output_flags_t flags, int pulses) {
+    sp<AudioTrack> track = new AudioTrack(AUDIO_STREAM_MUSIC, SAMPLE_RATE,
+            AUDIO_FORMAT_PCM_16_BIT, AUDIO_CHANNEL_OUT_STEREO, 0, flags);
+    if (track->initCheck() != NO_ERROR) {
+        fprintf(stderr, "AudioTrack init failed\n");
+        return 0;
+    }
+    printf("%s track: %zu frames buffer, reported latency %u ms\n",
+            (flags & AUDIO_OUTPUT_FLAG_FAST) ? "fast" : "normal",
+            (size_t)track->frameCount(), track->latency());
+
+    int16_t silence[CHUNK_FRAMES * 2];
+    int16_t pulse[PULSE_FRAMES * 2];
+    memset(silence, 0, sizeof(silence));
+    for (size_t i = 0; i < PULSE_FRAMES; i++) {
+        int16_t v = int16_t(16000 * sin(2 * M_PI * 1000 * i / SAMPLE_RATE));
+        pulse[2 * i] = pulse[2 * i + 1] = v;
+    }
+
+    track->start();
+    int found = 0;
+    double sum = 0, min = 1e9, max = 0;
+    for (int p = 0; p < pulses; p++) {
+        // fill the gap with silence, keeps the track from underrunning
+        nsecs_t gapEnd = systemTime(SYSTEM_TIME_MONOTONIC) + ms2ns(PULSE_INTERVAL_MS);
+        while (systemTime(SYSTEM_TIME_MONOTONIC) < gapEnd) {
+            track->write(silence, sizeof(silence));
+        }
+
+        c->detectedAt = 0;
+        c->armed = true;
+        nsecs_t sentAt = systemTime(SYSTEM_TIME_MONOTONIC);
+        track->write(pulse, sizeof(pulse));
+
+        // wait for it while keeping the track fed
+        nsecs_t timeout = sentAt + ms2ns(PULSE_INTERVAL_MS);
+        while (!c->detectedAt && systemTime(SYSTEM_TIME_MONOTONIC) < timeout) {
+            track->write(silence, sizeof(silence));
+        }
+        c->armed = false;
+
+        if (!c->detectedAt) {
+            printf("  pulse %2d: not detected\n", p);
+            continue;
+        }
+        double ms = double(c->detectedAt - sentAt) / 1000000.0;
+        printf("  pulse %2d: %6.1f ms\n", p, ms);
+        sum += ms;
+        min = ms < min ? ms : min;
+        max = ms > max ? ms : max;
+        found++;
+    }
+    track->stop();
+
+    if (found) {
+        printf("  round trip: min %.1f, avg %.1f, max %.1f ms (%d/%d pulses)\n",
+                min, sum / found, max, found, pulses);
+    }
+    return found;
+}
+
+int main(int argc, char** argv) {
+    int pulses = argc > 1 ? atoi(argv[1]) : 10;
+    if (pulses <= 0) {
+        fprintf(stderr, "usage: %s [pulses]\n", argv[0]);
+        return 1;
+    }
+
+    ProcessState::self()->startThreadPool();
+
+    Capture c;
+    c.record = new AudioRecord(AUDIO_SOURCE_MIC, SAMPLE_RATE, AUDIO_FORMAT_PCM_16_BIT,
+            AUDIO_CHANNEL_IN_MONO);
+    if (c.record->initCheck() != NO_ERROR) {
+        fprintf(stderr, "AudioRecord init failed\n");
+        return 1;
+    }
+    c.running = true;
+    c.armed = false;
+    c.detectedAt = 0;
+    c.record->start();
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, captureLoop, &c);
+
+    int found = measure(&c, AUDIO_OUTPUT_FLAG_NONE, pulses);
+    found += measure(&c, AUDIO_OUTPUT_FLAG_FAST, pulses);
+
+    c.running = false;
+    pthread_join(thread, NULL);
+    c.record->stop();
+
+    return found ? 0 : 1;
+}
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput of the patched stagefright color conversion: every
+ * ColorConverter kernel, then SoftwareRenderer::render() for the same
+ * formats (the YV12 copy paths for YUV420Planar and TI packed semi-planar,
+ * the converter into an RGB565 window for the rest), at the panel size,
+ * 720p and a decoder-style odd crop.
+ *
+ *   adb shell colorbench [-n iterations] [-s stripes] [-c] [-r]
+ *
+ *   -n  timed iterations per case (default 50, after 3 warm-up runs)
+ *   -s  ColorConverter stripe count (default 1, the caller's thread only)
+ *   -c  converter kernels only, -r  render paths only
+ *
+ * Output is CSV on stdout, one row per case, lines starting with '#' carry
+ * the run settings. Cycles come from the CPU cycle counter of the calling
+ * thread ("pmu"); when that isn't available, or the work is spread over
+ * stripe workers, they are estimated from the current cpu0 clock ("freq"),
+ * so pin the governor for numbers that compare across builds.
+ */
+
+#define LOG_TAG "colorbench"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include <binder/ProcessState.h>
+#include <gui/Surface.h>
+#include <gui/SurfaceComposerClient.h>
+#include <media/stagefright/ColorConverter.h>
+#include <media/stagefright/MetaData.h>
+#include <system/window.h>
+#include <utils/Timers.h>
+
+#include "include/SoftwareRenderer.h"
+
+using namespace android;
+
+static const int WARMUP_ITERATIONS = 3;
+
+struct Format {
+    const char* name;
+    OMX_COLOR_FORMATTYPE format;
+    bool packed422;                 // 2 bytes per pixel, otherwise 4:2:0
+};
+
+static const Format kFormats[] = {
+    { "YUV420Planar",               OMX_COLOR_FormatYUV420Planar,               false },
+    { "CbYCrY",                     OMX_COLOR_FormatCbYCrY,                     true  },
+    { "YCbYCr",                     OMX_COLOR_FormatYCbYCr,                     true  },
+    { "YUV420SemiPlanar",           OMX_COLOR_FormatYUV420SemiPlanar,           false },
+    { "QCOMYUV420SemiPlanar",       OMX_QCOM_COLOR_FormatYVU420SemiPlanar,      false },
+    { "TIYUV420PackedSemiPlanar",   OMX_TI_COLOR_FormatYUV420PackedSemiPlanar,  false },
+};
+
+struct Geometry {
+    const char* name;
+    size_t width, height;           // decoded buffer
+    size_t cropLeft, cropTop;       // cropLeft must stay even
+    size_t cropWidth, cropHeight;
+};
+
+static const Geometry kGeometries[] = {
+    { "480x800",    480,  800, 0, 0,  480, 800 },
+    { "720p",      1280,  720, 0, 0, 1280, 720 },
+    // 854x480 content in a macroblock aligned buffer, cropped to odd sizes
+    { "odd-crop",   864,  496, 2, 1,  853, 479 },
+};
+
+// Cycle counter of the calling thread, if the kernel exposes the PMU.
+class CycleCounter {
+public:
+    CycleCounter() : mFd(-1) {
+#ifdef __NR_perf_event_open
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        mFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~CycleCounter() {
+        if (mFd >= 0) {
+            close(mFd);
+        }
+    }
+
+    bool available() const { return mFd >= 0; }
+
+    uint64_t read() const {
+        uint64_t cycles = 0;
+        if (mFd >= 0 && ::read(mFd, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+            cycles = 0;
+        }
+        return cycles;
+    }
+
+private:
+    int mFd;
+};
+
+static CycleCounter* gCycles;
+static size_t gIterations = 50;
+static size_t gStripes = 1;
+
+static uint64_t currentCpuHz() {
+    uint64_t khz = 0;
+    FILE* f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+    if (f) {
+        unsigned long long v;
+        if (fscanf(f, "%llu", &v) == 1) {
+            khz = v;
+        }
+        fclose(f);
+    }
+    return khz * 1000;
+}
+
+static size_t frameSize(const Format& fmt, const Geometry& geo) {
+    size_t pixels = geo.width * geo.height;
+    return fmt.packed422 ? pixels * 2 : pixels * 3 / 2;
+}
+
+// Smooth gradients with some noise, so the clip table sees the whole range.
+static void fillFrame(uint8_t* data, size_t size) {
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = uint8_t((i >> 3) + ((seed >> 24) & 0x1f));
+    }
+}
+
+static void printHeader(bool pmu) {
+    printf("# colorbench iterations=%zu warmup=%d stripes=%zu cycles=%s cpu0_hz=%llu\n",
+            gIterations, WARMUP_ITERATIONS, gStripes, pmu ? "pmu" : "freq",
+            (unsigned long long)currentCpuHz());
+    printf("path,format,geometry,width,height,crop_width,crop_height,"
+            "iterations,status,us_per_frame,mpix_per_s,cycles_per_pixel,cycles_source\n");
+}
+
+struct Timing {
+    nsecs_t start;
+    uint64_t startCycles;
+    bool pmu;
+
+    void begin(bool usePmu) {
+        pmu = usePmu && gCycles->available();
+        startCycles = pmu ? gCycles->read() : 0;
+        start = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+
+    void report(const char* path, const Format& fmt, const Geometry& geo) {
+        nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        uint64_t cycles = pmu ? gCycles->read() - startCycles
+                : uint64_t(double(currentCpuHz()) * elapsed / 1e9);
+        double pixels = double(geo.cropWidth) * geo.cropHeight * gIterations;
+        double seconds = elapsed / 1e9;
+
+        printf("%s,%s,%s,%zu,%zu,%zu,%zu,%zu,0,%.1f,%.2f,%.2f,%s\n",
+                path, fmt.name, geo.name, geo.width, geo.height,
+                geo.cropWidth, geo.cropHeight, gIterations,
+                seconds * 1e6 / gIterations, pixels / seconds / 1e6,
+                cycles / pixels, pmu ? "pmu" : "freq");
+    }
+};
+
+static void printError(const char* path, const Format& fmt, const Geometry& geo,
+        status_t err) {
+    printf("%s,%s,%s,%zu,%zu,%zu,%zu,0,%d,,,,\n",
+            path, fmt.name, geo.name, geo.width, geo.height,
+            geo.cropWidth, geo.cropHeight, err);
+}
+
+static void benchConvert(const Format& fmt, const Geometry& geo) {
+    ColorConverter converter(fmt.format, OMX_COLOR_Format16bitRGB565);
+    if (!converter.isValid()) {
+        printError("convert", fmt, geo, INVALID_OPERATION);
+        return;
+    }
+    converter.setStripeCount(gStripes);
+
+    size_t size = frameSize(fmt, geo);
+    uint8_t* src = new uint8_t[size];
+    fillFrame(src, size);
+
+    // the kernels write pixel pairs, keep an even stride for odd crops
+    size_t dstWidth = (geo.cropWidth + 1) & ~1;
+    uint16_t* dst = new uint16_t[dstWidth * geo.cropHeight];
+
+    status_t err = OK;
+    Timing t;
+    for (size_t i = 0; i < WARMUP_ITERATIONS + gIterations && err == OK; i++) {
+        if (i == WARMUP_ITERATIONS) {
+            t.begin(gStripes <= 1);
+        }
+        err = converter.convert(src, geo.width, geo.height,
+                geo.cropLeft, geo.cropTop,
+                geo.cropLeft + geo.cropWidth - 1, geo.cropTop + geo.cropHeight - 1,
+                dst, dstWidth, geo.cropHeight,
+                0, 0, geo.cropWidth - 1, geo.cropHeight - 1);
+    }
+    if (err == OK) {
+        t.report("convert", fmt, geo);
+    } else {
+        printError("convert", fmt, geo, err);
+    }
+
+    delete[] dst;
+    delete[] src;
+}
+
+static void benchRender(const sp<SurfaceComposerClient>& client,
+        const Format& fmt, const Geometry& geo) {
+    sp<SurfaceControl> control = client->createSurface(String8("colorbench"),
+            geo.cropWidth, geo.cropHeight, PIXEL_FORMAT_RGB_565, 0);
+    if (control == NULL || !control->isValid()) {
+        printError("render", fmt, geo, NO_INIT);
+        return;
+    }
+    // latched and released by SurfaceFlinger but never composed
+    SurfaceComposerClient::openGlobalTransaction();
+    control->hide();
+    SurfaceComposerClient::closeGlobalTransaction();
+
+    sp<ANativeWindow> window = control->getSurface();
+    status_t err = native_window_api_connect(window.get(), NATIVE_WINDOW_API_MEDIA);
+    if (err != OK) {
+        printError("render", fmt, geo, err);
+        return;
+    }
+
+    sp<MetaData> meta = new MetaData;
+    meta->setInt32(kKeyColorFormat, fmt.format);
+    meta->setInt32(kKeyWidth, geo.width);
+    meta->setInt32(kKeyHeight, geo.height);
+    meta->setRect(kKeyCropRect, geo.cropLeft, geo.cropTop,
+            geo.cropLeft + geo.cropWidth - 1, geo.cropTop + geo.cropHeight - 1);
+
+    size_t size = frameSize(fmt, geo);
+    uint8_t* src = new uint8_t[size];
+    fillFrame(src, size);
+
+    {
+        SoftwareRenderer renderer(window, meta);
+        Timing t;
+        for (size_t i = 0; i < WARMUP_ITERATIONS + gIterations; i++) {
+            if (i == WARMUP_ITERATIONS) {
+                t.begin(gStripes <= 1);
+            }
+            renderer.render(src, size, NULL);
+        }
+        t.report("render", fmt, geo);
+    }
+
+    delete[] src;
+    native_window_api_disconnect(window.get(), NATIVE_WINDOW_API_MEDIA);
+}
+
+static void usage(const char* me) {
+    fprintf(stderr, "usage: %s [-n iterations] [-s stripes] [-c] [-r]\n", me);
+}
+
+int main(int argc, char** argv) {
+    bool doConvert = true;
+    bool doRender = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:cr")) != -1) {
+        switch (opt) {
+            case 'n': gIterations = atoi(optarg); break;
+            case 's': gStripes = atoi(optarg); break;
+            case 'c': doRender = false; break;
+            case 'r': doConvert = false; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (gIterations == 0 || (!doConvert && !doRender)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CycleCounter cycles;
+    gCycles = &cycles;
+    printHeader(cycles.available() && gStripes <= 1);
+
+    const size_t formats = sizeof(kFormats) / sizeof(kFormats[0]);
+    const size_t geometries = sizeof(kGeometries) / sizeof(kGeometries[0]);
+
+    if (doConvert) {
+        for (size_t f = 0; f < formats; f++) {
+            for (size_t g = 0; g < geometries; g++) {
+                benchConvert(kFormats[f], kGeometries[g]);
+            }
+        }
+    }
+
+    if (doRender) {
+        ProcessState::self()->startThreadPool();
+        sp<SurfaceComposerClient> client = new SurfaceComposerClient;
+        if (client->initCheck() != NO_ERROR) {
+            fprintf(stderr, "can't connect to SurfaceFlinger\n");
+            return 1;
+        }
+        for (size_t f = 0; f < formats; f++) {
+            for (size_t g = 0; g < geometries; g++) {
+                benchRender(client, kFormats[f], kGeometries[g]);
+            }
+        }
+        client->dispose();
+    }
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares moving a payload through a binder transaction in place against
+ * passing it in an ashmem region (Parcel::writeBlob/readBlob), at several
+ * payload sizes. The receiving side maps or reads the blob and touches
+ * every page, like a real consumer would. Up to the blob in-place limit
+ * (40k) both columns measure the in-place path.
+ *
+ * Needs to run as root to register its service:
+ *   adb shell parcelbench [iterations]
+ */
+
+#define LOG_TAG "parcelbench"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <binder/Binder.h>
+#include <binder/IPCThreadState.h>
+#include <binder/IServiceManager.h>
+#include <binder/Parcel.h>
+#include <binder/ProcessState.h>
+
+#include <utils/String16.h>
+#include <utils/Timers.h>
+
+using namespace android;
+
+static const char* const SERVICE_NAME = "parcelbench";
+
+enum {
+    TRANSACT_BLOB = IBinder::FIRST_CALL_TRANSACTION,
+};
+
+static const size_t PAYLOAD_SIZES[] = {
+    4 * 1024, 16 * 1024, 40 * 1024, 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024,
+};
+
+// ---------------------------------------------------------------------------
+
+class BenchService : public BBinder {
+protected:
+    virtual status_t onTransact(uint32_t code, const Parcel& data, Parcel* reply,
+            uint32_t flags) {
+        if (code != TRANSACT_BLOB) {
+            return BBinder::onTransact(code, data, reply, flags);
+        }
+        uint32_t len = data.readInt32();
+        Parcel::ReadableBlob blob;
+        status_t err = data.readBlob(len, &blob);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        const uint8_t* p = static_cast<const uint8_t*>(blob.data());
+        uint32_t sum = 0;
+        for (size_t i = 0; i < len; i += 4096) {
+            sum += p[i];
+        }
+        blob.release();
+        reply->writeInt32(sum);
+        return NO_ERROR;
+    }
+};
+
+static void runService() {
+    sp<ProcessState> proc(ProcessState::self());
+    defaultServiceManager()->addService(String16(SERVICE_NAME), new BenchService());
+    IPCThreadState::self()->joinThreadPool();
+}
+
+// ---------------------------------------------------------------------------
+
+static sp<IBinder> waitForService() {
+    sp<IServiceManager> sm(defaultServiceManager());
+    for (int i = 0; i < 50; i++) {
+        sp<IBinder> binder = sm->checkService(String16(SERVICE_NAME));
+        if (binder != NULL) {
+            return binder;
+        }
+        usleep(100000);
+    }
+    return NULL;
+}
+
+// Returns the mean time of one transaction in us, or -1 on failure.
+static double runOne(const sp<IBinder>& binder, size_t len, bool inPlace, int iterations) {
+    nsecs_t total = 0;
+    for (int i = 0; i < iterations; i++) {
+        Parcel data, reply;
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        // writeBlob goes to ashmem above its in-place limit unless fds
+        // are disallowed
+        bool allowFds = data.pushAllowFds(!inPlace);
+        data.writeInt32(len);
+        Parcel::WritableBlob blob;
+        status_t err = data.writeBlob(len, &blob);
+        data.restoreAllowFds(allowFds);
+        if (err != NO_ERROR) {
+            fprintf(stderr, "writeBlob(%zu) failed: %d\n", len, err);
+            return -1;
+        }
+        memset(blob.data(), i & 0xff, len);
+        blob.release();
+
+        err = binder->transact(TRANSACT_BLOB, data, &reply);
+        if (err != NO_ERROR) {
+            fprintf(stderr, "transact(%zu) failed: %d\n", len, err);
+            return -1;
+        }
+        total += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    }
+    return double(total) / iterations / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        runService();
+        _exit(0);
+    }
+
+    sp<ProcessState> proc(ProcessState::self());
+    proc->startThreadPool();
+    sp<IBinder> binder = waitForService();
+    if (binder == NULL) {
+        fprintf(stderr, "%s service didn't show up (not root?)\n", SERVICE_NAME);
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        return 1;
+    }
+
+    printf("%10s %14s %14s %10s\n", "bytes", "in place (us)", "ashmem (us)", "speedup");
+    int status = 0;
+    for (size_t i = 0; i < sizeof(PAYLOAD_SIZES) / sizeof(PAYLOAD_SIZES[0]); i++) {
+        const size_t len = PAYLOAD_SIZES[i];
+        double inPlace = runOne(binder, len, true, iterations);
+        double ashmem = runOne(binder, len, false, iterations);
+        if (inPlace < 0 || ashmem < 0) {
+            status = 1;
+            break;
+        }
+        printf("%10zu %14.1f %14.1f %9.2fx\n", len, inPlace, ashmem, inPlace / ashmem);
+    }
+
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return status;
+}